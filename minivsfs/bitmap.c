@@ -0,0 +1,182 @@
+#include "bitmap.h"
+
+#include <string.h>
+
+#include "stats.h"
+
+static void mark_dirty(bitmap_t* bm, uint64_t start, uint64_t len) {
+    if (len == 0) return;
+    if (start < bm->dirty_lo) bm->dirty_lo = start;
+    if (start + len - 1 > bm->dirty_hi || bm->dirty_lo > bm->dirty_hi) bm->dirty_hi = start + len - 1;
+}
+
+// Little-endian 64-bit load; compiles to a single load on x86-64/arm64
+static uint64_t load_word(const uint8_t* bits, uint64_t word) {
+    const uint8_t* p = bits + word * 8;
+    uint64_t w = 0;
+    for (int i = 7; i >= 0; i--) w = (w << 8) | p[i];
+    return w;
+}
+
+// Set bits in [start, start + len)
+static uint64_t count_set(const bitmap_t* bm, uint64_t start, uint64_t len) {
+    uint64_t end = start + len, set = 0;
+    while (start < end) {
+        uint64_t w = load_word(bm->bits, start / 64) >> (start % 64);
+        uint64_t n = 64 - start % 64 < end - start ? 64 - start % 64 : end - start;
+        if (n < 64) w &= (1ull << n) - 1;
+        set += (uint64_t)__builtin_popcountll(w);
+        start += n;
+    }
+    return set;
+}
+
+void bitmap_init_counted(bitmap_t* bm, uint8_t* bits, uint64_t nbits, uint64_t free, uint64_t first_free) {
+    bm->bits = bits;
+    bm->nbits = nbits;
+    bm->hint = first_free;
+    bm->free = free;
+    bm->low = first_free;
+    bitmap_clean(bm);
+}
+
+void bitmap_init(bitmap_t* bm, uint8_t* bits, uint64_t nbits) {
+    bitmap_init_counted(bm, bits, nbits, 0, 0);
+    bm->free = bitmap_count_free(bm);
+}
+
+void bitmap_clean(bitmap_t* bm) {
+    bm->dirty_lo = UINT64_MAX;
+    bm->dirty_hi = 0;
+}
+
+int bitmap_test(const bitmap_t* bm, uint64_t bit) {
+    return (bm->bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+void bitmap_set(bitmap_t* bm, uint64_t bit) {
+    if (!bitmap_test(bm, bit)) bm->free--;
+    bm->bits[bit / 8] |= (uint8_t)(1u << (bit % 8));
+    mark_dirty(bm, bit, 1);
+}
+
+void bitmap_set_range(bitmap_t* bm, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    bm->free -= len - count_set(bm, start, len);
+    mark_dirty(bm, start, len);
+    for (; start < end && start % 8; start++) bm->bits[start / 8] |= (uint8_t)(1u << (start % 8));
+    if (end - start >= 8) {
+        memset(bm->bits + start / 8, 0xFF, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    for (; start < end; start++) bm->bits[start / 8] |= (uint8_t)(1u << (start % 8));
+}
+
+void bitmap_clear_range(bitmap_t* bm, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    bm->free += count_set(bm, start, len);
+    if (len > 0 && start < bm->low) bm->low = start;
+    mark_dirty(bm, start, len);
+    for (; start < end && start % 8; start++) bm->bits[start / 8] &= (uint8_t)~(1u << (start % 8));
+    if (end - start >= 8) {
+        memset(bm->bits + start / 8, 0x00, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    for (; start < end; start++) bm->bits[start / 8] &= (uint8_t)~(1u << (start % 8));
+}
+
+int64_t bitmap_find(const bitmap_t* bm, uint64_t from, uint64_t to, int value) {
+    if (to > bm->nbits) to = bm->nbits;
+    uint64_t words = 0;
+    while (from < to) {
+        uint64_t w = load_word(bm->bits, from / 64);
+        words++;
+        if (!value) w = ~w;
+        w &= ~0ull << (from % 64); // ignore bits below `from`
+        if (w) {
+            uint64_t bit = (from & ~63ull) + (uint64_t)__builtin_ctzll(w);
+            stats_add(STAT_BITMAP_WORDS, words);
+            return bit < to ? (int64_t)bit : -1;
+        }
+        from = (from & ~63ull) + 64;
+    }
+    stats_add(STAT_BITMAP_WORDS, words);
+    return -1;
+}
+
+int64_t bitmap_find_run(const bitmap_t* bm, uint64_t from, uint64_t to, uint64_t len) {
+    if (to > bm->nbits) to = bm->nbits;
+    while (from < to && to - from >= len) {
+        int64_t run_start = bitmap_find(bm, from, to, 0);
+        if (run_start < 0 || to - (uint64_t)run_start < len) return -1;
+        // The run ends at the next used bit; only look as far as we need
+        int64_t run_end = bitmap_find(bm, (uint64_t)run_start, (uint64_t)run_start + len, 1);
+        if (run_end < 0) return run_start;
+        from = (uint64_t)run_end + 1;
+    }
+    return -1;
+}
+
+uint64_t bitmap_count_free(const bitmap_t* bm) {
+    uint64_t used = 0;
+    uint64_t full_words = bm->nbits / 64;
+    for (uint64_t w = 0; w < full_words; w++) used += (uint64_t)__builtin_popcountll(load_word(bm->bits, w));
+    if (bm->nbits % 64) {
+        uint64_t mask = (1ull << (bm->nbits % 64)) - 1;
+        used += (uint64_t)__builtin_popcountll(load_word(bm->bits, full_words) & mask);
+    }
+    stats_add(STAT_BITMAP_WORDS, (bm->nbits + 63) / 64);
+    return bm->nbits - used;
+}
+
+uint64_t bitmap_first_free(bitmap_t* bm) {
+    int64_t bit = bitmap_find(bm, bm->low, bm->nbits, 0);
+    bm->low = bit < 0 ? bm->nbits : (uint64_t)bit;
+    return bm->low;
+}
+
+int bitmap_dirty_bytes(const bitmap_t* bm, uint64_t* first, uint64_t* last) {
+    if (bm->dirty_lo > bm->dirty_hi) return 0;
+    *first = bm->dirty_lo / 8;
+    *last = bm->dirty_hi / 8;
+    return 1;
+}
+
+int64_t bitmap_alloc(bitmap_t* bm) {
+    uint64_t hint = bm->hint < bm->nbits ? bm->hint : 0;
+    int64_t bit = bitmap_find(bm, hint, bm->nbits, 0);
+    if (bit < 0) bit = bitmap_find(bm, 0, hint, 0);
+    if (bit < 0) return -1;
+    bitmap_set(bm, (uint64_t)bit);
+    bm->hint = (uint64_t)bit + 1;
+    return bit;
+}
+
+uint64_t bitmap_alloc_extent(bitmap_t* bm, uint64_t want, uint64_t* start) {
+    if (want == 0) return 0;
+    uint64_t hint = bm->hint < bm->nbits ? bm->hint : 0;
+    uint64_t len = want;
+    int64_t s = bitmap_find_run(bm, hint, bm->nbits, want);
+    if (s < 0) s = bitmap_find_run(bm, 0, hint + want - 1, want);
+    if (s < 0) {
+        // No run is long enough: take the longest one, so a fragmented
+        // bitmap does not hand out one-bit holes while long runs lie further on
+        len = 0;
+        for (uint64_t pos = 0; pos < bm->nbits; ) {
+            int64_t run = bitmap_find(bm, pos, bm->nbits, 0);
+            if (run < 0) break;
+            int64_t end = bitmap_find(bm, (uint64_t)run, bm->nbits, 1);
+            pos = end < 0 ? bm->nbits : (uint64_t)end;
+            if (pos - (uint64_t)run > len) {
+                s = run;
+                len = pos - (uint64_t)run;
+            }
+        }
+        if (len == 0) return 0;
+        if (len > want) len = want;
+    }
+    bitmap_set_range(bm, (uint64_t)s, len);
+    bm->hint = (uint64_t)s + len;
+    *start = (uint64_t)s;
+    return len;
+}
@@ -0,0 +1,62 @@
+// Word-at-a-time bitmap allocator shared by the MiniVSFS tools.
+//
+// Bit i of a bitmap lives in byte i / 8 at bit position i % 8 (LSB first),
+// which is exactly the on-disk layout of the inode and data bitmaps. Searches
+// load 64 bits at a time and use count-trailing-zeros to find the next free
+// or used bit, so scanning a full 4 KiB bitmap block takes 512 steps instead
+// of 32768.
+#ifndef MINIVSFS_BITMAP_H
+#define MINIVSFS_BITMAP_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t* bits;   // backing bytes; length must be a multiple of 8 covering nbits
+    uint64_t nbits;  // number of valid bits
+    uint64_t hint;   // next-fit cursor: allocations start searching here
+    uint64_t dirty_lo; // lowest and highest bit changed since init;
+    uint64_t dirty_hi; // dirty_lo > dirty_hi while nothing has changed
+    uint64_t free;   // clear bits, kept up to date by every set and clear
+    uint64_t low;    // every bit below low is set
+} bitmap_t;
+
+// Counts the clear bits once; later changes keep the count current
+void bitmap_init(bitmap_t* bm, uint8_t* bits, uint64_t nbits);
+// Takes the free count and first clear bit from the caller (e.g. as saved in
+// the superblock) instead of scanning, and starts allocating at first_free
+void bitmap_init_counted(bitmap_t* bm, uint8_t* bits, uint64_t nbits, uint64_t free, uint64_t first_free);
+// Forgets the changes so far, for the next bitmap_dirty_bytes
+void bitmap_clean(bitmap_t* bm);
+
+int bitmap_test(const bitmap_t* bm, uint64_t bit);
+void bitmap_set(bitmap_t* bm, uint64_t bit);
+void bitmap_set_range(bitmap_t* bm, uint64_t start, uint64_t len);
+void bitmap_clear_range(bitmap_t* bm, uint64_t start, uint64_t len);
+
+// First clear (value 0) or set (value 1) bit in [from, to), or -1 if none
+int64_t bitmap_find(const bitmap_t* bm, uint64_t from, uint64_t to, int value);
+
+// Start of the first run of at least len clear bits in [from, to), or -1
+int64_t bitmap_find_run(const bitmap_t* bm, uint64_t from, uint64_t to, uint64_t len);
+
+// Full recount; bm->free holds the same number without one
+uint64_t bitmap_count_free(const bitmap_t* bm);
+
+// First clear bit (nbits if none), searching up from bm->low, which it advances
+uint64_t bitmap_first_free(bitmap_t* bm);
+
+// Range of backing bytes [*first, *last] touched since init; returns 0 if clean.
+// Lets callers write back only the bitmap blocks that actually changed.
+int bitmap_dirty_bytes(const bitmap_t* bm, uint64_t* first, uint64_t* last);
+
+// Allocates one bit, searching from the hint and wrapping around once.
+// Returns the bit number or -1 when the bitmap is full.
+int64_t bitmap_alloc(bitmap_t* bm);
+
+// Allocates up to want contiguous bits. A run of the full length is preferred
+// (next-fit from the hint, wrapping once); if no such run exists the longest
+// free run is taken instead (the first of equals). Returns the number of bits
+// allocated (0 when the bitmap is full) and stores the run start in *start.
+uint64_t bitmap_alloc_extent(bitmap_t* bm, uint64_t want, uint64_t* start);
+
+#endif
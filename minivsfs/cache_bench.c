@@ -0,0 +1,161 @@
+// Block cache benchmark for libminivsfs.
+// Build: make cache_bench    Run: ./cache_bench [--quick] [--image <scratch.img>]
+//
+// Builds a scratch image of files, then reads it back through mvfs_read with
+// the cache off and at several budgets. Each run reads every file front to
+// back in 4 KiB calls twice (the second pass shows whether the working set
+// fits), then makes random 4 KiB reads. The hit/miss/readahead counters show
+// what a budget buys for a given working set.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "mvfs.h"
+
+#define READ_SIZE 4096
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes file_count files of file_kib KiB each into a fresh image
+static int build_image(const char* path, int file_count, uint64_t file_kib) {
+    uint64_t size_kib = (uint64_t)file_count * (file_kib + 4) + 4096;
+    size_kib = (size_kib + 3) / 4 * 4;
+    if (mvfs_format(path, size_kib, 1024, 0, NULL) != 0) return -1;
+    mvfs_t* fs = mvfs_open(path, MVFS_RDWR);
+    if (!fs) return -1;
+    size_t len = (size_t)file_kib * 1024;
+    uint8_t* data = malloc(len);
+    int rc = data ? 0 : -1;
+    for (int f = 0; rc == 0 && f < file_count; f++) {
+        char name[32];
+        uint32_t ino;
+        snprintf(name, sizeof(name), "file_%04d.bin", f);
+        for (size_t i = 0; i < len; i++) data[i] = (uint8_t)(i * 131 + (size_t)f);
+        rc = mvfs_create(fs, ROOT_INO, name, len, 0, &ino);
+        if (rc == 0) rc = mvfs_write(fs, ino, data, len, 0);
+    }
+    free(data);
+    if (rc != 0) {
+        mvfs_abort(fs);
+        return -1;
+    }
+    return mvfs_close(fs);
+}
+
+typedef struct {
+    uint32_t* inos;
+    int count;
+} file_list_t;
+
+static int collect(const char* name, uint32_t ino, uint8_t type, void* arg) {
+    (void)name;
+    (void)type;
+    file_list_t* files = arg;
+    files->inos[files->count++] = ino;
+    return 0;
+}
+
+// One budget: sequential pass twice, then random reads; prints a row
+static int run(const char* path, const char* label, size_t budget, uint64_t file_bytes,
+               int file_count, int random_reads) {
+    mvfs_t* fs = mvfs_open(path, MVFS_RDONLY);
+    if (!fs) return -1;
+    mvfs_set_cache(fs, budget);
+    file_list_t files = { calloc((size_t)file_count, sizeof(uint32_t)), 0 };
+    uint8_t buf[READ_SIZE];
+    int rc = files.inos ? mvfs_iterate(fs, ROOT_INO, collect, &files) : -1;
+
+    for (int pass = 0; rc == 0 && pass < 2; pass++) {
+        double t0 = now_sec();
+        for (int f = 0; rc == 0 && f < files.count; f++) {
+            for (uint64_t off = 0; off < file_bytes; off += READ_SIZE) {
+                if (mvfs_read(fs, files.inos[f], buf, READ_SIZE, off) < 0) {
+                    rc = -1;
+                    break;
+                }
+            }
+        }
+        double dt = now_sec() - t0;
+        mvfs_cache_stats_t st;
+        mvfs_cache_stats(fs, &st);
+        printf("%-8s %-10s %10.1f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+               label, pass == 0 ? "seq-cold" : "seq-warm",
+               (double)file_bytes * files.count / dt / (1 << 20), st.hits, st.misses, st.readahead, st.evictions);
+    }
+
+    srand(42);
+    double t0 = now_sec();
+    for (int i = 0; rc == 0 && i < random_reads; i++) {
+        uint32_t ino = files.inos[rand() % files.count];
+        uint64_t off = (uint64_t)(rand() % (int)(file_bytes / READ_SIZE)) * READ_SIZE;
+        if (mvfs_read(fs, ino, buf, READ_SIZE, off) < 0) rc = -1;
+    }
+    double dt = now_sec() - t0;
+    if (rc == 0) {
+        mvfs_cache_stats_t st;
+        mvfs_cache_stats(fs, &st);
+        printf("%-8s %-10s %10.1f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+               label, "random", (double)random_reads * READ_SIZE / dt / (1 << 20),
+               st.hits, st.misses, st.readahead, st.evictions);
+    }
+    free(files.inos);
+    mvfs_close(fs);
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    int quick = 0;
+    const char* path = "cache_bench.img";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--image <scratch.img>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int file_count = quick ? 16 : 64;
+    uint64_t file_kib = 1024;
+    int random_reads = quick ? 20000 : 100000;
+    if (build_image(path, file_count, file_kib) != 0) {
+        fprintf(stderr, "Error: Cannot build '%s': %s\n", path, strerror(errno));
+        unlink(path);
+        return 1;
+    }
+    printf("working set: %d files x %" PRIu64 " KiB, %d-byte reads\n", file_count, file_kib, READ_SIZE);
+    printf("%-8s %-10s %10s %10s %10s %10s %10s\n", "budget", "pattern", "MiB/s", "hits", "misses",
+           "readahead", "evictions");
+
+    static const size_t budgets_mib[] = { 0, 4, 32, 128 };
+    int rc = 0;
+    for (size_t b = 0; rc == 0 && b < sizeof(budgets_mib) / sizeof(budgets_mib[0]); b++) {
+        char label[32];
+        if (budgets_mib[b] == 0) {
+            snprintf(label, sizeof(label), "off");
+        } else {
+            snprintf(label, sizeof(label), "%zuM", budgets_mib[b]);
+        }
+        rc = run(path, label, budgets_mib[b] << 20, file_kib * 1024, file_count, random_reads);
+    }
+    unlink(path);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Read failed: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
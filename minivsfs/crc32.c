@@ -0,0 +1,257 @@
+#include "crc32.h"
+
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+// CRC32_TAB[0] is the reference byte table; CRC32_TAB[k][b] is the CRC of
+// byte b followed by k zero bytes, which is what slicing-by-N needs
+static uint32_t CRC32_TAB[16][256];
+static uint32_t x2n_table[32]; // x^(2^n) mod P, for crc32_zeros
+static crc32_impl_t active_impl = CRC32_IMPL_BYTEWISE;
+
+static inline uint32_t load32le(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// All kernels take and return the raw (pre-inversion) CRC register
+
+static uint32_t crc32_bytewise(uint32_t c, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = CRC32_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static uint32_t crc32_slice8(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 8) {
+        uint32_t one = load32le(p) ^ c;
+        uint32_t two = load32le(p + 4);
+        c = CRC32_TAB[7][one & 0xFF] ^ CRC32_TAB[6][(one >> 8) & 0xFF] ^
+            CRC32_TAB[5][(one >> 16) & 0xFF] ^ CRC32_TAB[4][one >> 24] ^
+            CRC32_TAB[3][two & 0xFF] ^ CRC32_TAB[2][(two >> 8) & 0xFF] ^
+            CRC32_TAB[1][(two >> 16) & 0xFF] ^ CRC32_TAB[0][two >> 24];
+        p += 8;
+        n -= 8;
+    }
+    return crc32_bytewise(c, p, n);
+}
+
+static uint32_t crc32_slice16(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 16) {
+        uint32_t w0 = load32le(p) ^ c;
+        uint32_t w1 = load32le(p + 4);
+        uint32_t w2 = load32le(p + 8);
+        uint32_t w3 = load32le(p + 12);
+        c = CRC32_TAB[15][w0 & 0xFF] ^ CRC32_TAB[14][(w0 >> 8) & 0xFF] ^
+            CRC32_TAB[13][(w0 >> 16) & 0xFF] ^ CRC32_TAB[12][w0 >> 24] ^
+            CRC32_TAB[11][w1 & 0xFF] ^ CRC32_TAB[10][(w1 >> 8) & 0xFF] ^
+            CRC32_TAB[9][(w1 >> 16) & 0xFF] ^ CRC32_TAB[8][w1 >> 24] ^
+            CRC32_TAB[7][w2 & 0xFF] ^ CRC32_TAB[6][(w2 >> 8) & 0xFF] ^
+            CRC32_TAB[5][(w2 >> 16) & 0xFF] ^ CRC32_TAB[4][w2 >> 24] ^
+            CRC32_TAB[3][w3 & 0xFF] ^ CRC32_TAB[2][(w3 >> 8) & 0xFF] ^
+            CRC32_TAB[1][(w3 >> 16) & 0xFF] ^ CRC32_TAB[0][w3 >> 24];
+        p += 16;
+        n -= 16;
+    }
+    return crc32_slice8(c, p, n);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+// Folds 64-byte blocks with carry-less multiplication and Barrett-reduces the
+// result, following Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction". Constants are for the reflected IEEE polynomial.
+// Requires n >= 64 and n % 16 == 0.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t c, const uint8_t* p, size_t n) {
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    p += 64;
+    n -= 64;
+
+    // Four parallel folds of 64 bytes
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        n -= 64;
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Single folds of the remaining 16-byte blocks
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    if (n >= 64) {
+        size_t bulk = n & ~(size_t)15;
+        c = crc32_pclmul_fold(c, p, bulk);
+        p += bulk;
+        n -= bulk;
+    }
+    return crc32_slice8(c, p, n);
+}
+
+static int cpu_has_pclmul(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#else
+static int cpu_has_pclmul(void) {
+    return 0;
+}
+#endif
+
+// a * b mod P in the bit-reflected domain
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+        CRC32_TAB[0][i] = c;
+    }
+    for (int k = 1; k < 16; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = CRC32_TAB[k - 1][i];
+            CRC32_TAB[k][i] = (c >> 8) ^ CRC32_TAB[0][c & 0xFF];
+        }
+    }
+    uint32_t p = 1u << 30; // x^1
+    x2n_table[0] = p;
+    for (int n = 1; n < 32; n++) x2n_table[n] = p = multmodp(p, p);
+
+    active_impl = cpu_has_pclmul() ? CRC32_IMPL_PCLMUL : CRC32_IMPL_SLICE16;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t c = crc ^ 0xFFFFFFFFu;
+    // Most CRCs cover one inode or directory entry and take about as long as
+    // the two clock reads timing them would, so only every STATS_SAMPLE-th
+    // call is timed and stands for the ones in between
+    stats_block_t* st = stats_self();
+    stats_bump(st, STAT_CRC_BYTES, n);
+    int timed = stats_bump(st, STAT_CRC_CALLS, 1) % STATS_SAMPLE == 0;
+    uint64_t t0 = timed ? stats_now_ns() : 0;
+    switch (active_impl) {
+    case CRC32_IMPL_SLICE8:  c = crc32_slice8(c, p, n); break;
+    case CRC32_IMPL_SLICE16: c = crc32_slice16(c, p, n); break;
+#ifdef CRC32_HAVE_PCLMUL
+    case CRC32_IMPL_PCLMUL:  c = crc32_pclmul(c, p, n); break;
+#endif
+    default:                 c = crc32_bytewise(c, p, n); break;
+    }
+    if (timed) stats_bump(st, STAT_CRC_NS, (stats_now_ns() - t0) * STATS_SAMPLE);
+    return c ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32(const void* data, size_t n) {
+    return crc32_update(0, data, n);
+}
+
+uint32_t crc32_zeros(uint32_t crc, uint64_t n) {
+    // Feeding n zero bytes multiplies the raw register by x^(8n) mod P
+    uint32_t op = 1u << 31; // x^0
+    for (unsigned k = 3; n; n >>= 1, k++) {
+        if (n & 1) op = multmodp(x2n_table[k & 31], op);
+    }
+    return multmodp(op, crc ^ 0xFFFFFFFFu) ^ 0xFFFFFFFFu;
+}
+
+int crc32_set_impl(crc32_impl_t impl) {
+    if (impl == CRC32_IMPL_AUTO) impl = cpu_has_pclmul() ? CRC32_IMPL_PCLMUL : CRC32_IMPL_SLICE16;
+    if (impl == CRC32_IMPL_PCLMUL && !cpu_has_pclmul()) return -1;
+    active_impl = impl;
+    return 0;
+}
+
+crc32_impl_t crc32_get_impl(void) {
+    return active_impl;
+}
+
+const char* crc32_impl_name(crc32_impl_t impl) {
+    switch (impl) {
+    case CRC32_IMPL_BYTEWISE: return "bytewise";
+    case CRC32_IMPL_SLICE8:   return "slice8";
+    case CRC32_IMPL_SLICE16:  return "slice16";
+    case CRC32_IMPL_PCLMUL:   return "pclmul";
+    default:                  return "auto";
+    }
+}
@@ -0,0 +1,553 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "delta.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "image.h"
+#include "stats.h"
+
+#define DELTA_CHUNK 256           // blocks read per call
+#define DIGEST_BASIS 0xcbf29ce484222325ull
+#define DIGEST_PRIME 0x100000001b3ull
+
+static const uint8_t zero_block[BS];
+
+static uint64_t zero_key(void) {
+    static uint64_t key;
+    if (!key) key = block_hash(zero_block);
+    return key;
+}
+
+// FNV-1a over whole keys: order-sensitive and cheap next to the keys
+static uint64_t digest_add(uint64_t d, uint64_t key) {
+    return (d ^ key) * DIGEST_PRIME;
+}
+
+static int file_size(int fd, uint64_t* size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    *size = (uint64_t)st.st_size;
+    return 0;
+}
+
+static int file_blocks(int fd, uint64_t* blocks) {
+    uint64_t size;
+    if (file_size(fd, &size) != 0) return -1;
+    if (size % BS != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *blocks = size / BS;
+    return 0;
+}
+
+// ==================================READER=====================================
+// Images are read front to back in chunks of DELTA_CHUNK blocks. A chunk with
+// no data in the file (a hole, or past its end) reads as zeros without I/O,
+// which keeps sparse images cheap.
+
+typedef struct {
+    int fd;
+    uint64_t blocks;   // size of the file
+    uint8_t* buf;      // DELTA_CHUNK blocks
+    uint64_t first;    // first block in buf
+    uint64_t count;    // blocks in buf, 0 before the first load
+    int hole;          // buf was not read and holds only zeros
+} reader_t;
+
+static int reader_init(reader_t* r, int fd, uint64_t blocks) {
+    r->fd = fd;
+    r->blocks = blocks;
+    r->first = 0;
+    r->count = 0;
+    r->hole = 0;
+    r->buf = malloc((size_t)DELTA_CHUNK * BS);
+    return r->buf ? 0 : -1;
+}
+
+static void reader_free(reader_t* r) {
+    free(r->buf);
+}
+
+static int reader_load(reader_t* r, uint64_t b) {
+    uint64_t n = r->blocks > b ? r->blocks - b : 0;
+    if (n > DELTA_CHUNK) n = DELTA_CHUNK;
+    memset(r->buf + n * BS, 0, (DELTA_CHUNK - n) * BS);
+    r->hole = 1;
+    if (n > 0) {
+        off_t data = lseek(r->fd, (off_t)(b * BS), SEEK_DATA);
+        stats_add(STAT_SYSCALLS, 1);
+        if (data < 0 && errno != ENXIO) data = (off_t)(b * BS); // no SEEK_DATA: just read
+        if (data < 0 || (uint64_t)data >= (b + n) * BS) {
+            memset(r->buf, 0, n * BS);
+        } else if (read_full(r->fd, r->buf, n * BS, b * BS) != 0) {
+            return -1;
+        } else {
+            r->hole = 0;
+        }
+    }
+    r->first = b;
+    r->count = DELTA_CHUNK;
+    return 0;
+}
+
+// Block b of the file, zeros past its end
+static const uint8_t* reader_block(reader_t* r, uint64_t b) {
+    if (b < r->first || b >= r->first + r->count) {
+        if (reader_load(r, b) != 0) return NULL;
+    }
+    return r->buf + (b - r->first) * BS;
+}
+
+// Key of a block just returned by reader_block; holes are not hashed
+static uint64_t reader_key(const reader_t* r, const uint8_t* data) {
+    return r->hole ? zero_key() : block_hash(data);
+}
+// ==================================READER=====================================
+
+// ================================SIGNATURE====================================
+
+static uint32_t signature_header_crc(signature_header_t h) {
+    h.header_crc = 0;
+    return crc32(&h, sizeof(h));
+}
+
+int delta_signature(int image_fd, int out_fd, delta_stats_t* st) {
+    uint64_t blocks;
+    if (file_blocks(image_fd, &blocks) != 0) return -1;
+    uint64_t* keys = malloc((blocks ? blocks : 1) * sizeof(*keys));
+    reader_t r;
+    if (!keys || reader_init(&r, image_fd, blocks) != 0) {
+        free(keys);
+        return -1;
+    }
+    int rc = -1;
+    for (uint64_t b = 0; b < blocks; b++) {
+        const uint8_t* data = reader_block(&r, b);
+        if (!data) goto out;
+        keys[b] = reader_key(&r, data);
+    }
+
+    signature_header_t h = {
+        .magic = SIGNATURE_MAGIC,
+        .version = DELTA_VERSION,
+        .blocks = blocks,
+        .keys_crc = crc32(keys, blocks * sizeof(*keys)),
+    };
+    h.header_crc = signature_header_crc(h);
+    if (ftruncate(out_fd, 0) != 0 ||
+        write_full(out_fd, keys, blocks * sizeof(*keys), sizeof(h)) != 0 ||
+        write_full(out_fd, &h, sizeof(h), 0) != 0 || fsync(out_fd) != 0) {
+        goto out;
+    }
+    if (st) {
+        memset(st, 0, sizeof(*st));
+        st->old_blocks = blocks;
+        st->delta_bytes = sizeof(h) + blocks * sizeof(*keys);
+    }
+    rc = 0;
+out:
+    reader_free(&r);
+    free(keys);
+    return rc;
+}
+
+// Reads a signature file whole; *keys is NULL when fd holds something else
+static int signature_load(int fd, uint64_t** keys, uint64_t* blocks) {
+    *keys = NULL;
+    uint64_t size;
+    signature_header_t h;
+    if (file_size(fd, &size) != 0) return -1;
+    if (size < sizeof(h)) return 0;
+    if (read_full(fd, &h, sizeof(h), 0) != 0) return -1;
+    if (h.magic != SIGNATURE_MAGIC) return 0;
+    if (h.version != DELTA_VERSION || h.header_crc != signature_header_crc(h) ||
+        h.blocks != (size - sizeof(h)) / sizeof(uint64_t) ||
+        size != sizeof(h) + h.blocks * sizeof(uint64_t)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    uint64_t* k = malloc((h.blocks ? h.blocks : 1) * sizeof(*k));
+    if (!k) return -1;
+    if (read_full(fd, k, h.blocks * sizeof(*k), sizeof(h)) != 0) {
+        free(k);
+        return -1;
+    }
+    if (crc32(k, h.blocks * sizeof(*k)) != h.keys_crc) {
+        free(k);
+        errno = EBADMSG;
+        return -1;
+    }
+    *keys = k;
+    *blocks = h.blocks;
+    return 0;
+}
+// ================================SIGNATURE====================================
+
+// ==================================CREATE=====================================
+
+static uint32_t delta_header_crc(delta_header_t h) {
+    h.header_crc = 0;
+    return crc32(&h, sizeof(h));
+}
+
+typedef struct {
+    delta_run_t* runs;
+    size_t run_count, run_cap;
+    delta_keys_t* keys;
+    size_t key_count, key_cap;
+} tables_t;
+
+static int tables_grow(void** p, size_t* cap, size_t need, size_t size) {
+    if (need <= *cap) return 0;
+    size_t c = *cap ? *cap * 2 : 64;
+    void* q = realloc(*p, c * size);
+    if (!q) return -1;
+    *p = q;
+    *cap = c;
+    return 0;
+}
+
+// Adds block b to the last run, or starts a new one
+static int tables_add(tables_t* t, uint64_t b, uint32_t flags, uint64_t old_key, uint64_t new_key) {
+    delta_run_t* last = t->run_count ? &t->runs[t->run_count - 1] : NULL;
+    if (last && last->start + last->len == b && last->flags == flags && last->len < UINT32_MAX) {
+        last->len++;
+    } else {
+        if (tables_grow((void**)&t->runs, &t->run_cap, t->run_count + 1, sizeof(*t->runs)) != 0) return -1;
+        t->runs[t->run_count++] = (delta_run_t){ .start = b, .len = 1, .flags = flags };
+    }
+    if (tables_grow((void**)&t->keys, &t->key_cap, t->key_count + 1, sizeof(*t->keys)) != 0) return -1;
+    t->keys[t->key_count++] = (delta_keys_t){ .old_key = old_key, .new_key = new_key };
+    return 0;
+}
+
+static uint32_t tables_crc(const delta_run_t* runs, uint64_t run_count,
+                           const delta_keys_t* keys, uint64_t key_count) {
+    uint32_t crc = crc32(runs, run_count * sizeof(*runs));
+    return crc32_update(crc, keys, key_count * sizeof(*keys));
+}
+
+int delta_create(int old_fd, int new_fd, int out_fd, delta_stats_t* st) {
+    uint64_t* old_keys;
+    uint64_t old_blocks, new_blocks;
+    if (signature_load(old_fd, &old_keys, &old_blocks) != 0) return -1;
+    if (!old_keys && file_blocks(old_fd, &old_blocks) != 0) return -1;
+    if (file_blocks(new_fd, &new_blocks) != 0) {
+        free(old_keys);
+        return -1;
+    }
+
+    int rc = -1;
+    tables_t t = {0};
+    reader_t old_r = { .buf = NULL }, new_r = { .buf = NULL };
+    if (reader_init(&new_r, new_fd, new_blocks) != 0) goto out;
+    if (!old_keys && reader_init(&old_r, old_fd, old_blocks) != 0) goto out;
+
+    // One pass for the tables and the digest
+    uint64_t digest = DIGEST_BASIS;
+    uint64_t data_blocks = 0;
+    for (uint64_t b = 0; b < new_blocks; b++) {
+        const uint8_t* data = reader_block(&new_r, b);
+        if (!data) goto out;
+        uint64_t key = reader_key(&new_r, data);
+        uint64_t old_key;
+        int changed;
+        if (old_keys) {
+            old_key = b < old_blocks ? old_keys[b] : zero_key();
+            changed = old_key != key;
+        } else {
+            const uint8_t* old = reader_block(&old_r, b);
+            if (!old) goto out;
+            changed = !(old_r.hole && new_r.hole) && memcmp(old, data, BS) != 0;
+            old_key = changed ? reader_key(&old_r, old) : key;
+        }
+        if (!changed) {
+            digest = digest_add(digest, key);
+            continue;
+        }
+        uint32_t flags = memcmp(data, zero_block, BS) == 0 ? DELTA_RUN_ZERO : 0;
+        if (!flags) data_blocks++;
+        if (tables_add(&t, b, flags, old_key, key) != 0) goto out;
+    }
+
+    // Tables, then the data straight from the new image, then the header
+    uint64_t off = sizeof(delta_header_t);
+    if (ftruncate(out_fd, 0) != 0 ||
+        write_full(out_fd, t.runs, t.run_count * sizeof(*t.runs), off) != 0) {
+        goto out;
+    }
+    off += t.run_count * sizeof(*t.runs);
+    if (write_full(out_fd, t.keys, t.key_count * sizeof(*t.keys), off) != 0) goto out;
+    off += t.key_count * sizeof(*t.keys);
+    for (size_t i = 0; i < t.run_count; i++) {
+        const delta_run_t* run = &t.runs[i];
+        if (run->flags & DELTA_RUN_ZERO) continue;
+        if (copy_bytes(new_fd, run->start * BS, out_fd, off, (uint64_t)run->len * BS) != 0) goto out;
+        off += (uint64_t)run->len * BS;
+    }
+
+    delta_header_t h = {
+        .magic = DELTA_MAGIC,
+        .version = DELTA_VERSION,
+        .old_blocks = old_blocks,
+        .new_blocks = new_blocks,
+        .same_digest = digest,
+        .run_count = t.run_count,
+        .changed_blocks = t.key_count,
+        .data_blocks = data_blocks,
+        .table_crc = tables_crc(t.runs, t.run_count, t.keys, t.key_count),
+    };
+    h.header_crc = delta_header_crc(h);
+    if (write_full(out_fd, &h, sizeof(h), 0) != 0 || fsync(out_fd) != 0) goto out;
+
+    if (st) {
+        memset(st, 0, sizeof(*st));
+        st->old_blocks = old_blocks;
+        st->new_blocks = new_blocks;
+        st->runs = t.run_count;
+        st->changed_blocks = t.key_count;
+        st->data_blocks = data_blocks;
+        st->delta_bytes = off;
+    }
+    rc = 0;
+out:
+    reader_free(&new_r);
+    reader_free(&old_r);
+    free(t.runs);
+    free(t.keys);
+    free(old_keys);
+    return rc;
+}
+// ==================================CREATE=====================================
+
+// ==================================APPLY======================================
+
+static int bad_delta(void) {
+    errno = EBADMSG;
+    return -1;
+}
+
+// Everything about the delta that can be checked without the image: header,
+// size, tables and the keys of the carried data
+static int delta_load(int delta_fd, delta_header_t* h, delta_run_t** runs, delta_keys_t** keys) {
+    *runs = NULL;
+    *keys = NULL;
+    uint64_t size;
+    if (file_size(delta_fd, &size) != 0) return -1;
+    if (size < sizeof(*h)) return bad_delta();
+    if (read_full(delta_fd, h, sizeof(*h), 0) != 0) return -1;
+    if (h->magic != DELTA_MAGIC || h->version != DELTA_VERSION || h->header_crc != delta_header_crc(*h)) {
+        return bad_delta();
+    }
+    // Bounded by the file size before anything is multiplied or allocated
+    uint64_t room = (size - sizeof(*h)) / sizeof(delta_run_t);
+    if (h->run_count > h->changed_blocks || h->changed_blocks > h->new_blocks ||
+        h->data_blocks > h->changed_blocks || h->changed_blocks > room ||
+        size != sizeof(*h) + h->run_count * sizeof(delta_run_t) +
+                h->changed_blocks * sizeof(delta_keys_t) + h->data_blocks * BS) {
+        return bad_delta();
+    }
+
+    delta_run_t* r = malloc((h->run_count ? h->run_count : 1) * sizeof(*r));
+    delta_keys_t* k = malloc((h->changed_blocks ? h->changed_blocks : 1) * sizeof(*k));
+    uint8_t* buf = malloc((size_t)DELTA_CHUNK * BS);
+    if (!r || !k || !buf) goto fail;
+    uint64_t off = sizeof(*h);
+    if (read_full(delta_fd, r, h->run_count * sizeof(*r), off) != 0) goto fail;
+    off += h->run_count * sizeof(*r);
+    if (read_full(delta_fd, k, h->changed_blocks * sizeof(*k), off) != 0) goto fail;
+    off += h->changed_blocks * sizeof(*k);
+    if (tables_crc(r, h->run_count, k, h->changed_blocks) != h->table_crc) {
+        errno = EBADMSG;
+        goto fail;
+    }
+
+    // Runs in order, inside the new image, adding up to the header's counts
+    uint64_t next = 0, changed = 0, data = 0;
+    for (uint64_t i = 0; i < h->run_count; i++) {
+        if (r[i].len == 0 || (r[i].flags & ~DELTA_RUN_ZERO) || r[i].start < next ||
+            r[i].start > h->new_blocks || r[i].len > h->new_blocks - r[i].start) {
+            errno = EBADMSG;
+            goto fail;
+        }
+        next = r[i].start + r[i].len;
+        for (uint64_t j = changed; j < changed + r[i].len; j++) {
+            if ((r[i].flags & DELTA_RUN_ZERO) && k[j].new_key != zero_key()) {
+                errno = EBADMSG;
+                goto fail;
+            }
+        }
+        changed += r[i].len;
+        if (!(r[i].flags & DELTA_RUN_ZERO)) data += r[i].len;
+    }
+    if (changed != h->changed_blocks || data != h->data_blocks) {
+        errno = EBADMSG;
+        goto fail;
+    }
+
+    // The carried data must be what the keys promise
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < h->run_count; i++) {
+        if (r[i].flags & DELTA_RUN_ZERO) {
+            j += r[i].len;
+            continue;
+        }
+        for (uint64_t done = 0; done < r[i].len;) {
+            uint64_t n = r[i].len - done;
+            if (n > DELTA_CHUNK) n = DELTA_CHUNK;
+            if (read_full(delta_fd, buf, n * BS, off) != 0) goto fail;
+            for (uint64_t b = 0; b < n; b++) {
+                if (block_hash(buf + b * BS) != k[j++].new_key) {
+                    errno = EBADMSG;
+                    goto fail;
+                }
+            }
+            off += n * BS;
+            done += n;
+        }
+    }
+    free(buf);
+    *runs = r;
+    *keys = k;
+    return 0;
+fail:;
+    int saved = errno;
+    free(r);
+    free(k);
+    free(buf);
+    errno = saved;
+    return -1;
+}
+
+// Gives [b, b + n) its new contents: a zero run as a hole, data from off in
+// the delta
+static int apply_stretch(int image_fd, int delta_fd, uint64_t b, uint64_t n, int zero, uint64_t off) {
+    if (!zero) return copy_bytes(delta_fd, off, image_fd, b * BS, n * BS);
+    stats_add(STAT_SYSCALLS, 1);
+    if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(b * BS), (off_t)(n * BS)) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) return -1;
+    for (uint64_t i = 0; i < n; i++) {
+        if (write_full(image_fd, zero_block, BS, (b + i) * BS) != 0) return -1;
+    }
+    return 0;
+}
+
+int delta_apply(int image_fd, int delta_fd, delta_stats_t* st) {
+    delta_header_t h;
+    delta_run_t* runs;
+    delta_keys_t* keys;
+    if (delta_load(delta_fd, &h, &runs, &keys) != 0) return -1;
+
+    int rc = -1;
+    uint8_t* todo = NULL;
+    reader_t r = { .buf = NULL };
+    uint64_t image_blocks;
+    if (file_blocks(image_fd, &image_blocks) != 0) goto out;
+    // Unpatched, or patched as far as the resize
+    if (image_blocks != h.old_blocks && image_blocks != h.new_blocks) {
+        errno = ESTALE;
+        goto out;
+    }
+    todo = malloc(h.changed_blocks ? h.changed_blocks : 1);
+    if (!todo || reader_init(&r, image_fd, image_blocks) != 0) goto out;
+
+    // Every block must be as the delta expects before anything is written: the
+    // unchanged ones by their digest, the changed ones in their old or new state
+    uint64_t digest = DIGEST_BASIS;
+    uint64_t i = 0, j = 0, written = 0;
+    for (uint64_t b = 0; b < h.new_blocks; b++) {
+        const uint8_t* data = reader_block(&r, b);
+        if (!data) goto out;
+        uint64_t key = reader_key(&r, data);
+        while (i < h.run_count && runs[i].start + runs[i].len <= b) i++;
+        if (i == h.run_count || b < runs[i].start) {
+            digest = digest_add(digest, key);
+            continue;
+        }
+        // A block whose key did not change is rewritten either way
+        if (key == keys[j].old_key) {
+            todo[j] = 1;
+        } else if (key == keys[j].new_key) {
+            todo[j] = 0;
+        } else {
+            errno = ESTALE;
+            goto out;
+        }
+        written += todo[j++];
+    }
+    if (digest != h.same_digest) {
+        errno = ESTALE;
+        goto out;
+    }
+
+    if (image_blocks < h.new_blocks && ftruncate(image_fd, (off_t)(h.new_blocks * BS)) != 0) goto out;
+    stats_add(STAT_SYSCALLS, 1);
+
+    // Stretches of blocks still to write, holding back block 0
+    int sb_todo = 0;
+    uint64_t data_off = sizeof(h) + h.run_count * sizeof(*runs) + h.changed_blocks * sizeof(*keys);
+    uint64_t sb_off = 0;
+    j = 0;
+    for (i = 0; i < h.run_count; i++) {
+        int zero = (runs[i].flags & DELTA_RUN_ZERO) != 0;
+        uint64_t k = 0;
+        while (k < runs[i].len) {
+            uint64_t b = runs[i].start + k;
+            if (!todo[j + k] || b == 0) {
+                if (b == 0 && todo[j + k]) {
+                    sb_todo = 1;
+                    sb_off = data_off + k * BS;
+                }
+                k++;
+                continue;
+            }
+            uint64_t n = 1;
+            while (k + n < runs[i].len && todo[j + k + n]) n++;
+            if (apply_stretch(image_fd, delta_fd, b, n, zero, data_off + k * BS) != 0) goto out;
+            k += n;
+        }
+        j += runs[i].len;
+        if (!zero) data_off += (uint64_t)runs[i].len * BS;
+    }
+
+    if (image_blocks > h.new_blocks && ftruncate(image_fd, (off_t)(h.new_blocks * BS)) != 0) goto out;
+    // The superblock only once the rest is on disk
+    if (sb_todo) {
+        int zero = (runs[0].flags & DELTA_RUN_ZERO) != 0;
+        if (fsync(image_fd) != 0 || apply_stretch(image_fd, delta_fd, 0, 1, zero, sb_off) != 0) goto out;
+    }
+    if (fsync(image_fd) != 0) goto out;
+    stats_add(STAT_SYSCALLS, 2);
+
+    if (st) {
+        memset(st, 0, sizeof(*st));
+        st->old_blocks = h.old_blocks;
+        st->new_blocks = h.new_blocks;
+        st->runs = h.run_count;
+        st->changed_blocks = h.changed_blocks;
+        st->data_blocks = h.data_blocks;
+        st->written_blocks = written;
+        st->delta_bytes = data_off;
+    }
+    rc = 0;
+out:;
+    int saved = errno;
+    reader_free(&r);
+    free(todo);
+    free(runs);
+    free(keys);
+    errno = saved;
+    return rc;
+}
+// ==================================APPLY======================================
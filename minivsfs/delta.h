@@ -0,0 +1,91 @@
+// Block-level deltas between two versions of a MiniVSFS image.
+//
+// A delta lists the BS-sized blocks that differ between an old and a new
+// image, as runs of changed block numbers, and carries the new contents of
+// those blocks; runs that became all zeros carry none. Applying it rewrites
+// only those blocks in place, so shipping a new version costs about as much
+// as what changed, not the size of the image.
+//
+// Blocks are told apart by their 64-bit block_hash. The old side is either
+// the image itself, whose blocks are then also compared byte for byte, or a
+// signature file holding just its keys (8 bytes per block). Every changed
+// block is listed with its old and new key, and the header holds a digest of
+// the keys of all the blocks the delta leaves alone. delta_apply checks the
+// image against both before it writes anything, so a delta only applies to
+// the image it was made from, and skips blocks that already hold their new
+// contents: an interrupted apply can simply be run again. Block 0, the
+// superblock, is written last.
+//
+// Delta file: delta_header_t, run_count delta_run_t, changed_blocks
+// delta_keys_t (in run order), then the data of every run without
+// DELTA_RUN_ZERO, in run order. Signature file: signature_header_t, then one
+// key per block.
+#ifndef MINIVSFS_DELTA_H
+#define MINIVSFS_DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_MAGIC 0x4C44564Du     // "MVDL"
+#define SIGNATURE_MAGIC 0x4753564Du // "MVSG"
+#define DELTA_VERSION 1
+#define DELTA_RUN_ZERO 1u           // the run's new contents are all zeros
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;           // DELTA_MAGIC
+    uint32_t version;         // DELTA_VERSION
+    uint64_t old_blocks;      // size of the image the delta applies to
+    uint64_t new_blocks;      // its size once applied
+    uint64_t same_digest;     // keys of the blocks below new_blocks outside every run
+    uint64_t run_count;
+    uint64_t changed_blocks;  // blocks in all runs
+    uint64_t data_blocks;     // blocks in runs without DELTA_RUN_ZERO
+    uint32_t table_crc;       // crc32 of the run and key tables
+    uint32_t header_crc;      // crc32 of this header with this field zeroed
+} delta_header_t;
+
+typedef struct {
+    uint64_t start;           // first block
+    uint32_t len;
+    uint32_t flags;           // DELTA_RUN_*
+} delta_run_t;
+
+typedef struct {
+    uint64_t old_key;         // past the end of the old image: the key of a zero block
+    uint64_t new_key;
+} delta_keys_t;
+
+typedef struct {
+    uint32_t magic;           // SIGNATURE_MAGIC
+    uint32_t version;         // DELTA_VERSION
+    uint64_t blocks;
+    uint32_t keys_crc;        // crc32 of the keys
+    uint32_t header_crc;      // crc32 of this header with this field zeroed
+} signature_header_t;
+#pragma pack(pop)
+_Static_assert(sizeof(delta_header_t) == 64, "delta header size mismatch");
+_Static_assert(sizeof(delta_run_t) == 16, "delta run size mismatch");
+
+typedef struct {
+    uint64_t old_blocks;
+    uint64_t new_blocks;
+    uint64_t runs;
+    uint64_t changed_blocks;
+    uint64_t data_blocks;     // changed blocks carried with their contents
+    uint64_t written_blocks;  // delta_apply: changed blocks not yet holding their new contents
+    uint64_t delta_bytes;     // size of the delta or signature file
+} delta_stats_t;
+
+// The functions return 0, or -1 with errno: EINVAL for a file that is not a
+// whole number of blocks, EBADMSG for a damaged delta or signature, ESTALE
+// when the image is not the one the delta was made from (nor that image
+// partly patched with it). Call crc32_init() first.
+
+// Writes the keys of every block of an image
+int delta_signature(int image_fd, int out_fd, delta_stats_t* st);
+// Writes the delta from old_fd (an image or a signature file) to new_fd
+int delta_create(int old_fd, int new_fd, int out_fd, delta_stats_t* st);
+// Patches the image in place and syncs it
+int delta_apply(int image_fd, int delta_fd, delta_stats_t* st);
+
+#endif
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "dir.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "crc32.h"
+
+static int is_dot_name(const char* name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+uint32_t dir_name_hash(const char* name) {
+    return crc32(name, strnlen(name, sizeof(((dirent64_t*)0)->name)));
+}
+
+// Looks for name in one block of entries, remembering the first free slot
+static dirent64_t* leaf_scan(meta_block_t* leaf, const char* name, dirent64_t** free_slot) {
+    dirent64_t* entries = (dirent64_t*)leaf->data;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no == 0) {
+            if (free_slot && !*free_slot) *free_slot = &entries[i];
+        } else if (strncmp(entries[i].name, name, sizeof(entries[i].name)) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static dir_index_t* load_index(image_t* img, const inode_t* dir, meta_block_t** index_block) {
+    meta_block_t* mb = image_block(img, dir->direct[1]);
+    if (!mb) return NULL;
+    dir_index_t* idx = (dir_index_t*)mb->data;
+    if (idx->magic != DIR_INDEX_MAGIC || idx->global_depth > DIR_INDEX_MAX_DEPTH) {
+        errno = EIO;
+        return NULL;
+    }
+    if (index_block) *index_block = mb;
+    return idx;
+}
+
+// The leaf block that holds (or would hold) name
+static meta_block_t* leaf_for(image_t* img, const inode_t* dir, const char* name,
+                              dir_index_t** idx_out, meta_block_t** index_block, uint32_t* slot_out) {
+    if (!(dir->mode & MODE_DIR_INDEX) || is_dot_name(name)) return image_block(img, dir->direct[0]);
+    dir_index_t* idx = load_index(img, dir, index_block);
+    if (!idx) return NULL;
+    uint32_t slot = dir_name_hash(name) & ((1u << idx->global_depth) - 1);
+    if (idx_out) *idx_out = idx;
+    if (slot_out) *slot_out = slot;
+    return image_block(img, idx->leaf[slot]);
+}
+
+dirent64_t* dir_lookup(image_t* img, const inode_t* dir, const char* name) {
+    meta_block_t* leaf = leaf_for(img, dir, name, NULL, NULL, NULL);
+    if (!leaf) return NULL;
+    errno = 0;
+    return leaf_scan(leaf, name, NULL);
+}
+
+static int leaf_iterate(meta_block_t* leaf, int (*fn)(const dirent64_t* de, void* arg), void* arg) {
+    dirent64_t* entries = (dirent64_t*)leaf->data;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no == 0 || is_dot_name(entries[i].name)) continue;
+        int rc = fn(&entries[i], arg);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+int dir_iterate(image_t* img, const inode_t* dir,
+                int (*fn)(const dirent64_t* de, void* arg), void* arg) {
+    if (!(dir->mode & MODE_DIR_INDEX)) {
+        meta_block_t* leaf = image_block(img, dir->direct[0]);
+        return leaf ? leaf_iterate(leaf, fn, arg) : -1;
+    }
+    dir_index_t* idx = load_index(img, dir, NULL);
+    if (!idx) return -1;
+    // A leaf's lowest slot is the one below 1 << local_depth; visiting only
+    // those slots sees every leaf exactly once
+    for (uint32_t slot = 0; slot < (1u << idx->global_depth); slot++) {
+        if (slot >= (1u << idx->local_depth[slot])) continue;
+        meta_block_t* leaf = image_block(img, idx->leaf[slot]);
+        if (!leaf) return -1;
+        int rc = leaf_iterate(leaf, fn, arg);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+// Turns a full single-block directory into a hashed one whose only leaf is
+// the existing block; the insert loop then splits it as needed
+static void convert_to_index(inode_t* dir, meta_block_t* mb) {
+    dir_index_t* idx = (dir_index_t*)mb->data;
+    idx->magic = DIR_INDEX_MAGIC;
+    idx->global_depth = 0;
+    idx->leaf_count = 1;
+    idx->leaf[0] = dir->direct[0];
+    idx->local_depth[0] = 0;
+    dir_index_checksum_finalize(idx);
+    dir->direct[1] = (uint32_t)mb->block_no;
+    dir->mode |= MODE_DIR_INDEX;
+}
+
+// Number of splits the full leaf at depth needs before name finds a free
+// slot in its part, or -1 if that would take the index past its maximum
+// depth. Follows split_leaf: entries move on their next hash bit, and "."
+// and ".." stay on the 0 side.
+static int splits_needed(meta_block_t* leaf, const char* name, uint8_t depth) {
+    const dirent64_t* entries = (const dirent64_t*)leaf->data;
+    uint32_t hash = dir_name_hash(name);
+    for (int splits = 1; depth + splits <= DIR_INDEX_MAX_DEPTH; splits++) {
+        uint32_t mask = ((1u << splits) - 1) << depth;
+        size_t used = 0;
+        for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no == 0) continue;
+            uint32_t other = is_dot_name(entries[i].name) ? 0 : dir_name_hash(entries[i].name);
+            used += ((other ^ hash) & mask) == 0;
+        }
+        if (used < DIRENTS_PER_BLOCK) return splits;
+    }
+    return -1;
+}
+
+// Splits the leaf behind slot on its next hash bit into new_leaf, doubling
+// the index first if that leaf already uses every index bit. splits_needed
+// has already checked the depth, so only reading the old leaf can fail.
+static int split_leaf(image_t* img, dir_index_t* idx, uint32_t slot, meta_block_t* new_leaf) {
+    meta_block_t* old_leaf = image_block(img, idx->leaf[slot]);
+    if (!old_leaf) return -1;
+    uint8_t depth = idx->local_depth[slot];
+    if (depth == idx->global_depth) {
+        uint32_t n = 1u << idx->global_depth;
+        memcpy(&idx->leaf[n], &idx->leaf[0], n * sizeof(idx->leaf[0]));
+        memcpy(&idx->local_depth[n], &idx->local_depth[0], n);
+        idx->global_depth++;
+    }
+
+    // Entries whose hash has the next bit set move to the new leaf; "." and
+    // ".." always stay in the first leaf
+    dirent64_t* src = (dirent64_t*)old_leaf->data;
+    dirent64_t* dst = (dirent64_t*)new_leaf->data;
+    size_t moved = 0;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (src[i].inode_no == 0 || is_dot_name(src[i].name)) continue;
+        if ((dir_name_hash(src[i].name) >> depth) & 1) {
+            dst[moved++] = src[i];
+            memset(&src[i], 0, sizeof(src[i]));
+        }
+    }
+    old_leaf->dirty = 1;
+
+    uint32_t mask = (1u << depth) - 1;
+    for (uint32_t i = 0; i < (1u << idx->global_depth); i++) {
+        if ((i & mask) != (slot & mask)) continue;
+        idx->local_depth[i] = depth + 1;
+        if ((i >> depth) & 1) idx->leaf[i] = (uint32_t)new_leaf->block_no;
+    }
+    idx->leaf_count++;
+    return 0;
+}
+
+int dir_add(image_t* img, inode_t* dir, const char* name, uint32_t inode_no, uint8_t type) {
+    if (is_dot_name(name)) {
+        errno = EEXIST;
+        return -1;
+    }
+    // Blocks for the index and the split leaves are all taken when the leaf
+    // is first found full, before anything changes, so a failed add leaves
+    // the directory as it was. Later rounds only touch blocks this add has
+    // already loaded, which stay cached for the operation.
+    meta_block_t* spare[DIR_INDEX_MAX_DEPTH + 1];
+    int spares = 0, used = 0;
+    for (;;) {
+        dir_index_t* idx = NULL;
+        meta_block_t* index_block = NULL;
+        uint32_t slot = 0;
+        meta_block_t* leaf = leaf_for(img, dir, name, &idx, &index_block, &slot);
+        if (!leaf) break;
+        dirent64_t* free_slot = NULL;
+        if (leaf_scan(leaf, name, &free_slot)) {
+            errno = EEXIST;
+            break;
+        }
+        if (free_slot) {
+            memset(free_slot, 0, sizeof(*free_slot));
+            free_slot->inode_no = inode_no;
+            free_slot->type = type;
+            strncpy(free_slot->name, name, sizeof(free_slot->name) - 1);
+            dirent_checksum_finalize(free_slot);
+            leaf->dirty = 1;
+            dir->size_bytes += sizeof(dirent64_t);
+            return 0;
+        }
+        // The leaf is full: index the directory or split the leaf, then retry
+        if (spares == 0) {
+            int splits = splits_needed(leaf, name, idx ? idx->local_depth[slot] : 0);
+            if (splits < 0) {
+                errno = ENOSPC;
+                break;
+            }
+            for (int want = splits + !idx; spares < want; spares++) {
+                if (!(spare[spares] = image_alloc_block(img))) break;
+            }
+            if (spares < splits + !idx) break;
+        }
+        if (used == spares) {
+            errno = EIO; // the plan was short; cannot happen
+            break;
+        }
+        if (!idx) {
+            convert_to_index(dir, spare[used++]);
+            continue;
+        }
+        if (split_leaf(img, idx, slot, spare[used++]) != 0) break;
+        dir_index_checksum_finalize(idx);
+        index_block->dirty = 1;
+    }
+    int err = errno;
+    while (spares > used) image_free_block(img, spare[--spares]);
+    errno = err;
+    return -1;
+}
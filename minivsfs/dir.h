@@ -0,0 +1,32 @@
+// Directory lookups and inserts for MiniVSFS.
+//
+// A directory starts as a single linear block of dirent64_t records. When
+// that block fills up, dir_add turns it into a hashed directory (see
+// dir_index_t in minivsfs.h): a name's hash picks one leaf block, so lookup,
+// duplicate detection and finding a free slot each touch a single block no
+// matter how large the directory grows.
+#ifndef MINIVSFS_DIR_H
+#define MINIVSFS_DIR_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+uint32_t dir_name_hash(const char* name);
+
+// Entry for name inside a cached block, or NULL (errno 0 when simply absent)
+dirent64_t* dir_lookup(image_t* img, const inode_t* dir, const char* name);
+
+// Calls fn for every entry except "." and "..", leaf by leaf; stops early and
+// returns fn's value if it is non-zero. Returns -1 with errno on read errors.
+int dir_iterate(image_t* img, const inode_t* dir,
+                int (*fn)(const dirent64_t* de, void* arg), void* arg);
+
+// Adds an entry and grows dir->size_bytes. Fails with EEXIST for a duplicate
+// name and ENOSPC when no block can be allocated or the index is at its
+// maximum depth; a failed add leaves dir and its blocks unchanged. May rewrite
+// dir's mode and block map; the caller marks the directory inode dirty and
+// finalizes its CRC.
+int dir_add(image_t* img, inode_t* dir, const char* name, uint32_t inode_no, uint8_t type);
+
+#endif
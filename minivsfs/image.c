@@ -0,0 +1,396 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "image.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "stats.h"
+
+int read_full(int fd, void* buf, size_t len, uint64_t offset) {
+    uint8_t* p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        stats_add(STAT_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO; // short image
+            return -1;
+        }
+        stats_add(STAT_BYTES_READ, (uint64_t)n);
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void* buf, size_t len, uint64_t offset) {
+    const uint8_t* p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        stats_add(STAT_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        stats_add(STAT_BYTES_WRITTEN, (uint64_t)n);
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+// ================================BLOCK CACHE==================================
+
+#define IMAGE_MIN_BUCKETS 64
+
+static size_t bucket_of(const image_t* img, uint64_t block_no) {
+    return (size_t)((block_no * 0x9E3779B97F4A7C15ull) >> 32) & (img->bucket_count - 1);
+}
+
+static meta_block_t* cache_find(const image_t* img, uint64_t block_no) {
+    if (img->bucket_count == 0) return NULL;
+    meta_block_t* mb = img->buckets[bucket_of(img, block_no)];
+    while (mb && mb->block_no != block_no) mb = mb->next;
+    return mb;
+}
+
+static void cache_touch(image_t* img, meta_block_t* mb) {
+    mb->referenced = 1;
+    mb->op = img->op;
+}
+
+// Once a copy exists the output holds the newest version of every block
+static int cache_fd(const image_t* img) {
+    return img->write_fd >= 0 ? img->write_fd : img->read_fd;
+}
+
+// Adds a filled-in block to the array and the hash table
+static int cache_link(image_t* img, meta_block_t* mb) {
+    if (img->block_count == img->block_cap) {
+        size_t cap = img->block_cap ? img->block_cap * 2 : 8;
+        meta_block_t** blocks = realloc(img->blocks, cap * sizeof(*blocks));
+        if (!blocks) return -1;
+        img->blocks = blocks;
+        img->block_cap = cap;
+    }
+    if (img->block_count >= img->bucket_count) {
+        size_t count = img->bucket_count ? img->bucket_count * 2 : IMAGE_MIN_BUCKETS;
+        meta_block_t** buckets = calloc(count, sizeof(*buckets));
+        if (!buckets) return -1;
+        free(img->buckets);
+        img->buckets = buckets;
+        img->bucket_count = count;
+        for (size_t i = 0; i < img->block_count; i++) {
+            meta_block_t* b = img->blocks[i];
+            size_t h = bucket_of(img, b->block_no);
+            b->next = buckets[h];
+            buckets[h] = b;
+        }
+    }
+    size_t h = bucket_of(img, mb->block_no);
+    mb->next = img->buckets[h];
+    img->buckets[h] = mb;
+    mb->slot = img->block_count;
+    img->blocks[img->block_count++] = mb;
+    return 0;
+}
+
+// Takes a block out of the array and the hash table; the caller owns it
+static void cache_unlink(image_t* img, meta_block_t* mb) {
+    meta_block_t** link = &img->buckets[bucket_of(img, mb->block_no)];
+    while (*link != mb) link = &(*link)->next;
+    *link = mb->next;
+    meta_block_t* last = img->blocks[--img->block_count];
+    img->blocks[mb->slot] = last;
+    last->slot = mb->slot;
+}
+
+static int cache_evictable(const image_t* img, const meta_block_t* mb) {
+    return !mb->dirty && mb->block_no >= img->data_region_start && mb->op != img->op;
+}
+
+// CLOCK: sweeps the hand, giving each referenced block a second chance, and
+// returns the first evictable unreferenced block, unlinked; NULL when every
+// block is pinned
+static meta_block_t* cache_evict(image_t* img) {
+    for (size_t step = 0; step < 2 * img->block_count; step++) {
+        if (img->hand >= img->block_count) img->hand = 0;
+        meta_block_t* mb = img->blocks[img->hand];
+        if (!cache_evictable(img, mb)) {
+            img->hand++;
+        } else if (mb->referenced) {
+            mb->referenced = 0;
+            img->hand++;
+        } else {
+            cache_unlink(img, mb); // the block from the end now sits under the hand
+            img->stats.evictions++;
+            return mb;
+        }
+    }
+    return NULL;
+}
+
+// Memory for one more cached block: a victim when the budget is reached,
+// otherwise (or when nothing can be evicted) a fresh allocation
+static meta_block_t* cache_slot(image_t* img) {
+    meta_block_t* mb = NULL;
+    if (img->budget && img->block_count >= img->budget) mb = cache_evict(img);
+    return mb ? mb : malloc(sizeof(*mb));
+}
+
+// Finds or creates the cached copy of a block; with `load` set a block seen
+// for the first time is read from the image, otherwise it starts zeroed
+// (freshly allocated blocks have nothing worth reading)
+static meta_block_t* image_block_get(image_t* img, uint64_t block_no, int load) {
+    meta_block_t* mb = cache_find(img, block_no);
+    if (mb) {
+        if (load) img->stats.hits++;
+        cache_touch(img, mb);
+        return mb;
+    }
+    if (block_no >= img->total_blocks) {
+        errno = EINVAL;
+        return NULL;
+    }
+    mb = cache_slot(img);
+    if (!mb) return NULL;
+    if (!load) {
+        memset(mb->data, 0, BS);
+    } else if (read_full(cache_fd(img), mb->data, BS, block_no * BS) != 0) {
+        free(mb);
+        return NULL;
+    }
+    if (load) img->stats.misses++;
+    mb->block_no = block_no;
+    mb->dirty = 0;
+    cache_touch(img, mb);
+    if (cache_link(img, mb) != 0) {
+        free(mb);
+        return NULL;
+    }
+    return mb;
+}
+
+meta_block_t* image_block(image_t* img, uint64_t block_no) {
+    return image_block_get(img, block_no, 1);
+}
+
+meta_block_t* image_cached(image_t* img, uint64_t block_no) {
+    meta_block_t* mb = cache_find(img, block_no);
+    if (mb) cache_touch(img, mb);
+    return mb;
+}
+
+meta_block_t* image_new_block(image_t* img, uint64_t block_no) {
+    meta_block_t* mb = image_block_get(img, block_no, 0);
+    if (!mb) return NULL;
+    memset(mb->data, 0, BS);
+    mb->dirty = 1;
+    return mb;
+}
+
+int image_readahead(image_t* img, uint64_t block_no, uint64_t count) {
+    if (block_no >= img->total_blocks) return 0;
+    if (count > img->total_blocks - block_no) count = img->total_blocks - block_no;
+    uint8_t* buf = NULL;
+    uint64_t end = block_no + count;
+    int rc = 0;
+    for (uint64_t b = block_no; rc == 0 && b < end; ) {
+        if (cache_find(img, b)) {
+            b++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (b + run < end && !cache_find(img, b + run)) run++;
+        if (!buf && !(buf = malloc(count * BS))) return -1;
+        rc = read_full(cache_fd(img), buf, run * BS, b * BS);
+        for (uint64_t i = 0; rc == 0 && i < run; i++) {
+            meta_block_t* mb = cache_slot(img);
+            if (!mb) {
+                rc = -1;
+                break;
+            }
+            memcpy(mb->data, buf + i * BS, BS);
+            mb->block_no = b + i;
+            mb->dirty = 0;
+            mb->referenced = 1; // one sweep to get used before it can go
+            mb->op = img->op - 1; // not part of the current operation
+            if (cache_link(img, mb) != 0) {
+                free(mb);
+                rc = -1;
+                break;
+            }
+            img->stats.readahead++;
+        }
+        b += run;
+    }
+    free(buf);
+    return rc;
+}
+
+// Marks the data-region part of [block_no, block_no + count) in img->written
+static void note_written(image_t* img, uint64_t block_no, uint64_t count) {
+    if (!img->written) return;
+    uint64_t start = block_no > img->data_region_start ? block_no : img->data_region_start;
+    uint64_t end = block_no + count < img->total_blocks ? block_no + count : img->total_blocks;
+    if (start < end) bitmap_set_range(img->written, start - img->data_region_start, end - start);
+}
+
+void image_forget(image_t* img, uint64_t block_no, uint64_t count) {
+    note_written(img, block_no, count);
+    for (uint64_t b = block_no; b < block_no + count && img->block_count > 0; b++) {
+        meta_block_t* mb = cache_find(img, b);
+        if (!mb || mb->dirty) continue;
+        cache_unlink(img, mb);
+        free(mb);
+    }
+}
+
+void image_next_op(image_t* img) {
+    if (!img->hold) img->op++;
+}
+
+int image_flush(image_t* img) {
+    for (size_t i = 0; i < img->block_count; i++) {
+        meta_block_t* mb = img->blocks[i];
+        if (!mb->dirty) continue;
+        if (write_full(img->write_fd, mb->data, BS, mb->block_no * BS) != 0) return -1;
+        note_written(img, mb->block_no, 1);
+        mb->dirty = 0;
+    }
+    return 0;
+}
+// ================================BLOCK CACHE==================================
+
+meta_block_t* image_alloc_block(image_t* img) {
+    int64_t bit = img->data_bitmap ? bitmap_alloc(img->data_bitmap) : -1;
+    if (bit < 0) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    stats_add(STAT_BLOCKS_ALLOCATED, 1);
+    return image_new_block(img, img->data_region_start + (uint64_t)bit);
+}
+
+void image_free_block(image_t* img, meta_block_t* mb) {
+    bitmap_clear_range(img->data_bitmap, mb->block_no - img->data_region_start, 1);
+    mb->dirty = 0;
+    image_forget(img, mb->block_no, 1);
+}
+
+void image_release(image_t* img) {
+    for (size_t i = 0; i < img->block_count; i++) free(img->blocks[i]);
+    free(img->blocks);
+    free(img->buckets);
+    img->blocks = NULL;
+    img->buckets = NULL;
+    img->block_count = img->block_cap = img->bucket_count = 0;
+    img->hand = 0;
+}
+
+int image_bitmap_load(image_t* img, image_bitmap_t* ib, uint64_t start_block,
+                      uint64_t block_count, uint64_t nbits, const uint64_t summary[2]) {
+    if (block_count == 0 || nbits > block_count * BS * 8 ||
+        start_block + block_count > img->total_blocks) {
+        errno = EINVAL;
+        return -1;
+    }
+    ib->start_block = start_block;
+    ib->block_count = block_count;
+    ib->data = malloc(block_count * BS);
+    if (!ib->data) return -1;
+    if (read_full(img->read_fd, ib->data, block_count * BS, start_block * BS) != 0) {
+        free(ib->data);
+        ib->data = NULL;
+        return -1;
+    }
+    if (summary) {
+        bitmap_init_counted(&ib->bm, ib->data, nbits, summary[0], summary[1]);
+    } else {
+        bitmap_init(&ib->bm, ib->data, nbits);
+    }
+    return 0;
+}
+
+int image_bitmap_flush(image_t* img, image_bitmap_t* ib) {
+    uint64_t first, last;
+    if (!bitmap_dirty_bytes(&ib->bm, &first, &last)) return 0;
+    uint64_t first_block = first / BS, last_block = last / BS;
+    return write_full(img->write_fd, ib->data + first_block * BS, (last_block - first_block + 1) * BS,
+                      (ib->start_block + first_block) * BS);
+}
+
+int copy_bytes(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len) {
+    loff_t in_pos = (loff_t)in_off, out_pos = (loff_t)out_off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, len, 0);
+        stats_add(STAT_SYSCALLS, 1);
+        if (n > 0) {
+            stats_add(STAT_BYTES_READ, (uint64_t)n);
+            stats_add(STAT_BYTES_WRITTEN, (uint64_t)n);
+            len -= (uint64_t)n;
+            continue;
+        }
+        if (n == 0) {
+            errno = EIO; // input shorter than its superblock says
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+        break; // copy the rest through userspace
+    }
+    size_t chunk = 1u << 20;
+    uint8_t* buf = len > 0 ? malloc(chunk) : NULL;
+    if (len > 0 && !buf) return -1;
+    in_off = (uint64_t)in_pos;
+    out_off = (uint64_t)out_pos;
+    while (len > 0) {
+        size_t n = len < chunk ? (size_t)len : chunk;
+        if (read_full(in_fd, buf, n, in_off) != 0 || write_full(out_fd, buf, n, out_off) != 0) {
+            free(buf);
+            return -1;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+int copy_image(int in_fd, int out_fd, uint64_t size) {
+    // A reflink shares every block with the input until one is overwritten
+    stats_add(STAT_SYSCALLS, 2); // the ioctl and ftruncate
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) return ftruncate(out_fd, (off_t)size);
+
+    // Otherwise copy only what the input stores: holes stay holes, and each
+    // data extent goes through copy_file_range (which may still share blocks
+    // on file systems that reflink internally)
+    if (ftruncate(out_fd, (off_t)size) != 0) return -1;
+    uint64_t off = 0;
+    while (off < size) {
+        stats_add(STAT_SYSCALLS, 1);
+        off_t data = lseek(in_fd, (off_t)off, SEEK_DATA);
+        off_t hole;
+        if (data < 0 && errno == ENXIO) break; // only a hole left
+        if (data < 0) {
+            data = (off_t)off; // no SEEK_DATA support: treat it all as data
+            hole = (off_t)size;
+        } else {
+            stats_add(STAT_SYSCALLS, 1);
+            hole = lseek(in_fd, data, SEEK_HOLE);
+            if (hole < 0) hole = (off_t)size;
+        }
+        if ((uint64_t)data >= size) break;
+        if ((uint64_t)hole > size) hole = (off_t)size;
+        if (copy_bytes(in_fd, (uint64_t)data, out_fd, (uint64_t)data, (uint64_t)(hole - data)) != 0) return -1;
+        off = (uint64_t)hole;
+    }
+    return 0;
+}
+// ================================IMAGE ACCESS=================================
@@ -0,0 +1,111 @@
+// Block-level access to a MiniVSFS image.
+//
+// The image is never loaded as a whole. Blocks are read on demand with pread
+// into a block cache, patched in memory and written back with pwrite only if
+// they were modified, so an update costs O(touched blocks) instead of
+// O(image size).
+//
+// The cache is found through a hash table and bounded by a block budget.
+// Past the budget, CLOCK eviction drops clean blocks from the data region.
+// It never drops dirty blocks, blocks before the data region (superblock,
+// bitmaps, inode table) or blocks touched since the last image_next_op().
+// Pointers returned by image_block therefore stay valid for the rest of the
+// caller's operation.
+#ifndef MINIVSFS_IMAGE_H
+#define MINIVSFS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+
+typedef struct meta_block {
+    uint64_t block_no;
+    int dirty;
+    uint8_t referenced;       // CLOCK bit, set on every access
+    uint64_t op;              // image_t.op of the last access
+    size_t slot;              // index in image_t.blocks
+    struct meta_block* next;  // hash chain
+    uint8_t data[BS];
+} meta_block_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;       // blocks loaded ahead of use
+    uint64_t evictions;
+} image_cache_stats_t;
+
+typedef struct {
+    int read_fd;             // image blocks are read from until write_fd is open
+    int write_fd;            // image changes are written to (same fd when in place)
+    uint64_t total_blocks;
+    meta_block_t** blocks;   // cached blocks, in CLOCK order
+    size_t block_count;
+    size_t block_cap;
+    meta_block_t** buckets;  // hash table over blocks
+    size_t bucket_count;
+    size_t budget;           // soft limit on block_count, 0 for none
+    size_t hand;             // CLOCK hand, an index into blocks
+    uint64_t op;             // current operation, see image_next_op
+    int hold;                // image_next_op is ignored while non-zero
+    image_cache_stats_t stats;
+    bitmap_t* data_bitmap;   // where image_alloc_block takes blocks from
+    uint64_t data_region_start;
+    bitmap_t* written;       // unless NULL, data region blocks written back or forgotten get set
+} image_t;
+
+// An on-disk bitmap region (possibly several blocks) held contiguously in
+// memory so it can be scanned word-at-a-time; only the blocks whose bits
+// changed are written back
+typedef struct {
+    uint64_t start_block;
+    uint64_t block_count;
+    uint8_t* data;
+    bitmap_t bm;
+} image_bitmap_t;
+
+// pread/pwrite the whole range, retrying short transfers; 0 or -1 with errno
+int read_full(int fd, void* buf, size_t len, uint64_t offset);
+int write_full(int fd, const void* buf, size_t len, uint64_t offset);
+
+// Cached copy of a block, read from the image on first use
+meta_block_t* image_block(image_t* img, uint64_t block_no);
+// The cached copy if there is one; never reads
+meta_block_t* image_cached(image_t* img, uint64_t block_no);
+// Loads the uncached blocks of [block_no, block_no + count) with one read per
+// uncached stretch
+int image_readahead(image_t* img, uint64_t block_no, uint64_t count);
+// Drops clean cached copies of [block_no, block_no + count) after the blocks
+// were written behind the cache's back (and notes them in img->written)
+void image_forget(image_t* img, uint64_t block_no, uint64_t count);
+// Starts a new operation: blocks used by earlier ones become evictable
+void image_next_op(image_t* img);
+// Cached metadata block started from zeros without reading it; marked dirty
+meta_block_t* image_new_block(image_t* img, uint64_t block_no);
+// Allocates a data block for metadata (directory leaves, extent blocks);
+// returns it zeroed and dirty, or NULL with errno ENOSPC
+meta_block_t* image_alloc_block(image_t* img);
+// Gives back a block from image_alloc_block that was never used: its bit is
+// cleared and the cached copy dropped without being written
+void image_free_block(image_t* img, meta_block_t* mb);
+// Writes every modified block back to the output image
+int image_flush(image_t* img);
+void image_release(image_t* img);
+
+// summary, unless NULL, holds the free count and the first clear bit as
+// saved in the superblock, and spares counting the bits
+int image_bitmap_load(image_t* img, image_bitmap_t* ib, uint64_t start_block,
+                      uint64_t block_count, uint64_t nbits, const uint64_t summary[2]);
+int image_bitmap_flush(image_t* img, image_bitmap_t* ib);
+
+// Makes a fresh output image a copy of the input before changes are applied:
+// a reflink (FICLONE) where the file system supports it, otherwise the
+// input's data extents via copy_file_range, keeping holes sparse
+int copy_image(int in_fd, int out_fd, uint64_t size);
+// Copies [in_off, in_off + len) of in_fd to out_off in out_fd: copy_file_range
+// where the kernel allows it, pread and pwrite otherwise
+int copy_bytes(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len);
+
+#endif
@@ -0,0 +1,297 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "io.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "image.h"
+#include "stats.h"
+
+struct io_engine {
+    io_kind_t kind;             // IO_PREAD or IO_URING
+    uint8_t* buf;               // IO_QUEUE_DEPTH chunks (one for pread)
+    int ring_fd;
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring;              // == sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+const char* io_kind_name(io_kind_t kind) {
+    switch (kind) {
+    case IO_PREAD: return "pread";
+    case IO_URING: return "io_uring";
+    default: return "auto";
+    }
+}
+
+io_kind_t io_engine_kind(const io_engine_t* io) {
+    return io->kind;
+}
+
+// ==================================PREAD======================================
+
+static int copy_pread(io_engine_t* io, int src_fd, int dst_fd, const io_copy_t* copies, size_t count) {
+    for (size_t c = 0; c < count; c++) {
+        const io_copy_t* cp = &copies[c];
+        for (uint64_t off = 0; off < cp->padded; ) {
+            size_t n = cp->padded - off < IO_CHUNK ? (size_t)(cp->padded - off) : IO_CHUNK;
+            size_t r = off >= cp->len ? 0 : (cp->len - off < n ? (size_t)(cp->len - off) : n);
+            if (r > 0 && read_full(src_fd, io->buf, r, cp->src_offset + off) != 0) return -1;
+            memset(io->buf + r, 0, n - r);
+            if (write_full(dst_fd, io->buf, n, cp->dst_offset + off) != 0) return -1;
+            off += n;
+        }
+    }
+    return 0;
+}
+
+// =================================IO_URING====================================
+
+static void ring_release(io_engine_t* io) {
+    if (io->sqes) munmap(io->sqes, io->sqes_len);
+    if (io->cq_ring && io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_len);
+    if (io->sq_ring) munmap(io->sq_ring, io->sq_ring_len);
+    if (io->ring_fd >= 0) close(io->ring_fd);
+    io->ring_fd = -1;
+}
+
+// Sets up a ring of IO_QUEUE_DEPTH entries and registers the chunk buffers
+static int ring_setup(io_engine_t* io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = (int)syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &p);
+    if (io->ring_fd < 0) return -1;
+
+    io->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && io->cq_ring_len > io->sq_ring_len) io->sq_ring_len = io->cq_ring_len;
+    io->sq_ring = mmap(NULL, io->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       io->ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) {
+        io->sq_ring = NULL;
+        goto fail;
+    }
+    if (single) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           io->ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) {
+            io->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        io->sqes = NULL;
+        goto fail;
+    }
+    uint8_t* sq = io->sq_ring;
+    uint8_t* cq = io->cq_ring;
+    io->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + p.sq_off.array);
+    io->cq_head = (unsigned*)(cq + p.cq_off.head);
+    io->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Registered buffers are pinned once instead of on every request
+    struct iovec iov[IO_QUEUE_DEPTH];
+    for (int s = 0; s < IO_QUEUE_DEPTH; s++) {
+        iov[s].iov_base = io->buf + (size_t)s * IO_CHUNK;
+        iov[s].iov_len = IO_CHUNK;
+    }
+    if (syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iov, IO_QUEUE_DEPTH) != 0) goto fail;
+    return 0;
+
+fail:;
+    int err = errno;
+    ring_release(io);
+    errno = err;
+    return -1;
+}
+
+// Queues a fixed-buffer read or write for a slot; submitted by ring_enter
+static void ring_queue(io_engine_t* io, int write, int fd, unsigned slot, uint8_t* addr, size_t len, uint64_t offset) {
+    unsigned tail = *io->sq_tail;
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    sqe->buf_index = (uint16_t)slot;
+    sqe->user_data = slot;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// One chunk in flight: read into the slot's buffer, then written out
+typedef struct {
+    int busy;
+    int writing;
+    uint64_t src;
+    uint64_t dst;
+    size_t read_len;            // bytes of the chunk that come from the source
+    size_t len;                 // bytes written, zero-padded past read_len
+    size_t done;                // progress of the current phase
+} io_slot_t;
+
+static void slot_next(io_engine_t* io, io_slot_t* s, unsigned slot, int src_fd, int dst_fd) {
+    uint8_t* buf = io->buf + (size_t)slot * IO_CHUNK;
+    if (!s->writing) {
+        ring_queue(io, 0, src_fd, slot, buf + s->done, s->read_len - s->done, s->src + s->done);
+    } else {
+        ring_queue(io, 1, dst_fd, slot, buf + s->done, s->len - s->done, s->dst + s->done);
+    }
+}
+
+static int copy_uring(io_engine_t* io, int src_fd, int dst_fd, const io_copy_t* copies, size_t count) {
+    io_slot_t slots[IO_QUEUE_DEPTH];
+    memset(slots, 0, sizeof(slots));
+    size_t c = 0;               // next chunk: copies[c] at offset off
+    uint64_t off = 0;
+    unsigned queued = 0;        // SQEs not yet submitted
+    int busy = 0;
+    int err = 0;
+
+    for (;;) {
+        // Start a chunk in every free slot
+        for (unsigned k = 0; !err && k < IO_QUEUE_DEPTH; k++) {
+            while (c < count && off >= copies[c].padded) {
+                c++;
+                off = 0;
+            }
+            if (c == count) break;
+            io_slot_t* s = &slots[k];
+            if (s->busy) continue;
+            const io_copy_t* cp = &copies[c];
+            s->len = cp->padded - off < IO_CHUNK ? (size_t)(cp->padded - off) : IO_CHUNK;
+            s->read_len = off >= cp->len ? 0 : (cp->len - off < s->len ? (size_t)(cp->len - off) : s->len);
+            s->src = cp->src_offset + off;
+            s->dst = cp->dst_offset + off;
+            s->done = 0;
+            s->writing = s->read_len == 0;
+            s->busy = 1;
+            memset(io->buf + (size_t)k * IO_CHUNK + s->read_len, 0, s->len - s->read_len);
+            slot_next(io, s, k, src_fd, dst_fd);
+            queued++;
+            busy++;
+            off += s->len;
+        }
+        if (busy == 0) break;
+
+        // Submit the batch and wait for at least one completion
+        long ret = syscall(__NR_io_uring_enter, io->ring_fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_add(STAT_SYSCALLS, 1);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            return -1; // the ring itself is unusable
+        }
+        queued -= (unsigned)ret < queued ? (unsigned)ret : queued;
+
+        unsigned head = *io->cq_head;
+        unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+            unsigned k = (unsigned)cqe->user_data;
+            int res = cqe->res;
+            io_slot_t* s = &slots[k];
+            if (res == -EINTR || res == -EAGAIN) {
+                res = 0; // retried below as a zero-length step
+            } else if (res < 0 || (res == 0 && !s->writing)) {
+                if (!err) err = res < 0 ? -res : EIO; // EIO: the source ended early
+                s->busy = 0;
+                busy--;
+                continue;
+            }
+            s->done += (size_t)res;
+            stats_add(s->writing ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, (uint64_t)res);
+            if (!s->writing && s->done == s->read_len) {
+                s->writing = 1;
+                s->done = 0;
+            }
+            if (s->writing && s->done == s->len) {
+                s->busy = 0;
+                busy--;
+            } else if (err) {
+                s->busy = 0; // failing: let what is in flight drain
+                busy--;
+            } else {
+                slot_next(io, s, k, src_fd, dst_fd); // short transfer or next phase
+                queued++;
+            }
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// ==================================ENGINE=====================================
+
+io_engine_t* io_engine_open(io_kind_t kind) {
+    io_engine_t* io = calloc(1, sizeof(*io));
+    if (!io) return NULL;
+    io->ring_fd = -1;
+    if (kind != IO_PREAD) {
+        io->buf = aligned_alloc(4096, (size_t)IO_QUEUE_DEPTH * IO_CHUNK);
+        if (io->buf && ring_setup(io) == 0) {
+            io->kind = IO_URING;
+            return io;
+        }
+        int err = errno;
+        free(io->buf);
+        io->buf = NULL;
+        if (kind == IO_URING) {
+            free(io);
+            errno = err;
+            return NULL;
+        }
+    }
+    io->kind = IO_PREAD;
+    io->buf = malloc(IO_CHUNK);
+    if (!io->buf) {
+        free(io);
+        return NULL;
+    }
+    return io;
+}
+
+void io_engine_close(io_engine_t* io) {
+    if (!io) return;
+    ring_release(io);
+    free(io->buf);
+    free(io);
+}
+
+int io_copy(io_engine_t* io, int src_fd, int dst_fd, const io_copy_t* copies, size_t count) {
+    if (io->kind == IO_URING) return copy_uring(io, src_fd, dst_fd, copies, count);
+    return copy_pread(io, src_fd, dst_fd, copies, count);
+}
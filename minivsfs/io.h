@@ -0,0 +1,46 @@
+// Bulk copies of host file data into an image, through a pluggable backend.
+//
+// A copy moves a stretch of a host file to a stretch of the image, zero-padded
+// to the end of its last block. The pread backend runs copies one chunk at a
+// time with pread and pwrite. The io_uring backend keeps up to IO_QUEUE_DEPTH
+// chunks in flight in buffers registered with the kernel: it reads ahead in
+// the host file while earlier chunks are still being written to the image,
+// and one io_uring_enter call submits a whole batch of reads and writes and
+// reaps what has completed. The ring is set up with raw system calls, so
+// there is no liburing dependency.
+#ifndef MINIVSFS_IO_H
+#define MINIVSFS_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IO_CHUNK (256u * 1024)  // bytes per read or write
+#define IO_QUEUE_DEPTH 16       // chunks in flight (io_uring)
+
+typedef enum {
+    IO_AUTO,    // io_uring where the kernel allows it, otherwise pread
+    IO_PREAD,
+    IO_URING,
+} io_kind_t;
+
+typedef struct {
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t len;               // bytes read from the source
+    uint64_t padded;            // bytes written: len plus zeros, at least len
+} io_copy_t;
+
+typedef struct io_engine io_engine_t;
+
+// NULL with errno set if the backend is unavailable (IO_URING on a kernel
+// without io_uring, or where seccomp forbids it)
+io_engine_t* io_engine_open(io_kind_t kind);
+void io_engine_close(io_engine_t* io);
+io_kind_t io_engine_kind(const io_engine_t* io);
+const char* io_kind_name(io_kind_t kind);
+
+// Runs every copy from src_fd to dst_fd; 0, or -1 with errno (EIO if the
+// source ends early)
+int io_copy(io_engine_t* io, int src_fd, int dst_fd, const io_copy_t* copies, size_t count);
+
+#endif
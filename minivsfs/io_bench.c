@@ -0,0 +1,177 @@
+// I/O backend benchmark for large imports.
+// Build: make io_bench    Run: ./io_bench [--quick] [--image <scratch.img>]
+//
+// Imports host files into a fresh scratch image with mvfs_add, once per
+// backend: one large file and a batch of 1 MiB files. Each import runs with
+// the source files in the page cache (warm) and after they were dropped from
+// it with posix_fadvise (cold), where reading ahead in the source while the
+// image is written pays off. The time runs from mvfs_open to mvfs_close; the
+// last column adds an fsync of the image. The best of three runs is shown.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "mvfs.h"
+
+#define RUNS 3
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    const char* label;
+    int file_count;
+    uint64_t file_mib;
+} workload_t;
+
+static void source_path(char* out, size_t cap, const char* image, int f) {
+    snprintf(out, cap, "%s.src%d", image, f);
+}
+
+static int write_sources(const char* image, const workload_t* w) {
+    size_t len = (size_t)w->file_mib << 20;
+    uint8_t* data = malloc(len);
+    if (!data) return -1;
+    for (size_t i = 0; i < len; i++) data[i] = (uint8_t)(i * 2654435761u >> 13);
+    int rc = 0;
+    for (int f = 0; rc == 0 && f < w->file_count; f++) {
+        char path[4096];
+        source_path(path, sizeof(path), image, f);
+        data[0] = (uint8_t)f;
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, data, len) != (ssize_t)len || fsync(fd) != 0) rc = -1;
+        if (fd >= 0) close(fd);
+    }
+    free(data);
+    return rc;
+}
+
+static void drop_sources(const char* image, const workload_t* w) {
+    for (int f = 0; f < w->file_count; f++) {
+        char path[4096];
+        source_path(path, sizeof(path), image, f);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void remove_sources(const char* image, const workload_t* w) {
+    for (int f = 0; f < w->file_count; f++) {
+        char path[4096];
+        source_path(path, sizeof(path), image, f);
+        unlink(path);
+    }
+}
+
+// One import; seconds until mvfs_close and until the image is synced
+static int import_once(const char* image, const workload_t* w, int backend, int cold, double* t_close,
+                       double* t_sync) {
+    uint64_t size_kib = ((uint64_t)w->file_count * (w->file_mib + 1) << 10) + 8192;
+    if (mvfs_format(image, size_kib, 128 + (uint64_t)w->file_count, 0, NULL) != 0) return -1;
+    if (cold) drop_sources(image, w);
+    double t0 = now_sec();
+    mvfs_t* fs = mvfs_open(image, MVFS_RDWR);
+    if (!fs) return -1;
+    if (mvfs_set_io(fs, backend) != 0) {
+        mvfs_abort(fs);
+        return -1;
+    }
+    for (int f = 0; f < w->file_count; f++) {
+        char path[4096], name[32];
+        source_path(path, sizeof(path), image, f);
+        snprintf(name, sizeof(name), "file_%04d.bin", f);
+        if (mvfs_add(fs, ROOT_INO, name, path, 0, NULL) != 0) {
+            mvfs_abort(fs);
+            return -1;
+        }
+    }
+    if (mvfs_close(fs) != 0) return -1;
+    *t_close = now_sec() - t0;
+    int fd = open(image, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    *t_sync = now_sec() - t0;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    int quick = 0;
+    const char* image = "io_bench.img";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--image <scratch.img>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const workload_t workloads[] = {
+        { "1 large", 1, quick ? 128 : 512 },
+        { "1 MiB", quick ? 64 : 256, 1 },
+    };
+    static const int backends[] = { MVFS_IO_PREAD, MVFS_IO_URING };
+    static const char* backend_names[] = { "pread", "io_uring" };
+
+    printf("%-9s %-9s %-5s %10s %12s\n", "backend", "files", "src", "MiB/s", "MiB/s+fsync");
+    int rc = 0;
+    for (size_t w = 0; rc == 0 && w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        const workload_t* wl = &workloads[w];
+        if (write_sources(image, wl) != 0) {
+            fprintf(stderr, "Error: Cannot write source files: %s\n", strerror(errno));
+            remove_sources(image, wl);
+            rc = -1;
+            break;
+        }
+        double mib = (double)wl->file_count * wl->file_mib;
+        for (size_t b = 0; rc == 0 && b < sizeof(backends) / sizeof(backends[0]); b++) {
+            for (int cold = 0; rc == 0 && cold <= 1; cold++) {
+                double best_close = 0, best_sync = 0;
+                for (int r = 0; r < RUNS; r++) {
+                    double t_close, t_sync;
+                    if (import_once(image, wl, backends[b], cold, &t_close, &t_sync) != 0) {
+                        rc = -1;
+                        break;
+                    }
+                    if (r == 0 || t_close < best_close) best_close = t_close;
+                    if (r == 0 || t_sync < best_sync) best_sync = t_sync;
+                }
+                if (rc != 0 && backends[b] == MVFS_IO_URING) {
+                    printf("%-9s (not available: %s)\n", backend_names[b], strerror(errno));
+                    rc = 0;
+                    break;
+                }
+                if (rc == 0) {
+                    printf("%-9s %-9s %-5s %10.1f %12.1f\n", backend_names[b], wl->label, cold ? "cold" : "warm",
+                           mib / best_close, mib / best_sync);
+                }
+            }
+        }
+        remove_sources(image, wl);
+    }
+    unlink(image);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Import failed: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define HASH_BITS 14
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define TAIL_LITERALS 5      // the last bytes are never searched for matches
+#define SKIP_SHIFT 6         // step grows by one every 64 misses in a row
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Bytes equal at p and ref, comparing eight at a time, stopping at end
+static size_t match_length(const uint8_t* p, const uint8_t* ref, const uint8_t* end) {
+    const uint8_t* start = p;
+    while (p + 8 <= end) {
+        uint64_t a, b;
+        memcpy(&a, p, 8);
+        memcpy(&b, ref, 8);
+        if (a != b) return (size_t)(p - start) + (size_t)__builtin_ctzll(a ^ b) / 8;
+        p += 8;
+        ref += 8;
+    }
+    while (p < end && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return (size_t)(p - start);
+}
+
+// Writes a length's continuation bytes after its nibble was saturated
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emits one sequence (match_len 0: the final, literals-only one); NULL if
+// it does not fit before oend
+static uint8_t* put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* literals, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + (match_len - MIN_MATCH) / 255 + 1 : 0);
+    if ((size_t)(oend - op) < need) return NULL;
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t m = match_len - MIN_MATCH;
+    *token |= (uint8_t)(m < 15 ? m : 15);
+    if (m >= 15) op = put_length(op, m - 15);
+    return op;
+}
+
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    uint32_t table[1u << HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+    const uint8_t* limit = n > MIN_MATCH + TAIL_LITERALS ? end - MIN_MATCH - TAIL_LITERALS : src;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+    size_t misses = 0;
+
+    while (ip < limit) {
+        uint32_t seq = read32(ip);
+        uint32_t h = hash4(seq);
+        const uint8_t* ref = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+        if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+            ip += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) { // extend backwards
+            ip--;
+            ref--;
+        }
+        size_t len = MIN_MATCH + match_length(ip + MIN_MATCH, ref + MIN_MATCH, end - TAIL_LITERALS);
+        op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), len);
+        if (!op) return 0;
+        ip += len;
+        anchor = ip;
+        if (ip < limit) table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+    }
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Adds a length's continuation bytes; -1 if the input ends first
+static int get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t raw) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + raw;
+    for (;;) {
+        if (ip >= iend) return -1;
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) != 0) return -1;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return -1;
+        if (lit_len <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16); // short run: one fixed-size copy, the excess is overwritten later
+        } else {
+            memcpy(op, ip, lit_len);
+        }
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) return op == oend ? 0 : -1;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) != 0) return -1;
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(oend - op)) return -1;
+        const uint8_t* ref = op - offset;
+        uint8_t* end = op + match_len;
+        if (offset >= 8 && (size_t)(oend - op) >= match_len + 8) {
+            // 8 bytes at a time, each chunk reading only bytes already written
+            for (; op < end; op += 8, ref += 8) memcpy(op, ref, 8);
+            op = end;
+        } else if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op = end;
+        } else {
+            // Overlapping: [ref, op) repeats with period offset, so copies of
+            // op - ref bytes stay disjoint while the copied stretch doubles
+            while (op < end) {
+                size_t chunk = (size_t)(op - ref) < (size_t)(end - op) ? (size_t)(op - ref) : (size_t)(end - op);
+                memcpy(op, ref, chunk);
+                op += chunk;
+            }
+        }
+    }
+}
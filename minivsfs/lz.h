@@ -0,0 +1,27 @@
+// Fast LZ77 block codec for compressed MiniVSFS files.
+//
+// The format follows the LZ4 block layout: a sequence is a token byte (high
+// nibble literal count, low nibble match length - 4, 15 meaning "more bytes
+// follow", each adding up to 255), the literals, a 2-byte little-endian
+// match offset and the extra match-length bytes. The last sequence holds
+// literals only. Matches are found through a single-probe hash table of
+// 4-byte prefixes, and the search step grows over incompressible input, so
+// compression runs at several hundred MB/s and decompression faster still.
+#ifndef MINIVSFS_LZ_H
+#define MINIVSFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Worst-case compressed size of n bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compresses n bytes into at most cap bytes of dst; returns the compressed
+// size, or 0 if it would not fit
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+
+// Decompresses a block that must expand to exactly raw bytes; 0 on success,
+// -1 for malformed input (never reads or writes out of bounds)
+int lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t raw);
+
+#endif
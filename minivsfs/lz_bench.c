@@ -0,0 +1,271 @@
+// Compression ratio and throughput benchmark.
+// Build: make lz_bench    Run: ./lz_bench [--quick] [--image <scratch.img>]
+//
+// Every input is cut into ZFRAME_RAW frames, as mvfs_add does with
+// MVFS_COMPRESS, compressed and decompressed again (exit status 1 if a frame
+// does not round-trip). The inputs cover what images usually carry: text in
+// the style of the sample file_*.txt files, the C sources in the current
+// directory, structured binary (an inode table) and the two extremes, random
+// bytes and zeros. Then the text is added to a scratch image raw and
+// compressed and read back through mvfs_read, which shows the block savings
+// and what streaming decompression costs per read.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "lz.h"
+#include "mvfs.h"
+
+#define INPUT_SIZE (8u << 20)
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Space-separated words drawn from the sample files' vocabulary
+static size_t make_text(uint8_t* buf, size_t len) {
+    static const char* words[] = {
+        "umbrella", "tango", "quokka", "banana", "yankee", "falcon", "yak", "salamander",
+        "narwhal", "rhinoceros", "xylophone", "delta", "walrus", "juliet", "mike",
+    };
+    size_t n = 0;
+    while (n < len) {
+        const char* w = words[rand() % (int)(sizeof(words) / sizeof(words[0]))];
+        size_t wl = strlen(w);
+        if (n + wl + 1 > len) break;
+        memcpy(buf + n, w, wl);
+        n += wl;
+        buf[n++] = rand() % 12 == 0 ? '\n' : ' ';
+    }
+    return n;
+}
+
+// The *.c and *.h files of the current directory, repeated to fill len
+static size_t make_source(uint8_t* buf, size_t len) {
+    size_t n = 0;
+    for (int round = 0; round < 64 && n < len; round++) {
+        DIR* d = opendir(".");
+        if (!d) return 0;
+        size_t before = n;
+        struct dirent* e;
+        while ((e = readdir(d)) && n < len) {
+            size_t nl = strlen(e->d_name);
+            if (nl < 3 || (strcmp(e->d_name + nl - 2, ".c") != 0 && strcmp(e->d_name + nl - 2, ".h") != 0)) {
+                continue;
+            }
+            FILE* f = fopen(e->d_name, "rb");
+            if (!f) continue;
+            n += fread(buf + n, 1, len - n, f);
+            fclose(f);
+        }
+        closedir(d);
+        if (n == before) break;
+    }
+    return n;
+}
+
+// Inodes of small files as mkfs_builder lays them out
+static size_t make_inodes(uint8_t* buf, size_t len) {
+    size_t count = len / sizeof(inode_t);
+    inode_t* table = (inode_t*)buf;
+    memset(buf, 0, len);
+    for (size_t i = 0; i < count; i++) {
+        table[i].mode = 0100000;
+        table[i].links = 1;
+        table[i].size_bytes = 1000 + (uint64_t)(rand() % 60000);
+        table[i].atime = table[i].mtime = table[i].ctime = 1700000000 + i / 16;
+        for (uint64_t b = 0; b * BS < table[i].size_bytes && b < DIRECT_MAX; b++) {
+            table[i].direct[b] = (uint32_t)(100 + i * 16 + b);
+        }
+        inode_crc_finalize(&table[i]);
+    }
+    return count * sizeof(inode_t);
+}
+
+static size_t make_random(uint8_t* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) buf[i] = (uint8_t)rand();
+    return len;
+}
+
+static size_t make_zeros(uint8_t* buf, size_t len) {
+    memset(buf, 0, len);
+    return len;
+}
+
+// Codec only: compresses and decompresses frame by frame; returns -1 if a
+// frame does not round-trip
+static int bench_codec(const char* label, const uint8_t* data, size_t len, int rounds) {
+    size_t frames = (len + ZFRAME_RAW - 1) / ZFRAME_RAW;
+    uint8_t* packed = malloc(frames * LZ_BOUND(ZFRAME_RAW));
+    size_t* packed_len = malloc(frames * sizeof(size_t));
+    uint8_t* out = malloc(ZFRAME_RAW);
+    if (!packed || !packed_len || !out) {
+        free(packed);
+        free(packed_len);
+        free(out);
+        return -1;
+    }
+
+    size_t total = 0;
+    double t0 = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        total = 0;
+        for (size_t f = 0; f < frames; f++) {
+            size_t raw = len - f * ZFRAME_RAW < ZFRAME_RAW ? len - f * ZFRAME_RAW : ZFRAME_RAW;
+            packed_len[f] = lz_compress(data + f * ZFRAME_RAW, raw, packed + f * LZ_BOUND(ZFRAME_RAW),
+                                        LZ_BOUND(ZFRAME_RAW));
+            total += packed_len[f];
+        }
+    }
+    double ct = now_sec() - t0;
+
+    int rc = 0;
+    t0 = now_sec();
+    for (int r = 0; r < rounds && rc == 0; r++) {
+        for (size_t f = 0; f < frames; f++) {
+            size_t raw = len - f * ZFRAME_RAW < ZFRAME_RAW ? len - f * ZFRAME_RAW : ZFRAME_RAW;
+            if (lz_decompress(packed + f * LZ_BOUND(ZFRAME_RAW), packed_len[f], out, raw) != 0 ||
+                memcmp(out, data + f * ZFRAME_RAW, raw) != 0) {
+                fprintf(stderr, "FAIL %s: frame %zu does not round-trip\n", label, f);
+                rc = -1;
+                break;
+            }
+        }
+    }
+    double dt = now_sec() - t0;
+
+    if (rc == 0) {
+        printf("%-8s %10zu %10zu %8.1f%% %12.1f %12.1f\n", label, len, total, 100.0 * total / len,
+               (double)len * rounds / ct / (1 << 20), (double)len * rounds / dt / (1 << 20));
+    }
+    free(packed);
+    free(packed_len);
+    free(out);
+    return rc;
+}
+
+// Reads a whole file through mvfs_read in read_size calls; MiB/s or -1
+static double read_back(mvfs_t* fs, uint32_t ino, const uint8_t* want, size_t len, size_t read_size) {
+    uint8_t* buf = malloc(read_size);
+    if (!buf) return -1;
+    double t0 = now_sec();
+    for (size_t off = 0; off < len; off += read_size) {
+        ssize_t n = mvfs_read(fs, ino, buf, read_size, off);
+        if (n < 0 || memcmp(buf, want + off, (size_t)n) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    double dt = now_sec() - t0;
+    free(buf);
+    return (double)len / dt / (1 << 20);
+}
+
+// End to end: the same file added raw and compressed, then read back
+static int bench_image(const char* path, const uint8_t* data, size_t len) {
+    char host[4096];
+    snprintf(host, sizeof(host), "%s.src", path);
+    FILE* f = fopen(host, "wb");
+    if (!f) return -1;
+    size_t written = fwrite(data, 1, len, f);
+    if (fclose(f) != 0 || written != len) {
+        unlink(host);
+        return -1;
+    }
+
+    uint64_t size_kib = (len / 1024 * 2 + 4096 + 3) / 4 * 4;
+    int rc = mvfs_format(path, size_kib, 128, 0, NULL);
+    mvfs_t* fs = rc == 0 ? mvfs_open(path, MVFS_RDWR) : NULL;
+    uint32_t raw_ino = 0, z_ino = 0;
+    if (!fs || mvfs_add(fs, ROOT_INO, "raw.txt", host, 0, &raw_ino) != 0 ||
+        mvfs_add(fs, ROOT_INO, "packed.txt", host, MVFS_COMPRESS, &z_ino) != 0) {
+        if (fs) mvfs_abort(fs);
+        unlink(host);
+        return -1;
+    }
+    unlink(host);
+    if (mvfs_close(fs) != 0) return -1;
+
+    fs = mvfs_open(path, MVFS_RDONLY);
+    if (!fs) return -1;
+    mvfs_stat_t raw_st, z_st;
+    mvfs_stat(fs, raw_ino, &raw_st);
+    mvfs_stat(fs, z_ino, &z_st);
+    printf("\nimage: %zu bytes of text, %" PRIu64 " blocks raw, %" PRIu64 " compressed\n", len,
+           raw_st.blocks, z_st.blocks);
+    printf("%-8s %10s %12s %12s\n", "read", "size", "raw MiB/s", "packed MiB/s");
+    static const size_t read_sizes[] = { 4096, 65536, 1u << 20 };
+    for (size_t i = 0; rc == 0 && i < sizeof(read_sizes) / sizeof(read_sizes[0]); i++) {
+        double raw = read_back(fs, raw_ino, data, len, read_sizes[i]);
+        double packed = read_back(fs, z_ino, data, len, read_sizes[i]);
+        if (raw < 0 || packed < 0) {
+            fprintf(stderr, "FAIL image: %zu-byte reads do not match\n", read_sizes[i]);
+            rc = -1;
+            break;
+        }
+        printf("%-8s %10zu %12.1f %12.1f\n", "seq", read_sizes[i], raw, packed);
+    }
+    mvfs_close(fs);
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    int quick = 0;
+    const char* path = "lz_bench.img";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--image <scratch.img>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const struct {
+        const char* label;
+        size_t (*make)(uint8_t*, size_t);
+    } inputs[] = {
+        { "text", make_text }, { "source", make_source }, { "inodes", make_inodes },
+        { "random", make_random }, { "zeros", make_zeros },
+    };
+    uint8_t* buf = malloc(INPUT_SIZE);
+    if (!buf) return 1;
+    int rounds = quick ? 1 : 4;
+    srand(17);
+
+    printf("%-8s %10s %10s %9s %12s %12s\n", "input", "bytes", "packed", "ratio", "comp MiB/s", "decomp MiB/s");
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        size_t len = inputs[i].make(buf, INPUT_SIZE);
+        if (len == 0) {
+            printf("%-8s (no input)\n", inputs[i].label);
+            continue;
+        }
+        rc = bench_codec(inputs[i].label, buf, len, rounds);
+    }
+
+    if (rc == 0) {
+        srand(17);
+        size_t len = make_text(buf, quick ? INPUT_SIZE / 4 : INPUT_SIZE);
+        if (bench_image(path, buf, len) != 0) {
+            if (errno) fprintf(stderr, "Error: Scratch image '%s': %s\n", path, strerror(errno));
+            rc = -1;
+        }
+        unlink(path);
+    }
+    free(buf);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include "minivsfs.h"
+
+#include <string.h>
+
+#include "crc32.h"
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    // Covers superblock[0..4091]; everything past the struct is zero padding,
+    // so hash the struct and extend over the zeros arithmetically
+    uint32_t s = crc32_zeros(crc32((void *) sb, sizeof(*sb)), BS - 4 - sizeof(*sb));
+    sb->checksum = s;
+    return s;
+}
+
+uint32_t superblock_ext_crc_finalize(superblock_t* sb, const superblock_ext_t* ext) {
+    sb->checksum = 0;
+    uint32_t s = crc32_zeros(crc32((void *) sb, sizeof(*sb)), SB_EXT_OFFSET - sizeof(*sb));
+    s = crc32_update(s, ext, sizeof(*ext));
+    s = crc32_zeros(s, BS - 4 - SB_EXT_OFFSET - sizeof(*ext));
+    sb->checksum = s;
+    return s;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    de->checksum = x;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER INDEX ELEMENTS HAVE BEEN FINALIZED
+void dir_index_checksum_finalize(dir_index_t* idx) {
+    idx->checksum = 0;
+    idx->checksum = crc32(idx, sizeof(*idx));
+}
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3 0x165667B19E3779F9ull
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+uint64_t block_hash(const void* block) {
+    const uint8_t* data = block;
+    uint64_t lane[4] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1 };
+    for (size_t i = 0; i < BS; i += sizeof(lane)) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, data + i + l * sizeof(w), sizeof(w));
+            lane[l] = rotl64(lane[l] + w * HASH_PRIME2, 31) * HASH_PRIME1;
+        }
+    }
+    uint64_t k = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+    k ^= k >> 33;
+    k *= HASH_PRIME2;
+    k ^= k >> 29;
+    k *= HASH_PRIME3;
+    return k ^ k >> 32;
+}
+
+int merkle_levels(uint64_t leaves, uint64_t blocks[MERKLE_MAX_LEVELS]) {
+    int levels = 0;
+    uint64_t n = leaves ? leaves : 1;
+    do {
+        n = (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+        blocks[levels++] = n;
+    } while (n > 1 && levels < MERKLE_MAX_LEVELS);
+    return levels;
+}
+
+uint64_t merkle_tree_blocks(uint64_t leaves) {
+    uint64_t blocks[MERKLE_MAX_LEVELS];
+    uint64_t total = 0;
+    for (int l = merkle_levels(leaves, blocks); l > 0; l--) total += blocks[l - 1];
+    return total;
+}
@@ -0,0 +1,259 @@
+// MiniVSFS on-disk format shared by all the tools.
+// All multi-byte fields are little-endian; structures are written as-is.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BS 4096u               // block size
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define MVFS_MAGIC 0x4D565346u // "MVSF"
+
+// Inode modes. MiniVSFS keeps no permission bits, so the low 12 bits of
+// mode are free and mark how the inode's data is laid out.
+#define MODE_TYPE_MASK 0170000
+#define MODE_DIR       0040000
+#define MODE_FILE      0100000
+#define MODE_INLINE    0000001 // file bytes live in the inode (see INLINE_MAX)
+#define MODE_EXTENTS   0000002 // direct[] holds extent_t runs instead of block pointers
+#define MODE_DIR_INDEX 0000004 // directory with a hash index (see dir_index_t)
+#define MODE_COMPRESSED 0000010 // file stored as a stream of compressed frames (see zframe_t)
+
+// Superblock feature flags. An image only gets a flag once it holds a
+// structure that older tools would misread.
+#define FEATURE_INLINE_DATA 0x00000001u
+#define FEATURE_EXTENTS     0x00000002u
+#define FEATURE_DIR_INDEX   0x00000004u
+#define FEATURE_DEDUP       0x00000008u // shared data blocks, see superblock_ext_t
+#define FEATURE_COMPRESSED  0x00000010u
+#define FEATURE_FREE_COUNTS 0x00000020u // free counts and first-free hints, see superblock_ext_t
+#define FEATURE_MERKLE      0x00000040u // hash tree over the data region, see superblock_ext_t
+
+#pragma pack(push, 1)
+typedef struct {
+    // CREATE YOUR SUPERBLOCK HERE
+    // ADD ALL FIELDS AS PROVIDED BY THE SPECIFICATION
+    uint32_t magic;               // 0x4D565346
+    uint32_t version;             // 1
+    uint32_t block_size;          // 4096
+    uint64_t total_blocks;        // size_kib * 1024 / 4096
+    uint64_t inode_count;         // from CLI
+    uint64_t inode_bitmap_start;  // 1
+    uint64_t inode_bitmap_blocks; // 1
+    uint64_t data_bitmap_start;   // 2
+    uint64_t data_bitmap_blocks;  // 1
+    uint64_t inode_table_start;   // 3
+    uint64_t inode_table_blocks;  // calculated
+    uint64_t data_region_start;   // calculated
+    uint64_t data_region_blocks;  // calculated
+    uint64_t root_inode;          // 1
+    uint64_t mtime_epoch;         // build time
+    uint32_t flags;               // FEATURE_* bits, 0 for a plain image
+    
+    // THIS FIELD SHOULD STAY AT THE END
+    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
+    uint32_t checksum;            // crc32(superblock[0..4091])
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+// Fields added by later features live in block 0 after the superblock, at
+// SB_EXT_OFFSET. Each is zero unless its FEATURE_* bit is set and, being part
+// of superblock[0..4091], is covered by the superblock checksum.
+#define SB_EXT_OFFSET 128u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t refcount_start;      // FEATURE_DEDUP: first refcount table block
+    uint64_t refcount_blocks;     // FEATURE_DEDUP: refcount table length
+    uint64_t free_inodes;         // FEATURE_FREE_COUNTS: clear bits in the inode bitmap
+    uint64_t free_blocks;         // FEATURE_FREE_COUNTS: clear bits in the data bitmap
+    uint64_t first_free_inode;    // FEATURE_FREE_COUNTS: lowest clear inode bitmap bit
+    uint64_t first_free_block;    // FEATURE_FREE_COUNTS: lowest clear data bitmap bit
+    uint64_t merkle_start;        // FEATURE_MERKLE: first hash tree block
+    uint64_t merkle_blocks;       // FEATURE_MERKLE: merkle_tree_blocks(data_region_blocks)
+    uint64_t merkle_root;         // FEATURE_MERKLE: block_hash of the tree's top block
+} superblock_ext_t;
+#pragma pack(pop)
+_Static_assert(SB_EXT_OFFSET + sizeof(superblock_ext_t) <= BS - 4, "extension must precede the checksum tail");
+
+// Deduplicated images (FEATURE_DEDUP) let several files point at one data
+// block. The refcount table keeps a uint16_t per data-region block counting
+// its references beyond the first, so ordinary blocks stay 0 and a shared
+// block may only be freed once its count is back at 0. The table fills
+// refcount_blocks contiguous data-region blocks, marked used in the bitmap.
+#define REFCOUNTS_PER_BLOCK (BS / sizeof(uint16_t))
+#define REFCOUNT_MAX UINT16_MAX
+
+// FEATURE_FREE_COUNTS images keep each bitmap's free count and lowest clear
+// bit in the superblock, rewritten with every bitmap change, so free space is
+// known without scanning and allocation skips the allocated prefix. Bit 0 of
+// both bitmaps is always set (root inode, root directory block), so a
+// first-free value of 0 means the fields were never written. Bitmaps are never
+// written while the flag is set on disk: a flush first rewrites block 0 with
+// the flag and the fields cleared, then the bitmaps, then block 0 with the new
+// counts, with an fdatasync after each of the first two steps. A flush cut
+// short between the two, by an error or a power loss, therefore leaves an
+// image without the flag, and opening it counts the bitmaps rather than
+// trusting the summary.
+
+// FEATURE_MERKLE images hold a hash tree over the data region. Leaf i is the
+// block_hash of data block i while its bitmap bit is set, and 0 while it is
+// free (free blocks may hold what an aborted add left there) or one of the
+// tree's own blocks. Level 0 packs MERKLE_FANOUT leaf hashes per block, each higher
+// level packs the block_hash of MERKLE_FANOUT blocks of the level below, and
+// the single block at the top is hashed into merkle_root. The levels lie one
+// after another, bottom first, in merkle_blocks contiguous data-region blocks
+// marked used in the bitmap. Unused entries of a level's last block are 0.
+#define MERKLE_FANOUT (BS / sizeof(uint64_t))
+#define MERKLE_MAX_LEVELS 4   // 512^4 leaves is past any 32-bit block number
+
+#pragma pack(push,1)
+typedef struct {
+    // CREATE YOUR INODE HERE
+    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
+    uint16_t mode;           // MODE_DIR/MODE_FILE plus MODE_* layout flags
+    uint16_t links;          // link count
+    uint32_t uid;            // user id (0)
+    uint32_t gid;            // group id (0)
+    uint64_t size_bytes;     // size in bytes
+    uint64_t atime;          // access time
+    uint64_t mtime;          // modification time
+    uint64_t ctime;          // creation time
+    uint32_t direct[12];     // direct block pointers
+    uint32_t reserved_0;     // 0
+    uint32_t reserved_1;     // 0
+    uint32_t reserved_2;     // 0
+    uint32_t proj_id;        // project id
+    uint32_t uid16_gid16;    // 0
+    uint64_t xattr_ptr;      // 0
+
+    // THIS FIELD SHOULD STAY AT THE END
+    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
+    uint64_t inode_crc;   // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    // CREATE YOUR DIRECTORY ENTRY STRUCTURE HERE
+    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
+    uint32_t inode_no;   // inode number (0 if free)
+    uint8_t type;        // 1=file, 2=directory
+    char name[58];       // filename/dirname
+
+    uint8_t  checksum; // XOR of bytes 0..62
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+// Inline files keep their bytes in place of direct[] and everything after it
+// up to the checksum (offsets 44..119), so the inode CRC still covers them
+#define INLINE_OFFSET offsetof(inode_t, direct)
+#define INLINE_MAX (offsetof(inode_t, inode_crc) - INLINE_OFFSET)
+_Static_assert(INLINE_MAX == 76, "inline area size mismatch");
+
+static inline uint8_t* inode_inline_data(inode_t* ino) {
+    return (uint8_t*)ino + INLINE_OFFSET;
+}
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t start;      // first block (absolute block number)
+    uint32_t len;        // number of contiguous blocks
+} extent_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_t)==8, "extent size mismatch");
+
+// Extent-mapped inodes (MODE_EXTENTS) keep the first EXTENTS_INLINE runs in
+// place of direct[]; reserved_0 holds the total run count and reserved_1 the
+// overflow block holding the remaining runs (0 when everything fits inline).
+#define EXTENTS_INLINE (sizeof(((inode_t*)0)->direct) / sizeof(extent_t))
+#define EXTENTS_PER_BLOCK (BS / sizeof(extent_t))
+#define EXTENTS_MAX (EXTENTS_INLINE + EXTENTS_PER_BLOCK)
+_Static_assert(EXTENTS_INLINE == 6, "inline extent count mismatch");
+
+static inline extent_t* inode_extents(inode_t* ino) {
+    return (extent_t*)ino->direct;
+}
+
+// Compressed files (MODE_COMPRESSED) keep size_bytes as the uncompressed
+// size; reserved_2 holds the number of data blocks their frame stream fills,
+// mapped with direct pointers or extents as usual. Each frame is a zframe_t
+// header followed by packed_len bytes: an LZ block (see lz.h) expanding to
+// raw_len bytes, or with ZFRAME_STORED the raw bytes themselves. Every frame
+// but the last expands to ZFRAME_RAW bytes; the rest of the last block is
+// zero.
+#define ZFRAME_RAW (64u * 1024)
+#define ZFRAME_STORED 0x80000000u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t raw_len;
+    uint32_t packed_len;     // plus ZFRAME_STORED for frames kept uncompressed
+} zframe_t;
+#pragma pack(pop)
+_Static_assert(sizeof(zframe_t)==8, "frame header size mismatch");
+
+// Longest frame stream for size bytes: every frame stored
+static inline uint64_t zstream_max(uint64_t size) {
+    return size + (size + ZFRAME_RAW - 1) / ZFRAME_RAW * sizeof(zframe_t);
+}
+
+// Data blocks mapped by a file inode
+static inline uint64_t inode_data_blocks(const inode_t* ino) {
+    if (ino->mode & MODE_INLINE) return 0;
+    if (ino->mode & MODE_COMPRESSED) return ino->reserved_2;
+    return (ino->size_bytes + BS - 1) / BS;
+}
+
+#define DIRENTS_PER_BLOCK (BS / sizeof(dirent64_t))
+
+// Hashed directories (MODE_DIR_INDEX) use extendible hashing over the low
+// bits of crc32(name). direct[0] is still the first leaf block, holding "."
+// and ".." in slots 0 and 1, and direct[1] points at the index block. Leaf
+// blocks are plain arrays of dirent64_t records with their XOR checksums.
+// Index slot i covers every name whose hash has i in its low global_depth
+// bits; slots whose leaf has a smaller local depth share that leaf.
+#define DIR_INDEX_MAGIC 0x5844564Du // "MVDX"
+#define DIR_INDEX_MAX_DEPTH 9
+#define DIR_INDEX_SLOTS (1u << DIR_INDEX_MAX_DEPTH)
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;                          // DIR_INDEX_MAGIC
+    uint16_t global_depth;                   // slots in use = 1 << global_depth
+    uint16_t reserved;                       // 0
+    uint32_t leaf_count;                     // distinct leaf blocks
+    uint32_t checksum;                       // crc32 of the block with this field zeroed
+    uint32_t leaf[DIR_INDEX_SLOTS];          // slot -> leaf block number
+    uint8_t  local_depth[DIR_INDEX_SLOTS];   // hash bits the slot's leaf is split on
+    uint8_t  pad[BS - 16 - DIR_INDEX_SLOTS * 5];
+} dir_index_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dir_index_t)==BS, "directory index must fill one block");
+
+// WARNING: CALL THESE ONLY AFTER ALL OTHER ELEMENTS HAVE BEEN FINALIZED
+uint32_t superblock_crc_finalize(superblock_t *sb);
+// Same, for a block 0 that carries ext at SB_EXT_OFFSET
+uint32_t superblock_ext_crc_finalize(superblock_t* sb, const superblock_ext_t* ext);
+void inode_crc_finalize(inode_t* ino);
+void dirent_checksum_finalize(dirent64_t* de);
+void dir_index_checksum_finalize(dir_index_t* idx);
+
+// 64-bit hash of one block: its words go round-robin into four lanes mixed
+// with the xxHash64 round, then fold and avalanche. Unlike a CRC it is not
+// linear, so it sees inode edits that keep each inode's CRC valid. Catches
+// corruption, not deliberate tampering.
+uint64_t block_hash(const void* block);
+// Fills blocks[] with the size of each tree level, bottom up, and returns the
+// level count
+int merkle_levels(uint64_t leaves, uint64_t blocks[MERKLE_MAX_LEVELS]);
+uint64_t merkle_tree_blocks(uint64_t leaves);
+
+#endif
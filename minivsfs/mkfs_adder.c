@@ -1,4 +1,5 @@
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,166 +7,166 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-#pragma pack(push, 1)
+#include "minivsfs.h"
+#include "crc32.h"
+#include "mvfs.h"
+#include "stats.h"
 
-typedef struct {
-    // CREATE YOUR SUPERBLOCK HERE
-    // ADD ALL FIELDS AS PROVIDED BY THE SPECIFICATION
-    uint32_t magic;               // 0x4D565346
-    uint32_t version;             // 1
-    uint32_t block_size;          // 4096
-    uint64_t total_blocks;        // size_kib * 1024 / 4096
-    uint64_t inode_count;         // from CLI
-    uint64_t inode_bitmap_start;  // 1
-    uint64_t inode_bitmap_blocks; // 1
-    uint64_t data_bitmap_start;   // 2
-    uint64_t data_bitmap_blocks;  // 1
-    uint64_t inode_table_start;   // 3
-    uint64_t inode_table_blocks;  // calculated
-    uint64_t data_region_start;   // calculated
-    uint64_t data_region_blocks;  // calculated
-    uint64_t root_inode;          // 1
-    uint64_t mtime_epoch;         // build time
-    uint32_t flags;               // 0
-    
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum;            // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    // CREATE YOUR INODE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint16_t mode;           // file/directory mode
-    uint16_t links;          // link count
-    uint32_t uid;            // user id (0)
-    uint32_t gid;            // group id (0)
-    uint64_t size_bytes;     // size in bytes
-    uint64_t atime;          // access time
-    uint64_t mtime;          // modification time
-    uint64_t ctime;          // creation time
-    uint32_t direct[12];     // direct block pointers
-    uint32_t reserved_0;     // 0
-    uint32_t reserved_1;     // 0
-    uint32_t reserved_2;     // 0
-    uint32_t proj_id;        // project id
-    uint32_t uid16_gid16;    // 0
-    uint64_t xattr_ptr;      // 0
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc;   // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --input <input.img> --output <output.img> --file <filename | -> [--name <entry>] [--file ...] [--inline] [--dedup | --compress] [--merkle] [--io <auto | pread | io_uring>] [--stats json]\n", prog_name);
+    fprintf(stderr, "       %s --input <input.img> --output <output.img> --manifest <list.txt | -> [--inline] [--dedup | --compress] [--merkle] [--io <auto | pread | io_uring>] [--stats json]\n", prog_name);
+}
 
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+// =================================BATCH ADD===================================
+// The whole batch runs against one libminivsfs handle: every file is checked
+// and every entry created before any data is written, then the files are
+// filled and the image metadata is flushed once when the handle is closed.
+// If anything fails the handle is aborted and the image is left as it was.
+// With --dedup or --compress each file is created and filled in one step
+// (mvfs_add), as the blocks it needs are only known once its contents are
+// hashed or compressed; names are then checked up front instead.
+// Streams (stdin, named pipes) have no size to plan with and are always
+// added in one step, allocating blocks as their data arrives.
 
-#pragma pack(push,1)
 typedef struct {
-    // CREATE YOUR DIRECTORY ENTRY STRUCTURE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint32_t inode_no;   // inode number (0 if free)
-    uint8_t type;        // 1=file, 2=directory
-    char name[58];       // filename/dirname
-
-    uint8_t  checksum; // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+    const char* path;                 // host file to copy in
+    char name[sizeof(((dirent64_t*)0)->name)]; // entry in the root directory
+    uint64_t size;
+    uint64_t blocks_needed;           // 0 for inline files
+    int inline_data;                  // bytes stored in the inode itself
+    uint32_t inode_num;               // 1-indexed
+    int stream;                       // "-" or a pipe: size known only once added
+} add_job_t;
 
+typedef struct {
+    add_job_t* items;
+    size_t count;
+    size_t cap;
+    char** owned_paths;               // paths read from a manifest
+    size_t owned_count;
+    size_t owned_cap;
+} job_list_t;
 
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+static int job_list_push(job_list_t* jobs, const char* path) {
+    if (jobs->count == jobs->cap) {
+        size_t cap = jobs->cap ? jobs->cap * 2 : 16;
+        add_job_t* items = realloc(jobs->items, cap * sizeof(*items));
+        if (!items) return -1;
+        jobs->items = items;
+        jobs->cap = cap;
     }
+    memset(&jobs->items[jobs->count], 0, sizeof(add_job_t));
+    jobs->items[jobs->count++].path = path;
+    return 0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+// Reads one path per line; blank lines and lines starting with '#' are skipped
+static int job_list_load_manifest(job_list_t* jobs, const char* manifest) {
+    FILE* fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!fp) return -1;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int rc = 0;
+    while ((len = getline(&line, &line_cap, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        if (jobs->owned_count == jobs->owned_cap) {
+            size_t cap = jobs->owned_cap ? jobs->owned_cap * 2 : 16;
+            char** owned = realloc(jobs->owned_paths, cap * sizeof(*owned));
+            if (!owned) { rc = -1; break; }
+            jobs->owned_paths = owned;
+            jobs->owned_cap = cap;
+        }
+        char* path = strdup(line);
+        if (!path) { rc = -1; break; }
+        jobs->owned_paths[jobs->owned_count++] = path;
+        if (job_list_push(jobs, path) != 0) { rc = -1; break; }
+    }
+    if (ferror(fp)) rc = -1;
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return rc;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+static int by_name(const void* a, const void* b) {
+    return strcmp((*(add_job_t* const*)a)->name, (*(add_job_t* const*)b)->name);
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
+// First job whose name repeats an earlier one in the batch, or NULL
+static const add_job_t* job_list_duplicate(const job_list_t* jobs) {
+    add_job_t** sorted = malloc(jobs->count * sizeof(*sorted));
+    if (!sorted) return NULL;
+    for (size_t j = 0; j < jobs->count; j++) sorted[j] = &jobs->items[j];
+    qsort(sorted, jobs->count, sizeof(*sorted), by_name);
+    const add_job_t* dup = NULL;
+    for (size_t j = 1; j < jobs->count && !dup; j++) {
+        if (strcmp(sorted[j - 1]->name, sorted[j]->name) == 0) dup = sorted[j];
+    }
+    free(sorted);
+    return dup;
 }
 
-void print_usage(const char* prog_name) {
-    fprintf(stderr, "Usage: %s --input <input.img> --output <output.img> --file <filename>\n", prog_name);
+// Adds a job in one step with mvfs_add (mvfs_add_fd for stdin); a stream's
+// size is only known afterwards
+static int add_in_one_step(mvfs_t* fs, add_job_t* job, int flags) {
+    int rc = strcmp(job->path, "-") == 0
+        ? mvfs_add_fd(fs, ROOT_INO, job->name, STDIN_FILENO, flags, &job->inode_num)
+        : mvfs_add(fs, ROOT_INO, job->name, job->path, flags, &job->inode_num);
+    if (rc != 0 || !job->stream) return rc;
+    mvfs_stat_t st;
+    if (mvfs_stat(fs, job->inode_num, &st) != 0) return -1;
+    job->size = st.size;
+    job->inline_data = (flags & MVFS_INLINE) && st.size > 0 && st.size <= INLINE_MAX;
+    job->blocks_needed = job->inline_data ? 0 : (st.size + BS - 1) / BS;
+    return 0;
 }
 
-int find_free_inode(uint8_t* inode_bitmap, uint64_t inode_count) {
-    // First-fit allocation for inodes (1-indexed)
-    for (uint64_t i = 0; i < inode_count; i++) {
-        uint64_t byte_idx = i / 8;
-        uint64_t bit_idx = i % 8;
-        if (!(inode_bitmap[byte_idx] & (1 << bit_idx))) {
-            return i + 1; // 1-indexed
-        }
-    }
-    return -1; // No free inode
+// How a job's input is named in messages
+static const char* job_label(const add_job_t* job) {
+    return strcmp(job->path, "-") == 0 ? "stdin" : job->path;
 }
 
-int find_free_data_block(uint8_t* data_bitmap, uint64_t data_blocks) {
-    // First-fit allocation for data blocks
-    for (uint64_t i = 0; i < data_blocks; i++) {
-        uint64_t byte_idx = i / 8;
-        uint64_t bit_idx = i % 8;
-        if (!(data_bitmap[byte_idx] & (1 << bit_idx))) {
-            return i;
-        }
+static void report_add_error(const char* image, const add_job_t* job) {
+    if (errno == EEXIST) {
+        fprintf(stderr, "Error: '%s' already exists in the root directory\n", job->name);
+    } else if (errno == EFBIG) {
+        fprintf(stderr, "Error: File '%s' is too fragmented (more than %zu extents)\n",
+                job_label(job), (size_t)EXTENTS_MAX);
+    } else if (errno == ENOSPC) {
+        fprintf(stderr, "Error: No space left in '%s' (adding '%s')\n", image, job_label(job));
+    } else {
+        fprintf(stderr, "Error: Cannot add file '%s': %s\n", job_label(job), strerror(errno));
     }
-    return -1; // No free data block
 }
 
-void set_bitmap_bit(uint8_t* bitmap, int bit_number) {
-    uint64_t byte_idx = bit_number / 8;
-    uint64_t bit_idx = bit_number % 8;
-    bitmap[byte_idx] |= (1 << bit_idx);
+static void job_list_free(job_list_t* jobs) {
+    for (size_t i = 0; i < jobs->owned_count; i++) free(jobs->owned_paths[i]);
+    free(jobs->owned_paths);
+    free(jobs->items);
 }
 
-int main(int argc, char* argv[]) {
+// =================================BATCH ADD===================================
+
+static int print_stats; // --stats json: counters and phase times on stderr at exit
+
+static int add_batch(int argc, char* argv[]) {
     crc32_init();
+    stats_phase("parse");
     
     char* input_name = NULL;
     char* output_name = NULL;
-    char* file_name = NULL;
+    job_list_t jobs = {0};
+    int stdin_used = 0;
+    int allow_inline = 0;
+    int dedup = 0;
+    int compress = 0;
+    int merkle = 0;
+    int io_backend = MVFS_IO_PREAD;
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -174,217 +175,295 @@ int main(int argc, char* argv[]) {
         } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
             output_name = argv[++i];
         } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
-            file_name = argv[++i];
+            if (job_list_push(&jobs, argv[++i]) != 0) {
+                fprintf(stderr, "Error: Out of memory\n");
+                job_list_free(&jobs);
+                return 1;
+            }
+            stdin_used += strcmp(argv[i], "-") == 0;
+        } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc && i >= 2 && strcmp(argv[i - 2], "--file") == 0) {
+            // Names the entry of the --file just before it
+            add_job_t* job = &jobs.items[jobs.count - 1];
+            const char* name = argv[++i];
+            if (strlen(name) >= sizeof(job->name)) {
+                fprintf(stderr, "Error: Entry name '%s' is longer than %zu characters\n", name,
+                        sizeof(job->name) - 1);
+                job_list_free(&jobs);
+                return 1;
+            }
+            strcpy(job->name, name);
+        } else if (strcmp(argv[i], "--inline") == 0) {
+            allow_inline = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup = 1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = 1;
+        } else if (strcmp(argv[i], "--merkle") == 0) {
+            merkle = 1;
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            const char* backend = argv[++i];
+            if (strcmp(backend, "auto") == 0) {
+                io_backend = MVFS_IO_AUTO;
+            } else if (strcmp(backend, "pread") == 0) {
+                io_backend = MVFS_IO_PREAD;
+            } else if (strcmp(backend, "io_uring") == 0) {
+                io_backend = MVFS_IO_URING;
+            } else {
+                print_usage(argv[0]);
+                job_list_free(&jobs);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+            print_stats = 1;
+            i++;
+        } else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            const char* manifest = argv[++i];
+            stdin_used += strcmp(manifest, "-") == 0;
+            if (job_list_load_manifest(&jobs, manifest) != 0) {
+                fprintf(stderr, "Error: Cannot read manifest '%s': %s\n", manifest, strerror(errno));
+                job_list_free(&jobs);
+                return 1;
+            }
         } else {
             print_usage(argv[0]);
+            job_list_free(&jobs);
             return 1;
         }
     }
     
-    if (!input_name || !output_name || !file_name) {
+    if (!input_name || !output_name || jobs.count == 0 || (dedup && compress) || stdin_used > 1) {
         print_usage(argv[0]);
+        job_list_free(&jobs);
         return 1;
     }
     
-    // Check if file exists and get its size
-    struct stat file_stat;
-    if (stat(file_name, &file_stat) != 0) {
-        fprintf(stderr, "Error: Cannot access file '%s': %s\n", file_name, strerror(errno));
-        return 1;
-    }
-    
-    if (!S_ISREG(file_stat.st_mode)) {
-        fprintf(stderr, "Error: '%s' is not a regular file\n", file_name);
-        return 1;
-    }
-    
-    uint64_t file_size = file_stat.st_size;
-    uint64_t blocks_needed = (file_size + BS - 1) / BS; // Round up
-    
-    if (blocks_needed > DIRECT_MAX) {
-        fprintf(stderr, "Error: File too large (requires %" PRIu64 " blocks, max %d)\n", blocks_needed, DIRECT_MAX);
-        return 1;
+    // Check that every file exists and get its size before touching the image
+    stats_phase("stat");
+    uint64_t total_bytes = 0;
+    uint64_t total_blocks_needed = 0;
+    for (size_t j = 0; j < jobs.count; j++) {
+        add_job_t* job = &jobs.items[j];
+        struct stat file_stat;
+        if (strcmp(job->path, "-") == 0) {
+            if (job->name[0] == '\0') {
+                fprintf(stderr, "Error: Reading a file from stdin needs --name <entry>\n");
+                job_list_free(&jobs);
+                return 1;
+            }
+            job->stream = 1;
+        }
+        if (!job->stream && stat(job->path, &file_stat) != 0) {
+            fprintf(stderr, "Error: Cannot access file '%s': %s\n", job->path, strerror(errno));
+            job_list_free(&jobs);
+            return 1;
+        }
+        if (!job->stream) job->stream = S_ISFIFO(file_stat.st_mode) || S_ISCHR(file_stat.st_mode);
+        if (job->stream && dedup) {
+            fprintf(stderr, "Error: --dedup cannot read '%s': streams can only be read once\n", job_label(job));
+            job_list_free(&jobs);
+            return 1;
+        }
+        if (strcmp(job->path, "-") == 0) continue;
+        if (!S_ISREG(file_stat.st_mode) && !job->stream) {
+            fprintf(stderr, "Error: '%s' is not a regular file or a stream\n", job->path);
+            job_list_free(&jobs);
+            return 1;
+        }
+        
+        // Extract just the filename without path, unless --name gave one
+        if (job->name[0] == '\0') {
+            const char* basename = strrchr(job->path, '/');
+            basename = basename ? basename + 1 : job->path;
+            strncpy(job->name, basename, sizeof(job->name) - 1);
+            job->name[sizeof(job->name) - 1] = '\0'; // Ensure null termination
+        }
+        if (job->stream) continue; // sized once it has been added
+
+        job->size = file_stat.st_size;
+        job->blocks_needed = (job->size + BS - 1) / BS; // Round up
+        
+        // Tiny files can skip the data block entirely
+        if (allow_inline && job->size > 0 && job->size <= INLINE_MAX) {
+            job->inline_data = 1;
+            job->blocks_needed = 0;
+        }
+        
+        if (job->blocks_needed > UINT32_MAX) {
+            fprintf(stderr, "Error: File '%s' too large (requires %" PRIu64 " blocks)\n",
+                    job->path, job->blocks_needed);
+            job_list_free(&jobs);
+            return 1;
+        }
+        total_bytes += job->size;
+        total_blocks_needed += job->blocks_needed;
     }
     
-    // Open input image
-    FILE* input_fp = fopen(input_name, "rb");
-    if (!input_fp) {
+    // Work in place when --output names the same file as --input
+    struct stat input_stat, output_stat;
+    if (stat(input_name, &input_stat) != 0) {
         fprintf(stderr, "Error: Cannot open input file '%s': %s\n", input_name, strerror(errno));
+        job_list_free(&jobs);
         return 1;
     }
-    
-    // Read superblock
-    superblock_t sb;
-    fread(&sb, sizeof(sb), 1, input_fp);
-    
-    // Validate magic number
-    if (sb.magic != 0x4D565346) {
-        fprintf(stderr, "Error: Invalid file system magic number\n");
-        fclose(input_fp);
-        return 1;
-    }
-    
-    // Read entire image into memory for easier manipulation
-    fseek(input_fp, 0, SEEK_END);
-    long image_size = ftell(input_fp);
-    fseek(input_fp, 0, SEEK_SET);
-    
-    uint8_t* image_data = malloc(image_size);
-    fread(image_data, 1, image_size, input_fp);
-    fclose(input_fp);
-    
-    // Get pointers to different sections
-    uint8_t* inode_bitmap = image_data + sb.inode_bitmap_start * BS;
-    uint8_t* data_bitmap = image_data + sb.data_bitmap_start * BS;
-    inode_t* inode_table = (inode_t*)(image_data + sb.inode_table_start * BS);
-    
-    // Find free inode
-    int free_inode_num = find_free_inode(inode_bitmap, sb.inode_count);
-    if (free_inode_num < 0) {
-        fprintf(stderr, "Error: No free inodes available\n");
-        free(image_data);
-        return 1;
-    }
-    
-    // Find free data blocks
-    int free_blocks[DIRECT_MAX];
-    int blocks_found = 0;
-    for (uint64_t i = 0; i < sb.data_region_blocks && (uint64_t)blocks_found < blocks_needed; i++) {
-        if (find_free_data_block(data_bitmap, sb.data_region_blocks) >= 0) {
-            uint64_t byte_idx = i / 8;
-            uint64_t bit_idx = i % 8;
-            if (!(data_bitmap[byte_idx] & (1 << bit_idx))) {
-                free_blocks[blocks_found++] = i;
-            }
+    int in_place = stat(output_name, &output_stat) == 0 &&
+                   output_stat.st_dev == input_stat.st_dev &&
+                   output_stat.st_ino == input_stat.st_ino;
+    
+    // A separate output starts as a copy of the input and receives the changes
+    stats_phase("open");
+    mvfs_t* fs = in_place ? mvfs_open(input_name, MVFS_RDWR) : mvfs_open_copy(input_name, output_name);
+    if (!fs) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is not a valid MiniVSFS image\n", input_name);
+        } else {
+            fprintf(stderr, "Error: Cannot open input file '%s': %s\n", input_name, strerror(errno));
         }
-    }
-    
-    if ((uint64_t)blocks_found < blocks_needed) {
-        fprintf(stderr, "Error: Not enough free data blocks (need %" PRIu64 ", found %d)\n", blocks_needed, blocks_found);
-        free(image_data);
+        job_list_free(&jobs);
         return 1;
     }
     
-    // Read file content
-    FILE* file_fp = fopen(file_name, "rb");
-    if (!file_fp) {
-        fprintf(stderr, "Error: Cannot open file '%s': %s\n", file_name, strerror(errno));
-        free(image_data);
-        return 1;
+    if (io_backend != MVFS_IO_PREAD && mvfs_set_io(fs, io_backend) != 0) {
+        fprintf(stderr, "Error: Cannot set up the %s I/O backend: %s\n",
+                io_backend == MVFS_IO_URING ? "io_uring" : "auto", strerror(errno));
+        goto fail;
     }
     
-    // Mark inode as used
-    set_bitmap_bit(inode_bitmap, free_inode_num - 1); // Convert to 0-indexed for bitmap
-    
-    // Mark data blocks as used
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        set_bitmap_bit(data_bitmap, free_blocks[i]);
+    // A hash tree the image already has is kept current whether or not
+    // --merkle is given; a new one is allocated before the capacity check
+    if (merkle && mvfs_merkle_enable(fs) != 0) {
+        fprintf(stderr, "Error: Cannot allocate the hash tree: %s\n", strerror(errno));
+        goto fail;
     }
     
-    // Create new inode for the file
-    time_t current_time = time(NULL);
-    inode_t* new_inode = &inode_table[free_inode_num - 1]; // Convert to 0-indexed for array
-    memset(new_inode, 0, sizeof(inode_t));
-    new_inode->mode = 0100000; // file mode (0100000)8
-    new_inode->links = 1;
-    new_inode->uid = 0;
-    new_inode->gid = 0;
-    new_inode->size_bytes = file_size;
-    new_inode->atime = current_time;
-    new_inode->mtime = current_time;
-    new_inode->ctime = current_time;
-    
-    // Set direct block pointers
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        new_inode->direct[i] = sb.data_region_start + free_blocks[i];
+    // Capacity is checked up front so a batch that cannot fit fails before
+    // anything is allocated; deduplicated batches may need far fewer blocks
+    uint64_t free_data_blocks = mvfs_free_blocks(fs);
+    if (!dedup && free_data_blocks < total_blocks_needed) {
+        fprintf(stderr, "Error: Not enough free data blocks (need %" PRIu64 ", found %" PRIu64 ")\n",
+                total_blocks_needed, free_data_blocks);
+        goto fail;
     }
-    for (uint64_t i = blocks_needed; i < DIRECT_MAX; i++) {
-        new_inode->direct[i] = 0;
+    uint64_t free_inodes = mvfs_free_inodes(fs);
+    if (free_inodes < jobs.count) {
+        fprintf(stderr, "Error: No free inodes available (for '%s')\n", jobs.items[free_inodes].path);
+        goto fail;
     }
     
-    new_inode->reserved_0 = 0;
-    new_inode->reserved_1 = 0;
-    new_inode->reserved_2 = 0;
-    new_inode->proj_id = 0;
-    new_inode->uid16_gid16 = 0;
-    new_inode->xattr_ptr = 0;
-    inode_crc_finalize(new_inode);
-    
-    // Write file data to allocated blocks
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        uint64_t block_offset = (sb.data_region_start + free_blocks[i]) * BS;
-        uint64_t bytes_to_read = (i == blocks_needed - 1) ? 
-                                (file_size - i * BS) : BS;
-        
-        fread(image_data + block_offset, 1, bytes_to_read, file_fp);
-        
-        // Zero-pad the rest of the block if needed
-        if (bytes_to_read < BS) {
-            memset(image_data + block_offset + bytes_to_read, 0, BS - bytes_to_read);
+    int one_step = dedup || compress;
+    uint64_t stored_blocks = 0;
+    stats_phase(one_step ? "copy" : "create");
+    if (one_step) {
+        const add_job_t* dup = job_list_duplicate(&jobs);
+        for (size_t j = 0; !dup && j < jobs.count; j++) {
+            uint32_t existing;
+            if (mvfs_lookup(fs, jobs.items[j].name, &existing) == 0) dup = &jobs.items[j];
+        }
+        if (dup) {
+            fprintf(stderr, "Error: '%s' already exists in the root directory\n", dup->name);
+            goto fail;
+        }
+        for (size_t j = 0; j < jobs.count; j++) {
+            add_job_t* job = &jobs.items[j];
+            int flags = (dedup ? MVFS_DEDUP : MVFS_COMPRESS) | (allow_inline ? MVFS_INLINE : 0);
+            if (add_in_one_step(fs, job, flags) != 0) {
+                report_add_error(input_name, job);
+                goto fail;
+            }
+            if (job->stream) {
+                total_bytes += job->size;
+                total_blocks_needed += job->blocks_needed;
+            }
+            mvfs_stat_t st;
+            if (mvfs_stat(fs, job->inode_num, &st) == 0) stored_blocks += st.blocks;
         }
     }
-    fclose(file_fp);
-    
-    // Add directory entry to root directory
-    inode_t* root_inode = &inode_table[ROOT_INO - 1];
-    uint64_t root_data_block_offset = root_inode->direct[0] * BS;
-    dirent64_t* root_entries = (dirent64_t*)(image_data + root_data_block_offset);
-    
-    // Find free directory entry slot
-    int entries_per_block = BS / sizeof(dirent64_t);
-    int free_entry_idx = -1;
-    for (int i = 0; i < entries_per_block; i++) {
-        if (root_entries[i].inode_no == 0) {
-            free_entry_idx = i;
-            break;
+
+    // Create every entry first: a name clash or a full directory then fails
+    // the batch before any file data reaches the image. Streams are added
+    // whole here, in batch order; on failure only free blocks were written.
+    for (size_t j = 0; !one_step && j < jobs.count; j++) {
+        add_job_t* job = &jobs.items[j];
+        if (job->stream) {
+            stats_phase("copy");
+            if (add_in_one_step(fs, job, allow_inline ? MVFS_INLINE : 0) != 0) {
+                report_add_error(input_name, job);
+                goto fail;
+            }
+            stats_phase("create");
+            total_bytes += job->size;
+            total_blocks_needed += job->blocks_needed;
+            continue;
+        }
+        if (mvfs_create(fs, ROOT_INO, job->name, job->size, allow_inline ? MVFS_INLINE : 0, &job->inode_num) != 0) {
+            if (errno == EEXIST) {
+                fprintf(stderr, "Error: '%s' already exists in the root directory\n", job->name);
+            } else if (errno == EFBIG) {
+                fprintf(stderr, "Error: File '%s' is too fragmented (more than %zu extents)\n",
+                        job->path, (size_t)EXTENTS_MAX);
+            } else if (errno == ENOSPC) {
+                // Inodes and blocks were checked above, so only the directory can be full
+                fprintf(stderr, "Error: Root directory is full (adding '%s')\n", job->name);
+            } else {
+                fprintf(stderr, "Error: Cannot update root directory in '%s': %s\n", input_name, strerror(errno));
+            }
+            goto fail;
         }
     }
     
-    if (free_entry_idx < 0) {
-        fprintf(stderr, "Error: Root directory is full\n");
-        free(image_data);
-        return 1;
+    if (!one_step) stats_phase("copy");
+    for (size_t j = 0; !one_step && j < jobs.count; j++) {
+        if (jobs.items[j].stream) continue;
+        if (mvfs_fill(fs, jobs.items[j].inode_num, jobs.items[j].path) != 0) {
+            fprintf(stderr, "Error: Cannot read file '%s': %s\n", jobs.items[j].path, strerror(errno));
+            goto fail;
+        }
     }
     
-    // Create new directory entry
-    dirent64_t* new_entry = &root_entries[free_entry_idx];
-    memset(new_entry, 0, sizeof(dirent64_t));
-    new_entry->inode_no = free_inode_num;
-    new_entry->type = 1; // file
-    
-    // Extract just the filename without path
-    const char* basename = strrchr(file_name, '/');
-    basename = basename ? basename + 1 : file_name;
-    strncpy(new_entry->name, basename, 57);
-    new_entry->name[57] = '\0'; // Ensure null termination
-    
-    dirent_checksum_finalize(new_entry);
-    
-    // Update root directory size and link count
-    root_inode->size_bytes += sizeof(dirent64_t);
-    root_inode->links += 1; // CRITICAL: Increment root link count as per PDF spec
-    root_inode->mtime = current_time;
-    inode_crc_finalize(root_inode);
-    
-    // Update superblock checksum
-    memcpy(image_data, &sb, sizeof(sb));
-    superblock_crc_finalize((superblock_t*)image_data);
-    
-    // Write output image
-    FILE* output_fp = fopen(output_name, "wb");
-    if (!output_fp) {
-        fprintf(stderr, "Error: Cannot create output file '%s': %s\n", output_name, strerror(errno));
-        free(image_data);
+    mvfs_dedup_stats_t dedup_stats;
+    mvfs_dedup_stats(fs, &dedup_stats);
+    stats_phase("flush");
+    if (mvfs_close(fs) != 0) {
+        fprintf(stderr, "Error: Cannot write output file '%s': %s\n", output_name, strerror(errno));
+        job_list_free(&jobs);
         return 1;
     }
-    
-    fwrite(image_data, 1, image_size, output_fp);
-    fclose(output_fp);
-    free(image_data);
-    
-    printf("File '%s' added successfully to image '%s'\n", file_name, output_name);
-    printf("  Inode: %d\n", free_inode_num);
-    printf("  Size: %" PRIu64 " bytes (%" PRIu64 " blocks)\n", file_size, blocks_needed);
-    
+    stats_phase(NULL);
+    
+    size_t inline_count = 0;
+    for (size_t j = 0; j < jobs.count; j++) inline_count += jobs.items[j].inline_data;
+    if (jobs.count == 1) {
+        printf("File '%s' added successfully to image '%s'\n", job_label(&jobs.items[0]), output_name);
+        printf("  Inode: %" PRIu32 "\n", jobs.items[0].inode_num);
+        if (inline_count > 0) {
+            printf("  Size: %" PRIu64 " bytes (stored inline)\n", total_bytes);
+        } else {
+            printf("  Size: %" PRIu64 " bytes (%" PRIu64 " blocks)\n", total_bytes, total_blocks_needed);
+        }
+    } else {
+        printf("%zu files added successfully to image '%s'\n", jobs.count, output_name);
+        printf("  Inodes: %" PRIu32 "..%" PRIu32 "\n", jobs.items[0].inode_num, jobs.items[jobs.count - 1].inode_num);
+        printf("  Size: %" PRIu64 " bytes (%" PRIu64 " blocks)\n", total_bytes, total_blocks_needed);
+        if (inline_count > 0) printf("  Inline: %zu files stored in their inodes\n", inline_count);
+    }
+    if (dedup) {
+        printf("  Deduplicated: %" PRIu64 " of %" PRIu64 " blocks shared with existing data\n",
+               dedup_stats.shared_blocks, dedup_stats.shared_blocks + dedup_stats.written_blocks);
+    }
+    if (compress) {
+        printf("  Compressed: %" PRIu64 " blocks stored for %" PRIu64 " (%.1f%%)\n", stored_blocks,
+               total_blocks_needed, total_blocks_needed ? 100.0 * stored_blocks / total_blocks_needed : 100.0);
+    }
+    job_list_free(&jobs);
     return 0;
-}
\ No newline at end of file
+    
+fail:
+    mvfs_abort(fs);
+    job_list_free(&jobs);
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    int status = add_batch(argc, argv);
+    if (print_stats) stats_print_json(stderr, "mkfs_adder", status);
+    return status;
+}
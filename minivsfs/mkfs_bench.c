@@ -0,0 +1,420 @@
+// End-to-end benchmark of the mkfs_* tools on synthetic file sets.
+// Build: make mkfs_bench    Run: ./mkfs_bench [--quick] [--json] [--bin <dir>] [--dir <scratch dir>]
+//
+// For every image geometry, three file sets are generated in a scratch
+// directory: many tiny files, mixed sizes from bytes to megabytes, and large
+// files that fill the image to about 95%. Each set is then run through the
+// tools as separate processes, the way they are used:
+//
+//   build        mkfs_builder --from-dir
+//   check        mkfs_check on the built image
+//   extract_all  mkfs_extract --all
+//   extract      mkfs_extract --file, one process per sampled file
+//   add_batch    mkfs_adder --manifest into an empty image
+//   add          mkfs_adder --file in place, one process per sampled file
+//
+// Every operation reports files/s, MiB/s, latency percentiles over its
+// processes (a single process for the whole-set operations) and the largest
+// peak RSS of any of them. --json prints one JSON object per line instead of
+// the table, with fixed keys and order, so two builds can be diffed.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "crc32.h"
+#include "mvfs.h"
+
+#define SAMPLES_QUICK 50       // processes per per-file operation
+#define SAMPLES_FULL 200
+#define PATTERN_BYTES (4u << 20)
+
+typedef struct {
+    const char* label;
+    uint64_t size_kib;
+    uint64_t inodes;
+} geometry_t;
+
+typedef enum { SET_TINY, SET_MIXED, SET_NEARFULL } set_kind_t;
+
+static const char* const SET_NAMES[] = { "tiny", "mixed", "nearfull" };
+
+typedef struct {
+    uint64_t* sizes;
+    size_t count;
+    uint64_t bytes;
+} file_set_t;
+
+typedef struct {
+    const char* bin;            // directory holding the tools
+    const char* dir;            // scratch directory
+    int json;
+    size_t samples;
+    uint8_t* pattern;           // source of every file's contents
+} bench_t;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, seeded per geometry and set so runs are reproducible
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+// ==================================PROCESSES==================================
+
+// Runs a tool with its output discarded; seconds taken, or -1 if it could not
+// run or exited non-zero. *rss_kib receives its peak resident set size.
+static double run_tool(const bench_t* b, const char* tool, char* args[], long* rss_kib) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", b->bin, tool);
+    args[0] = path;
+    double t0 = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: Cannot run %s: %s\n", tool, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(path, args);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Error: Cannot wait for %s: %s\n", tool, strerror(errno));
+            return -1;
+        }
+    }
+    double t = now_sec() - t0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: %s %s ... failed (status %d)\n", tool, args[1] ? args[1] : "",
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return -1;
+    }
+    *rss_kib = ru.ru_maxrss;
+    return t;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void remove_tree(const char* path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// ==================================FILE SETS==================================
+
+static int set_push(file_set_t* set, uint64_t size) {
+    uint64_t* sizes = realloc(set->sizes, (set->count + 1) * sizeof(*sizes));
+    if (!sizes) return -1;
+    set->sizes = sizes;
+    set->sizes[set->count++] = size;
+    set->bytes += size;
+    return 0;
+}
+
+// Picks the file sizes of a set. free_blocks is what an empty image of the
+// geometry has left for data; the directory needs a few of them too.
+static int plan_set(file_set_t* set, set_kind_t kind, const geometry_t* g, uint64_t free_blocks) {
+    uint64_t state = 0x9E3779B97F4A7C15ull ^ (g->size_kib << 8) ^ (uint64_t)kind;
+    size_t max_files = (size_t)g->inodes * 3 / 4;
+    if (max_files > 8192) max_files = 8192; // a flat root directory holds about this many
+    uint64_t budget = kind == SET_TINY ? free_blocks : kind == SET_MIXED ? free_blocks / 2 : free_blocks * 95 / 100;
+    budget -= budget < 64 + max_files / 32 ? budget : 64 + max_files / 32; // directory blocks
+    uint64_t used = 0;
+    for (size_t f = 0; f < max_files; f++) {
+        uint64_t size;
+        uint64_t r = next_random(&state);
+        if (kind == SET_TINY) {
+            size = 1 + r % 1024;
+        } else if (kind == SET_MIXED) {
+            size = 1 + (r >> 8) % (1ull << (r % 21)); // log-uniform up to 1 MiB
+        } else {
+            size = (64u << 10) + r % (960u << 10);    // 64 KiB .. 1 MiB
+        }
+        uint64_t blocks = (size + BS - 1) / BS;
+        if (used + blocks > budget) {
+            if (kind != SET_NEARFULL || used >= budget) break;
+            size = (budget - used) * BS; // top the image up
+            blocks = budget - used;
+        }
+        if (set_push(set, size) != 0) return -1;
+        used += blocks;
+    }
+    return 0;
+}
+
+static void source_name(char* out, size_t cap, size_t f) {
+    snprintf(out, cap, "f%06zu.bin", f);
+}
+
+static int write_set(const bench_t* b, const file_set_t* set) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/src", b->dir);
+    remove_tree(path);
+    if (mkdir(path, 0755) != 0) return -1;
+    snprintf(path, sizeof(path), "%s/list.txt", b->dir);
+    FILE* list = fopen(path, "w");
+    if (!list) return -1;
+    int rc = 0;
+    for (size_t f = 0; rc == 0 && f < set->count; f++) {
+        char name[32];
+        source_name(name, sizeof(name), f);
+        snprintf(path, sizeof(path), "%s/src/%s", b->dir, name);
+        fprintf(list, "%s\n", path);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            rc = -1;
+            break;
+        }
+        for (uint64_t done = 0; rc == 0 && done < set->sizes[f]; ) {
+            size_t off = (size_t)((f * 4099 + done) % (PATTERN_BYTES / 2));
+            size_t n = set->sizes[f] - done < PATTERN_BYTES / 2 ? (size_t)(set->sizes[f] - done) : PATTERN_BYTES / 2;
+            if (write(fd, b->pattern + off, n) != (ssize_t)n) rc = -1;
+            done += n;
+        }
+        close(fd);
+    }
+    if (fclose(list) != 0) rc = -1;
+    return rc;
+}
+
+// ==================================REPORTING==================================
+
+typedef struct {
+    const char* op;
+    size_t files;
+    uint64_t bytes;
+    double* latency;            // seconds per process
+    size_t ops;
+    long rss_kib;
+} result_t;
+
+static int by_value(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const double* sorted, size_t n, double p) {
+    size_t rank = (size_t)(p * n + 0.999999);
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+static void report(const bench_t* b, const geometry_t* g, set_kind_t kind, result_t* r) {
+    double total = 0;
+    for (size_t i = 0; i < r->ops; i++) total += r->latency[i];
+    qsort(r->latency, r->ops, sizeof(double), by_value);
+    double p50 = percentile(r->latency, r->ops, 0.50) * 1e3;
+    double p90 = percentile(r->latency, r->ops, 0.90) * 1e3;
+    double p99 = percentile(r->latency, r->ops, 0.99) * 1e3;
+    double max = r->latency[r->ops - 1] * 1e3;
+    double mib = r->bytes / 1048576.0;
+    if (b->json) {
+        printf("{\"geometry\":\"%s\",\"size_kib\":%" PRIu64 ",\"inodes\":%" PRIu64 ",\"workload\":\"%s\","
+               "\"op\":\"%s\",\"ops\":%zu,\"files\":%zu,\"bytes\":%" PRIu64 ",\"seconds\":%.6f,"
+               "\"files_per_s\":%.1f,\"mib_per_s\":%.1f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,"
+               "\"max_ms\":%.3f,\"peak_rss_kib\":%ld}\n",
+               g->label, g->size_kib, g->inodes, SET_NAMES[kind], r->op, r->ops, r->files, r->bytes, total,
+               r->files / total, mib / total, p50, p90, p99, max, r->rss_kib);
+    } else {
+        printf("%-6s %-9s %-12s %6zu %9.1f %10.1f %9.1f %8.2f %8.2f %8.2f %8.2f %8ld\n", g->label,
+               SET_NAMES[kind], r->op, r->files, mib, r->files / total, mib / total, p50, p90, p99, max, r->rss_kib);
+    }
+    fflush(stdout);
+}
+
+// ==================================OPERATIONS=================================
+
+static int make_empty(const bench_t* b, const geometry_t* g, const char* image) {
+    char size[32], inodes[32];
+    snprintf(size, sizeof(size), "%" PRIu64, g->size_kib);
+    snprintf(inodes, sizeof(inodes), "%" PRIu64, g->inodes);
+    char* args[] = { NULL, "--image", (char*)image, "--size-kib", size, "--inodes", inodes, NULL };
+    long rss;
+    return run_tool(b, "mkfs_builder", args, &rss) < 0 ? -1 : 0;
+}
+
+// One process for the whole set
+static int run_once(const bench_t* b, const char* tool, char* args[], const geometry_t* g,
+                    set_kind_t kind, const char* op, const file_set_t* set) {
+    double t;
+    result_t r = { op, set->count, set->bytes, &t, 1, 0 };
+    t = run_tool(b, tool, args, &r.rss_kib);
+    if (t < 0) return -1;
+    report(b, g, kind, &r);
+    return 0;
+}
+
+// One process per sampled file; args[slot] is pointed at each file in turn
+static int run_each(const bench_t* b, const char* tool, char* args[], int slot, int host_path,
+                    const geometry_t* g, set_kind_t kind, const char* op, const file_set_t* set) {
+    size_t n = set->count < b->samples ? set->count : b->samples;
+    result_t r = { op, n, 0, calloc(n ? n : 1, sizeof(double)), n, 0 };
+    if (!r.latency) return -1;
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        size_t f = i * set->count / n; // spread over the set
+        char name[32], path[4096];
+        source_name(name, sizeof(name), f);
+        snprintf(path, sizeof(path), "%s/src/%s", b->dir, name);
+        args[slot] = host_path ? path : name;
+        long rss = 0;
+        r.latency[i] = run_tool(b, tool, args, &rss);
+        if (r.latency[i] < 0) rc = -1;
+        if (rss > r.rss_kib) r.rss_kib = rss;
+        r.bytes += set->sizes[f];
+    }
+    if (rc == 0 && n > 0) report(b, g, kind, &r);
+    free(r.latency);
+    return rc;
+}
+
+static int bench_set(const bench_t* b, const geometry_t* g, set_kind_t kind, const file_set_t* set) {
+    char image[4096], empty[4096], src[4096], out[4096], out_file[4096], list[4096];
+    char size[32], inodes[32];
+    snprintf(image, sizeof(image), "%s/built.img", b->dir);
+    snprintf(empty, sizeof(empty), "%s/added.img", b->dir);
+    snprintf(src, sizeof(src), "%s/src", b->dir);
+    snprintf(out, sizeof(out), "%s/out", b->dir);
+    snprintf(out_file, sizeof(out_file), "%s/out.bin", b->dir);
+    snprintf(list, sizeof(list), "%s/list.txt", b->dir);
+    snprintf(size, sizeof(size), "%" PRIu64, g->size_kib);
+    snprintf(inodes, sizeof(inodes), "%" PRIu64, g->inodes);
+
+    unlink(image);
+    char* build[] = { NULL, "--image", image, "--size-kib", size, "--inodes", inodes, "--from-dir", src, NULL };
+    if (run_once(b, "mkfs_builder", build, g, kind, "build", set) != 0) return -1;
+
+    char* check[] = { NULL, "--image", image, NULL };
+    if (run_once(b, "mkfs_check", check, g, kind, "check", set) != 0) return -1;
+
+    remove_tree(out);
+    char* extract_all[] = { NULL, "--image", image, "--all", out, NULL };
+    if (run_once(b, "mkfs_extract", extract_all, g, kind, "extract_all", set) != 0) return -1;
+    remove_tree(out);
+
+    char* extract[] = { NULL, "--image", image, "--file", NULL, "--output", out_file, NULL };
+    if (run_each(b, "mkfs_extract", extract, 4, 0, g, kind, "extract", set) != 0) return -1;
+    unlink(out_file);
+
+    if (make_empty(b, g, empty) != 0) return -1;
+    char* add_batch[] = { NULL, "--input", empty, "--output", empty, "--manifest", list, NULL };
+    if (run_once(b, "mkfs_adder", add_batch, g, kind, "add_batch", set) != 0) return -1;
+
+    if (make_empty(b, g, empty) != 0) return -1;
+    char* add[] = { NULL, "--input", empty, "--output", empty, "--file", NULL, NULL };
+    if (run_each(b, "mkfs_adder", add, 6, 1, g, kind, "add", set) != 0) return -1;
+    unlink(empty);
+    unlink(image);
+    return 0;
+}
+
+// Data blocks an empty image of the geometry has free
+static int geometry_free_blocks(const bench_t* b, const geometry_t* g, uint64_t* free_blocks) {
+    char image[4096];
+    snprintf(image, sizeof(image), "%s/probe.img", b->dir);
+    if (mvfs_format(image, g->size_kib, g->inodes, 0, NULL) != 0) return -1;
+    mvfs_t* fs = mvfs_open(image, MVFS_RDONLY);
+    if (!fs) return -1;
+    *free_blocks = mvfs_free_blocks(fs);
+    mvfs_close(fs);
+    unlink(image);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+    bench_t b = { ".", "mkfs_bench.tmp", 0, SAMPLES_FULL, NULL };
+    int quick = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+            b.samples = SAMPLES_QUICK;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            b.json = 1;
+        } else if (strcmp(argv[i], "--bin") == 0 && i + 1 < argc) {
+            b.bin = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            b.dir = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--json] [--bin <dir>] [--dir <scratch dir>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const geometry_t geometries[] = {
+        { "4m", 4096, 256 },
+        { "64m", 65536, 4096 },
+        { "1g", 1048576, 8192 },
+    };
+    size_t geometry_count = sizeof(geometries) / sizeof(geometries[0]) - (quick ? 1 : 0);
+
+    b.pattern = malloc(PATTERN_BYTES);
+    if (!b.pattern || (mkdir(b.dir, 0755) != 0 && errno != EEXIST)) {
+        fprintf(stderr, "Error: Cannot set up scratch directory '%s': %s\n", b.dir, strerror(errno));
+        free(b.pattern);
+        return 1;
+    }
+    uint64_t state = 1;
+    for (size_t i = 0; i < PATTERN_BYTES / 8; i++) {
+        uint64_t r = next_random(&state);
+        memcpy(b.pattern + i * 8, &r, 8);
+    }
+
+    if (!b.json) {
+        printf("%-6s %-9s %-12s %6s %9s %10s %9s %8s %8s %8s %8s %8s\n", "image", "files", "op", "count", "MiB",
+               "files/s", "MiB/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "RSS KiB");
+    }
+    int rc = 0;
+    for (size_t gi = 0; rc == 0 && gi < geometry_count; gi++) {
+        const geometry_t* g = &geometries[gi];
+        uint64_t free_blocks;
+        if (geometry_free_blocks(&b, g, &free_blocks) != 0) {
+            fprintf(stderr, "Error: Cannot format a %s image: %s\n", g->label, strerror(errno));
+            rc = -1;
+            break;
+        }
+        for (int kind = SET_TINY; rc == 0 && kind <= SET_NEARFULL; kind++) {
+            file_set_t set = {0};
+            if (plan_set(&set, (set_kind_t)kind, g, free_blocks) != 0 || write_set(&b, &set) != 0) {
+                fprintf(stderr, "Error: Cannot write the %s file set: %s\n", SET_NAMES[kind], strerror(errno));
+                rc = -1;
+            } else if (set.count > 0) {
+                rc = bench_set(&b, g, (set_kind_t)kind, &set);
+            }
+            free(set.sizes);
+        }
+    }
+    remove_tree(b.dir);
+    free(b.pattern);
+    return rc == 0 ? 0 : 1;
+}
@@ -1,5 +1,6 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o mkfs_builder
+// Build: make mkfs_builder
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,148 +9,489 @@
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
-#define BS 4096u               // block size
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include "minivsfs.h"
+#include "crc32.h"
+#include "image.h"
+#include "mvfs.h"
+#include "stats.h"
 
 uint64_t g_random_seed = 0; // This should be replaced by seed value from the CLI.
 
-// below contains some basic structures you need for your project
-// you are free to create more structures as you require
+// CLI limits. Block pointers are 32-bit, so the hard ceiling is 2^32 blocks;
+// the caps below keep bitmaps and the inode table to a few MiB.
+#define MIN_SIZE_KIB 180ull
+#define MAX_SIZE_KIB (64ull * 1024 * 1024)   // 64 GiB
+#define MIN_INODES 128ull
+#define MAX_INODES (1024ull * 1024)          // 1M inodes, 32768 inode-table blocks
+#define MAX_THREADS 64                       // --from-dir reader threads
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --image <output.img> --size-kib <180..%llu> --inodes <128..%llu> [--preallocate]\n"
+                    "       [--from-dir <directory> [--threads <1..%d>]] [--merkle] [--stats json]\n",
+            prog_name, MAX_SIZE_KIB, MAX_INODES, MAX_THREADS);
+}
+
+// Parses a non-negative decimal number; returns 0 (always rejected) on junk
+static uint64_t parse_u64(const char* text) {
+    char* end;
+    errno = 0;
+    unsigned long long v = strtoull(text, &end, 10);
+    if (errno || end == text || *end != '\0' || text[0] == '-') return 0;
+    return v;
+}
+
+// ================================TREE IMPORT==================================
+// --from-dir copies a host directory tree into the freshly built image. The
+// whole layout is planned through libminivsfs before any file data moves:
+// the tree is walked breadth first and every directory and file is created in
+// walk order, so inodes are numbered in walk order and, in a fresh image,
+// each file gets one contiguous run right after the previous allocation. The
+// file data then forms an almost sequential stream through the data region.
+// Worker threads read that stream in fixed-size segments and the main thread
+// writes the segments in order, one large pwrite each.
+
+#define IMPORT_SEGMENT_BLOCKS 256   // 1 MiB per image write
 
-#pragma pack(push, 1)
 typedef struct {
-    // CREATE YOUR SUPERBLOCK HERE
-    // ADD ALL FIELDS AS PROVIDED BY THE SPECIFICATION
-    uint32_t magic;               // 0x4D565346
-    uint32_t version;             // 1
-    uint32_t block_size;          // 4096
-    uint64_t total_blocks;        // size_kib * 1024 / 4096
-    uint64_t inode_count;         // from CLI
-    uint64_t inode_bitmap_start;  // 1
-    uint64_t inode_bitmap_blocks; // 1
-    uint64_t data_bitmap_start;   // 2
-    uint64_t data_bitmap_blocks;  // 1
-    uint64_t inode_table_start;   // 3
-    uint64_t inode_table_blocks;  // calculated
-    uint64_t data_region_start;   // calculated
-    uint64_t data_region_blocks;  // calculated
-    uint64_t root_inode;          // 1
-    uint64_t mtime_epoch;         // build time
-    uint32_t flags;               // 0
-    
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum;            // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+    char* path;          // host path
+    uint32_t parent;     // node index of the containing directory
+    int is_dir;
+    uint64_t size;
+    uint64_t blocks;
+    uint32_t ino;        // inode in the image once created
+} import_node_t;
 
-#pragma pack(push,1)
 typedef struct {
-    // CREATE YOUR INODE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint16_t mode;           // file/directory mode
-    uint16_t links;          // link count
-    uint32_t uid;            // user id (0)
-    uint32_t gid;            // group id (0)
-    uint64_t size_bytes;     // size in bytes
-    uint64_t atime;          // access time
-    uint64_t mtime;          // modification time
-    uint64_t ctime;          // creation time
-    uint32_t direct[12];     // direct block pointers
-    uint32_t reserved_0;     // 0
-    uint32_t reserved_1;     // 0
-    uint32_t reserved_2;     // 0
-    uint32_t proj_id;        // project id
-    uint32_t uid16_gid16;    // 0
-    uint64_t xattr_ptr;      // 0
+    import_node_t* items;
+    size_t count;
+    size_t cap;
+} node_list_t;
+
+static int node_list_push(node_list_t* list, char* path, uint32_t parent, int is_dir, uint64_t size) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        import_node_t* items = realloc(list->items, cap * sizeof(*items));
+        if (!items) return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    import_node_t* node = &list->items[list->count++];
+    memset(node, 0, sizeof(*node));
+    node->path = path;
+    node->parent = parent;
+    node->is_dir = is_dir;
+    node->size = size;
+    node->blocks = (size + BS - 1) / BS;
+    return 0;
+}
 
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc;   // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+static void node_list_free(node_list_t* list) {
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].path);
+    free(list->items);
+}
+
+static int not_dot_entry(const struct dirent* d) {
+    return strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0;
+}
 
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+// Breadth-first walk; node 0 is the root. Entries are sorted by name so the
+// same tree always produces the same image. Anything that is neither a
+// regular file nor a directory (symlinks, devices, sockets) is skipped.
+static int walk_tree(node_list_t* nodes, const char* root) {
+    char* root_path = strdup(root);
+    if (!root_path || node_list_push(nodes, root_path, 0, 1, 0) != 0) {
+        free(root_path);
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    for (size_t i = 0; i < nodes->count; i++) {
+        if (!nodes->items[i].is_dir) continue;
+        const char* dir_path = nodes->items[i].path; // stays valid across pushes
+        struct dirent** names;
+        int n = scandir(dir_path, &names, not_dot_entry, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "Error: Cannot read directory '%s': %s\n", dir_path, strerror(errno));
+            return -1;
+        }
+        int failed = 0;
+        for (int k = 0; k < n; k++) {
+            char* path = NULL;
+            struct stat st;
+            if (!failed && asprintf(&path, "%s/%s", dir_path, names[k]->d_name) < 0) {
+                fprintf(stderr, "Error: Out of memory\n");
+                path = NULL;
+                failed = 1;
+            } else if (!failed && lstat(path, &st) != 0) {
+                fprintf(stderr, "Error: Cannot access file '%s': %s\n", path, strerror(errno));
+                failed = 1;
+            } else if (!failed && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+                int is_dir = S_ISDIR(st.st_mode);
+                if (node_list_push(nodes, path, (uint32_t)i, is_dir, is_dir ? 0 : (uint64_t)st.st_size) != 0) {
+                    fprintf(stderr, "Error: Out of memory\n");
+                    failed = 1;
+                } else {
+                    path = NULL; // owned by the node now
+                }
+            } else if (!failed) {
+                fprintf(stderr, "Warning: Skipping '%s' (not a regular file or directory)\n", path);
+            }
+            free(path);
+            free(names[k]);
+        }
+        free(names);
+        if (failed) return -1;
+        if (nodes->count > UINT32_MAX) {
+            fprintf(stderr, "Error: Too many files under '%s'\n", root);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-#pragma pack(push,1)
+// A stretch of one file that lands in adjacent image blocks
 typedef struct {
-    // CREATE YOUR DIRECTORY ENTRY STRUCTURE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint32_t inode_no;   // inode number (0 if free)
-    uint8_t type;        // 1=file, 2=directory
-    char name[58];       // filename/dirname
+    size_t node;
+    uint64_t file_offset;   // bytes
+    uint64_t first_block;   // absolute image block
+    uint32_t block_count;
+} import_piece_t;
 
-    uint8_t  checksum; // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+typedef struct {
+    uint64_t first_block;   // absolute image block
+    uint32_t block_count;
+    size_t first_piece;     // pieces [first_piece, first_piece + piece_count) fill it
+    size_t piece_count;
+} import_segment_t;
 
+typedef struct {
+    const import_node_t* nodes;
+    const import_piece_t* pieces;
+    const import_segment_t* segs;
+    size_t seg_count;
+    uint8_t** slots;            // segment k is staged in slots[k % nslots]
+    size_t* slot_seg;           // k + 1 once segment k is staged, 0 before
+    size_t nslots;
+    pthread_mutex_t lock;
+    pthread_cond_t staged;      // a worker finished a segment
+    pthread_cond_t drained;     // the writer freed a slot
+    size_t next_seg;            // next segment a worker picks up
+    size_t written;             // segments written so far
+    int failed;
+    int err;
+    const char* err_path;       // host file that failed, NULL for image errors
+} import_pipeline_t;
 
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// Reads every file piece of one segment; the tail of each file's last block
+// stays zero
+static int fill_segment(const import_pipeline_t* p, const import_segment_t* seg, uint8_t* buf,
+                        const char** bad_path) {
+    memset(buf, 0, (size_t)seg->block_count * BS);
+    for (size_t k = 0; k < seg->piece_count; k++) {
+        const import_piece_t* piece = &p->pieces[seg->first_piece + k];
+        const import_node_t* node = &p->nodes[piece->node];
+        uint64_t len = (uint64_t)piece->block_count * BS;
+        if (len > node->size - piece->file_offset) len = node->size - piece->file_offset;
+        int fd = open(node->path, O_RDONLY);
+        if (fd < 0 || read_full(fd, buf + (piece->first_block - seg->first_block) * BS, len, piece->file_offset) != 0) {
+            int err = errno; // a short read means the file shrank while importing
+            if (fd >= 0) close(fd);
+            errno = err;
+            *bad_path = node->path;
+            return -1;
+        }
+        close(fd);
     }
+    return 0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+static void* import_worker(void* arg) {
+    import_pipeline_t* p = arg;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        size_t k = p->next_seg;
+        if (k < p->seg_count) p->next_seg++;
+        while (!p->failed && k < p->seg_count && k >= p->written + p->nslots) {
+            pthread_cond_wait(&p->drained, &p->lock);
+        }
+        int stop = p->failed || k >= p->seg_count;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) return NULL;
+        
+        const char* bad_path = NULL;
+        int rc = fill_segment(p, &p->segs[k], p->slots[k % p->nslots], &bad_path);
+        int err = errno;
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0 && !p->failed) {
+            p->failed = 1;
+            p->err = err;
+            p->err_path = bad_path;
+        }
+        p->slot_seg[k % p->nslots] = k + 1;
+        pthread_cond_broadcast(&p->staged);
+        pthread_mutex_unlock(&p->lock);
+    }
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+// Streams the planned file data into the image: workers read, the calling
+// thread writes segments strictly in block order
+static int import_file_data(int fd, import_pipeline_t* p, int threads) {
+    p->nslots = (size_t)threads * 2;
+    p->slots = calloc(p->nslots, sizeof(*p->slots));
+    p->slot_seg = calloc(p->nslots, sizeof(*p->slot_seg));
+    pthread_t* workers = calloc((size_t)threads, sizeof(*workers));
+    int ok = p->slots && p->slot_seg && workers;
+    for (size_t s = 0; ok && s < p->nslots; s++) {
+        ok = (p->slots[s] = malloc((size_t)IMPORT_SEGMENT_BLOCKS * BS)) != NULL;
+    }
+    if (!ok) {
+        p->failed = 1;
+        p->err = ENOMEM;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->staged, NULL);
+    pthread_cond_init(&p->drained, NULL);
+    
+    int started = 0;
+    for (; ok && started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, import_worker, p) != 0) break;
+    }
+    if (ok && started == 0) {
+        p->failed = 1;
+        p->err = EAGAIN;
+    }
+    
+    for (size_t k = 0; k < p->seg_count; k++) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->failed && p->slot_seg[k % p->nslots] != k + 1) {
+            pthread_cond_wait(&p->staged, &p->lock);
+        }
+        int failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+        if (failed) break;
+        
+        const import_segment_t* seg = &p->segs[k];
+        int rc = write_full(fd, p->slots[k % p->nslots], (size_t)seg->block_count * BS, seg->first_block * BS);
+        int err = errno;
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0 && !p->failed) {
+            p->failed = 1;
+            p->err = err;
+            p->err_path = NULL;
+        }
+        p->written = k + 1;
+        pthread_cond_broadcast(&p->drained);
+        pthread_mutex_unlock(&p->lock);
+    }
+    
+    // Wake any worker still waiting for a slot so it can see the failure
+    pthread_mutex_lock(&p->lock);
+    if (p->written < p->seg_count) p->failed = 1;
+    pthread_cond_broadcast(&p->drained);
+    pthread_mutex_unlock(&p->lock);
+    for (int t = 0; t < started; t++) pthread_join(workers[t], NULL);
+    
+    pthread_cond_destroy(&p->drained);
+    pthread_cond_destroy(&p->staged);
+    pthread_mutex_destroy(&p->lock);
+    for (size_t s = 0; p->slots && s < p->nslots; s++) free(p->slots[s]);
+    free(p->slots);
+    free(p->slot_seg);
+    free(workers);
+    return p->failed ? -1 : 0;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
+typedef struct {
+    size_t files;
+    size_t dirs;
+    uint64_t bytes;
+    uint64_t blocks;
+} import_stats_t;
+
+// Appends one piece to the segment list, opening a new segment when the
+// piece does not continue the current one or the current one is full
+static int push_piece(import_piece_t** pieces, size_t* piece_count, size_t* piece_cap,
+                      import_segment_t** segs, size_t* seg_count, size_t* seg_cap,
+                      size_t node, uint64_t file_offset, uint64_t first_block, uint64_t blocks) {
+    while (blocks > 0) {
+        import_segment_t* seg = *seg_count ? &(*segs)[*seg_count - 1] : NULL;
+        if (!seg || seg->first_block + seg->block_count != first_block ||
+            seg->block_count == IMPORT_SEGMENT_BLOCKS) {
+            if (*seg_count == *seg_cap) {
+                size_t cap = *seg_cap ? *seg_cap * 2 : 64;
+                import_segment_t* grown = realloc(*segs, cap * sizeof(*grown));
+                if (!grown) return -1;
+                *segs = grown;
+                *seg_cap = cap;
+            }
+            seg = &(*segs)[(*seg_count)++];
+            seg->first_block = first_block;
+            seg->block_count = 0;
+            seg->first_piece = *piece_count;
+            seg->piece_count = 0;
+        }
+        if (*piece_count == *piece_cap) {
+            size_t cap = *piece_cap ? *piece_cap * 2 : 64;
+            import_piece_t* grown = realloc(*pieces, cap * sizeof(*grown));
+            if (!grown) return -1;
+            *pieces = grown;
+            *piece_cap = cap;
+        }
+        uint32_t room = IMPORT_SEGMENT_BLOCKS - seg->block_count;
+        uint32_t n = blocks < room ? (uint32_t)blocks : room;
+        import_piece_t* piece = &(*pieces)[(*piece_count)++];
+        piece->node = node;
+        piece->file_offset = file_offset;
+        piece->first_block = first_block;
+        piece->block_count = n;
+        seg->block_count += n;
+        seg->piece_count++;
+        file_offset += (uint64_t)n * BS;
+        first_block += n;
+        blocks -= n;
+    }
+    return 0;
 }
 
-void print_usage(const char* prog_name) {
-    fprintf(stderr, "Usage: %s --image <output.img> --size-kib <180..4096> --inodes <128..512>\n", prog_name);
+// Imports the tree under dir into the open image. Metadata reaches the image
+// only when the caller closes the handle.
+static int import_tree(mvfs_t* fs, const char* dir, int threads, import_stats_t* stats) {
+    node_list_t nodes = {0};
+    import_piece_t* pieces = NULL;
+    import_segment_t* segs = NULL;
+    size_t piece_count = 0, piece_cap = 0, seg_count = 0, seg_cap = 0;
+    int status = -1;
+    
+    stats_phase("scan");
+    if (walk_tree(&nodes, dir) != 0) goto out;
+    if (nodes.count - 1 > mvfs_free_inodes(fs)) {
+        fprintf(stderr, "Error: Not enough inodes (need %zu, image has %" PRIu64 ")\n",
+                nodes.count, mvfs_superblock(fs)->inode_count);
+        goto out;
+    }
+    uint64_t need = 0;
+    for (size_t i = 1; i < nodes.count; i++) need += nodes.items[i].is_dir ? 1 : nodes.items[i].blocks;
+    if (need > mvfs_free_blocks(fs)) {
+        fprintf(stderr, "Error: Not enough free data blocks (need %" PRIu64 ", found %" PRIu64 ")\n",
+                need, mvfs_free_blocks(fs));
+        goto out;
+    }
+    
+    // Build the tree. Parents precede their children in walk order, so each
+    // parent exists when a child is created in it.
+    stats_phase("create");
+    nodes.items[0].ino = ROOT_INO;
+    for (size_t i = 1; i < nodes.count; i++) {
+        import_node_t* node = &nodes.items[i];
+        const char* basename = strrchr(node->path, '/');
+        basename = basename ? basename + 1 : node->path;
+        char name[sizeof(((dirent64_t*)0)->name)];
+        strncpy(name, basename, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        uint32_t parent = nodes.items[node->parent].ino;
+        int rc = node->is_dir ? mvfs_mkdir(fs, parent, name, &node->ino)
+                              : mvfs_create(fs, parent, name, node->size, 0, &node->ino);
+        if (rc != 0) {
+            if (errno == EEXIST) {
+                fprintf(stderr, "Error: '%s' clashes with another name once truncated to %zu bytes\n",
+                        node->path, sizeof(name) - 1);
+            } else if (errno == EFBIG) {
+                fprintf(stderr, "Error: File '%s' is too large for the image\n", node->path);
+            } else {
+                fprintf(stderr, "Error: Cannot add '%s' to its directory: %s\n", node->path, strerror(errno));
+            }
+            goto out;
+        }
+        if (node->is_dir) {
+            stats->dirs++;
+            continue;
+        }
+        stats->files++;
+        stats->bytes += node->size;
+        stats->blocks += node->blocks;
+        
+        // Cut the file's runs into segments for the reader threads
+        extent_t* runs;
+        size_t run_count;
+        if (mvfs_map(fs, node->ino, &runs, &run_count) != 0) {
+            fprintf(stderr, "Error: Cannot map '%s': %s\n", node->path, strerror(errno));
+            goto out;
+        }
+        uint64_t file_offset = 0;
+        for (size_t r = 0; r < run_count && rc == 0; r++) {
+            rc = push_piece(&pieces, &piece_count, &piece_cap, &segs, &seg_count, &seg_cap,
+                            i, file_offset, runs[r].start, runs[r].len);
+            file_offset += (uint64_t)runs[r].len * BS;
+        }
+        free(runs);
+        if (rc != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            goto out;
+        }
+    }
+    
+    // File data first, then (on close) the metadata that references it
+    import_pipeline_t pipeline = {
+        .nodes = nodes.items, .pieces = pieces, .segs = segs, .seg_count = seg_count,
+    };
+    stats_phase("copy");
+    if (import_file_data(mvfs_data_fd(fs), &pipeline, threads) != 0) {
+        if (pipeline.err_path) {
+            fprintf(stderr, "Error: Cannot copy file '%s': %s\n", pipeline.err_path, strerror(pipeline.err));
+        } else {
+            fprintf(stderr, "Error: Cannot write image: %s\n", strerror(pipeline.err));
+        }
+        goto out;
+    }
+    status = 0;
+    
+out:
+    free(segs);
+    free(pieces);
+    node_list_free(&nodes);
+    return status;
 }
+// ================================TREE IMPORT==================================
 
-int main(int argc, char* argv[]) {
+static int print_stats; // --stats json: counters and phase times on stderr at exit
+
+static int build(int argc, char* argv[]) {
     crc32_init();
+    stats_phase("parse");
     
     char* image_name = NULL;
-    int size_kib = 0;
-    int inodes = 0;
+    uint64_t size_kib = 0;
+    uint64_t inodes = 0;
+    int preallocate = 0;
+    const char* from_dir = NULL;
+    int merkle = 0;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t threads = online < 1 ? 1 : (online > MAX_THREADS ? MAX_THREADS : (uint64_t)online);
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
             image_name = argv[++i];
         } else if (strcmp(argv[i], "--size-kib") == 0 && i + 1 < argc) {
-            size_kib = atoi(argv[++i]);
+            size_kib = parse_u64(argv[++i]);
         } else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) {
-            inodes = atoi(argv[++i]);
+            inodes = parse_u64(argv[++i]);
+        } else if (strcmp(argv[i], "--preallocate") == 0) {
+            preallocate = 1;
+        } else if (strcmp(argv[i], "--from-dir") == 0 && i + 1 < argc) {
+            from_dir = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = parse_u64(argv[++i]);
+        } else if (strcmp(argv[i], "--merkle") == 0) {
+            merkle = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+            print_stats = 1;
+            i++;
         } else {
             print_usage(argv[0]);
             return 1;
@@ -157,135 +499,72 @@ int main(int argc, char* argv[]) {
     }
     
     // Validate arguments
-    if (!image_name || size_kib < 180 || size_kib > 4096 || size_kib % 4 != 0 || 
-        inodes < 128 || inodes > 512) {
+    if (!image_name || size_kib < MIN_SIZE_KIB || size_kib > MAX_SIZE_KIB || size_kib % 4 != 0 || 
+        inodes < MIN_INODES || inodes > MAX_INODES || threads < 1 || threads > MAX_THREADS) {
         print_usage(argv[0]);
         return 1;
     }
     
-    // Calculate file system layout
-    uint64_t total_blocks = (size_kib * 1024) / BS;
-    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;  // round up
-    uint64_t inode_table_start = 3;  // after superblock, inode bitmap, data bitmap
-    uint64_t data_region_start = inode_table_start + inode_table_blocks;
-    uint64_t data_region_blocks = total_blocks - data_region_start;
-    
-    // Validate we have enough space
-    if (data_region_blocks <= 0) {
-        fprintf(stderr, "Error: Not enough space for data region\n");
-        return 1;
-    }
-    
-    time_t build_time = time(NULL);
-    
-    // Create and fill superblock
     superblock_t sb;
-    memset(&sb, 0, sizeof(sb));
-    sb.magic = 0x4D565346;
-    sb.version = 1;
-    sb.block_size = BS;
-    sb.total_blocks = total_blocks;
-    sb.inode_count = inodes;
-    sb.inode_bitmap_start = 1;
-    sb.inode_bitmap_blocks = 1;
-    sb.data_bitmap_start = 2;
-    sb.data_bitmap_blocks = 1;
-    sb.inode_table_start = inode_table_start;
-    sb.inode_table_blocks = inode_table_blocks;
-    sb.data_region_start = data_region_start;
-    sb.data_region_blocks = data_region_blocks;
-    sb.root_inode = ROOT_INO;
-    sb.mtime_epoch = build_time;
-    sb.flags = 0;
-    superblock_crc_finalize(&sb);
-    
-    // Create root directory inode
-    inode_t root_inode;
-    memset(&root_inode, 0, sizeof(root_inode));
-    root_inode.mode = 0040000;  // directory mode (0040000)8
-    root_inode.links = 2;       // . and ..
-    root_inode.uid = 0;
-    root_inode.gid = 0;
-    root_inode.size_bytes = 2 * sizeof(dirent64_t);  // . and .. entries
-    root_inode.atime = build_time;
-    root_inode.mtime = build_time;
-    root_inode.ctime = build_time;
-    root_inode.direct[0] = data_region_start;  // first data block
-    for (int i = 1; i < 12; i++) {
-        root_inode.direct[i] = 0;
-    }
-    root_inode.reserved_0 = 0;
-    root_inode.reserved_1 = 0;
-    root_inode.reserved_2 = 0;
-    root_inode.proj_id = 0;  // Could be set to group ID if needed
-    root_inode.uid16_gid16 = 0;
-    root_inode.xattr_ptr = 0;
-    inode_crc_finalize(&root_inode);
-    
-    // Create . and .. directory entries
-    dirent64_t dot_entry, dotdot_entry;
-    memset(&dot_entry, 0, sizeof(dot_entry));
-    dot_entry.inode_no = ROOT_INO;
-    dot_entry.type = 2;  // directory
-    strcpy(dot_entry.name, ".");
-    dirent_checksum_finalize(&dot_entry);
-    
-    memset(&dotdot_entry, 0, sizeof(dotdot_entry));
-    dotdot_entry.inode_no = ROOT_INO;
-    dotdot_entry.type = 2;  // directory
-    strcpy(dotdot_entry.name, "..");
-    dirent_checksum_finalize(&dotdot_entry);
-    
-    // Open output file
-    FILE* fp = fopen(image_name, "wb");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot create output file '%s': %s\n", image_name, strerror(errno));
+    stats_phase("format");
+    if (mvfs_format(image_name, size_kib, inodes, preallocate, &sb) != 0) {
+        if (errno == ENOSPC) {
+            fprintf(stderr, "Error: Not enough space for data region\n");
+        } else {
+            fprintf(stderr, "Error: Cannot create output file '%s': %s\n", image_name, strerror(errno));
+        }
+        unlink(image_name);
         return 1;
     }
     
-    // Write superblock (block 0)
-    uint8_t block_buffer[BS];
-    memset(block_buffer, 0, BS);
-    memcpy(block_buffer, &sb, sizeof(sb));
-    fwrite(block_buffer, 1, BS, fp);
-    
-    // Write inode bitmap (block 1) - mark root inode as used
-    memset(block_buffer, 0, BS);
-    block_buffer[0] = 0x01;  // bit 0 set (inode #1 used)
-    fwrite(block_buffer, 1, BS, fp);
-    
-    // Write data bitmap (block 2) - mark first data block as used
-    memset(block_buffer, 0, BS);
-    block_buffer[0] = 0x01;  // bit 0 set (first data block used)
-    fwrite(block_buffer, 1, BS, fp);
-    
-    // Write inode table - root inode at position 0
-    for (uint64_t block = 0; block < inode_table_blocks; block++) {
-        memset(block_buffer, 0, BS);
-        if (block == 0) {
-            // First block contains root inode at index 0
-            memcpy(block_buffer, &root_inode, sizeof(root_inode));
+    // Populate the image from a host directory tree; the hash tree comes
+    // first so the files are hashed as the import is flushed
+    import_stats_t stats = {0};
+    if (from_dir || merkle) {
+        stats_phase("open");
+        mvfs_t* fs = mvfs_open(image_name, MVFS_RDWR);
+        if (!fs) {
+            fprintf(stderr, "Error: Cannot open output file '%s': %s\n", image_name, strerror(errno));
+            unlink(image_name);
+            return 1;
         }
-        fwrite(block_buffer, 1, BS, fp);
-    }
-    
-    // Write data region - first block contains root directory entries
-    for (uint64_t block = 0; block < data_region_blocks; block++) {
-        memset(block_buffer, 0, BS);
-        if (block == 0) {
-            // First data block contains . and .. entries
-            memcpy(block_buffer, &dot_entry, sizeof(dot_entry));
-            memcpy(block_buffer + sizeof(dot_entry), &dotdot_entry, sizeof(dotdot_entry));
+        if (merkle && mvfs_merkle_enable(fs) != 0) {
+            fprintf(stderr, "Error: Cannot allocate the hash tree: %s\n", strerror(errno));
+            mvfs_abort(fs);
+            unlink(image_name);
+            return 1;
+        }
+        if (from_dir && import_tree(fs, from_dir, (int)threads, &stats) != 0) {
+            mvfs_abort(fs);
+            unlink(image_name); // do not leave a half-imported image behind
+            return 1;
+        }
+        stats_phase("flush");
+        if (mvfs_close(fs) != 0) {
+            fprintf(stderr, "Error: Cannot write output file '%s': %s\n", image_name, strerror(errno));
+            unlink(image_name);
+            return 1;
         }
-        fwrite(block_buffer, 1, BS, fp);
     }
-    
-    fclose(fp);
+    stats_phase(NULL);
     
     printf("MiniVSFS image '%s' created successfully:\n", image_name);
-    printf("  Size: %d KiB (%" PRIu64 " blocks)\n", size_kib, total_blocks);
-    printf("  Inodes: %d\n", inodes);
-    printf("  Data blocks: %" PRIu64 "\n", data_region_blocks);
+    printf("  Size: %" PRIu64 " KiB (%" PRIu64 " blocks)\n", size_kib, sb.total_blocks);
+    printf("  Inodes: %" PRIu64 "\n", inodes);
+    printf("  Data blocks: %" PRIu64 "\n", sb.data_region_blocks);
+    if (from_dir) {
+        printf("  Imported: %zu files, %zu directories from '%s'\n", stats.files, stats.dirs, from_dir);
+        printf("  Size: %" PRIu64 " bytes (%" PRIu64 " blocks)\n", stats.bytes, stats.blocks);
+    }
+    if (merkle) {
+        printf("  Hash tree: %" PRIu64 " blocks\n", merkle_tree_blocks(sb.data_region_blocks));
+    }
     
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[]) {
+    int status = build(argc, argv);
+    if (print_stats) stats_print_json(stderr, "mkfs_builder", status);
+    return status;
+}
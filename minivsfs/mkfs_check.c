@@ -0,0 +1,654 @@
+// Build: make mkfs_check
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+#include "crc32.h"
+#include "image.h"
+#include "dir.h"
+
+// Exit codes
+#define CHECK_CLEAN 0
+#define CHECK_ERRORS 1   // the image is inconsistent
+#define CHECK_FAILED 2   // usage error or the image could not be read
+
+#define MAX_THREADS 64
+#define INODE_CHUNK 1024                 // inodes per work item (32 table blocks)
+#define BITMAP_CHUNK (BS * 8ull)         // data bitmap bits per work item
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --image <image.img> [--quick] [--threads <1..%d>]\n", prog_name, MAX_THREADS);
+}
+
+// The check runs in two parallel passes. Pass 1 splits the inode table into
+// chunks: each allocated inode is verified on its own, and every block and
+// directory entry it owns is recorded in the shared reference tables. Pass 2
+// splits the inode range and the data bitmap again and cross-checks the
+// bitmaps and link counts against what pass 1 collected.
+typedef struct {
+    int fd;
+    superblock_t sb;
+    int quick;                       // stop at the first error
+    image_bitmap_t inode_bitmap;
+    image_bitmap_t data_bitmap;
+    superblock_ext_t ext;
+    uint16_t* refcounts;             // FEATURE_DEDUP: extra references per data block
+
+    // Filled in pass 1
+    atomic_uint* block_refs;         // per data block, references found
+    atomic_uint* inode_refs;         // per inode, entries naming it (not "." / "..")
+    atomic_uchar* ref_types;         // per inode, 1 << dirent type of those entries
+    atomic_uint* parent_of;          // per directory inode, the directory naming it
+    uint16_t* modes;                 // per inode, copied from the table
+    uint16_t* links;
+    uint32_t* dotdot;                // per directory inode, target of ".."
+    uint32_t* children;              // per directory inode, entries besides "." / ".."
+
+    atomic_size_t next_chunk;        // work distribution for the current pass
+    size_t chunk_count;
+    atomic_int stop;                 // quick mode: an error has been reported
+    atomic_size_t errors;
+    atomic_size_t io_failed;         // the image could not be read
+    pthread_mutex_t print_lock;
+} check_t;
+
+// Records one inconsistency. In quick mode only the first one is printed and
+// every thread winds down.
+static void report(check_t* c, const char* fmt, ...) {
+    if (c->quick && atomic_exchange(&c->stop, 1)) return;
+    atomic_fetch_add(&c->errors, 1);
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&c->print_lock);
+    printf("  ");
+    vprintf(fmt, ap);
+    printf("\n");
+    pthread_mutex_unlock(&c->print_lock);
+    va_end(ap);
+}
+
+static int stopped(check_t* c) {
+    return atomic_load_explicit(&c->stop, memory_order_relaxed);
+}
+
+static void io_failure(check_t* c, const char* what, uint64_t block_no) {
+    atomic_fetch_add(&c->io_failed, 1);
+    atomic_store(&c->stop, 1);
+    fprintf(stderr, "Error: Cannot read %s (block %" PRIu64 "): %s\n", what, block_no, strerror(errno));
+}
+
+static int in_data_region(const check_t* c, uint64_t block_no) {
+    return block_no >= c->sb.data_region_start && block_no < c->sb.total_blocks;
+}
+
+// Marks a data block as referenced by inode ino; 0 if it is out of range
+static int ref_block(check_t* c, uint32_t ino, uint64_t block_no) {
+    if (!in_data_region(c, block_no)) {
+        report(c, "inode %" PRIu32 ": block %" PRIu64 " is outside the data region", ino, block_no);
+        return 0;
+    }
+    atomic_fetch_add_explicit(&c->block_refs[block_no - c->sb.data_region_start], 1, memory_order_relaxed);
+    return 1;
+}
+
+// ==============================PASS 1: INODES=================================
+
+static void check_file_blocks(check_t* c, uint32_t ino_no, inode_t* ino) {
+    uint64_t want = inode_data_blocks(ino);
+    if ((ino->mode & MODE_COMPRESSED) &&
+        (want == 0 || want > (zstream_max(ino->size_bytes) + BS - 1) / BS)) {
+        report(c, "inode %" PRIu32 ": compressed stream of %" PRIu64 " blocks for %" PRIu64 " bytes",
+               ino_no, want, ino->size_bytes);
+        return;
+    }
+    if (ino->mode & MODE_INLINE) {
+        if (ino->size_bytes > INLINE_MAX) {
+            report(c, "inode %" PRIu32 ": inline size %" PRIu64 " exceeds %zu bytes",
+                   ino_no, ino->size_bytes, (size_t)INLINE_MAX);
+        }
+        return;
+    }
+    if (!(ino->mode & MODE_EXTENTS)) {
+        if (want > DIRECT_MAX) {
+            report(c, "inode %" PRIu32 ": size %" PRIu64 " needs %" PRIu64 " blocks but has only direct pointers",
+                   ino_no, ino->size_bytes, want);
+            return;
+        }
+        for (uint32_t i = 0; i < DIRECT_MAX; i++) {
+            if (i < want) {
+                ref_block(c, ino_no, ino->direct[i]);
+            } else if (ino->direct[i] != 0) {
+                report(c, "inode %" PRIu32 ": stray block pointer direct[%" PRIu32 "]", ino_no, i);
+            }
+        }
+        return;
+    }
+
+    uint32_t count = ino->reserved_0;
+    if (count == 0 || count > EXTENTS_MAX || (count > EXTENTS_INLINE) != (ino->reserved_1 != 0)) {
+        report(c, "inode %" PRIu32 ": bad extent count %" PRIu32 " (overflow block %" PRIu32 ")",
+               ino_no, count, ino->reserved_1);
+        return;
+    }
+    extent_t overflow[EXTENTS_PER_BLOCK];
+    if (count > EXTENTS_INLINE) {
+        if (!ref_block(c, ino_no, ino->reserved_1)) return;
+        if (read_full(c->fd, overflow, BS, (uint64_t)ino->reserved_1 * BS) != 0) {
+            io_failure(c, "extent block", ino->reserved_1);
+            return;
+        }
+    }
+    extent_t* inline_runs = inode_extents(ino);
+    uint64_t mapped = 0;
+    for (uint32_t r = 0; r < count && !stopped(c); r++) {
+        extent_t e = r < EXTENTS_INLINE ? inline_runs[r] : overflow[r - EXTENTS_INLINE];
+        if (e.len == 0 || !in_data_region(c, e.start) || !in_data_region(c, (uint64_t)e.start + e.len - 1)) {
+            report(c, "inode %" PRIu32 ": extent %" PRIu32 " (%" PRIu32 "+%" PRIu32 ") is outside the data region",
+                   ino_no, r, e.start, e.len);
+            continue;
+        }
+        for (uint32_t i = 0; i < e.len; i++) ref_block(c, ino_no, (uint64_t)e.start + i);
+        mapped += e.len;
+    }
+    if (mapped != want) {
+        report(c, "inode %" PRIu32 ": extents map %" PRIu64 " blocks, size needs %" PRIu64,
+               ino_no, mapped, want);
+    }
+}
+
+// Verifies one block of directory entries. first_leaf is set for direct[0],
+// which must start with "." and ".."; for hashed leaves slot/depth give the
+// hash bits every name in the block must share.
+static uint64_t check_leaf(check_t* c, uint32_t dir_no, uint64_t block_no, int first_leaf,
+                           int hashed, uint32_t slot, uint8_t depth) {
+    dirent64_t entries[DIRENTS_PER_BLOCK];
+    if (read_full(c->fd, entries, BS, block_no * BS) != 0) {
+        io_failure(c, "directory block", block_no);
+        return 0;
+    }
+    uint64_t used = 0;
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK && !stopped(c); i++) {
+        dirent64_t* de = &entries[i];
+        if (de->inode_no == 0) continue;
+        used++;
+        uint8_t stored = de->checksum;
+        dirent_checksum_finalize(de);
+        if (de->checksum != stored) {
+            report(c, "directory %" PRIu32 ": entry %" PRIu32 " in block %" PRIu64 " has a bad checksum",
+                   dir_no, i, block_no);
+            continue;
+        }
+        if (memchr(de->name, '\0', sizeof(de->name)) == NULL) {
+            report(c, "directory %" PRIu32 ": entry %" PRIu32 " in block %" PRIu64 " has an unterminated name",
+                   dir_no, i, block_no);
+            continue;
+        }
+        if (de->inode_no > c->sb.inode_count || !bitmap_test(&c->inode_bitmap.bm, de->inode_no - 1)) {
+            report(c, "directory %" PRIu32 ": '%s' points to free or invalid inode %" PRIu32,
+                   dir_no, de->name, de->inode_no);
+            continue;
+        }
+        int is_dot = strcmp(de->name, ".") == 0, is_dotdot = strcmp(de->name, "..") == 0;
+        if (is_dot || is_dotdot) {
+            if (!first_leaf || i != (uint32_t)is_dotdot || de->type != 2) {
+                report(c, "directory %" PRIu32 ": misplaced '%s' entry", dir_no, de->name);
+            } else if (is_dot && de->inode_no != dir_no) {
+                report(c, "directory %" PRIu32 ": '.' points to inode %" PRIu32, dir_no, de->inode_no);
+            } else if (is_dotdot) {
+                c->dotdot[dir_no - 1] = de->inode_no;
+            }
+            continue;
+        }
+        if (de->type != 1 && de->type != 2) {
+            report(c, "directory %" PRIu32 ": '%s' has unknown type %u", dir_no, de->name, de->type);
+            continue;
+        }
+        if (hashed && (dir_name_hash(de->name) & ((1u << depth) - 1)) != slot) {
+            report(c, "directory %" PRIu32 ": '%s' is in the wrong hash leaf", dir_no, de->name);
+        }
+        c->children[dir_no - 1]++;
+        atomic_fetch_add(&c->inode_refs[de->inode_no - 1], 1);
+        atomic_fetch_or(&c->ref_types[de->inode_no - 1], (unsigned char)(1u << de->type));
+        if (de->type == 2) atomic_store(&c->parent_of[de->inode_no - 1], dir_no);
+    }
+    if (first_leaf && (entries[0].inode_no == 0 || entries[1].inode_no == 0)) {
+        report(c, "directory %" PRIu32 ": missing '.' or '..' entry", dir_no);
+    }
+    return used;
+}
+
+static void check_directory(check_t* c, uint32_t dir_no, inode_t* ino) {
+    uint32_t first_extra = (ino->mode & MODE_DIR_INDEX) ? 2 : 1;
+    for (uint32_t i = first_extra; i < DIRECT_MAX; i++) {
+        if (ino->direct[i] != 0) {
+            report(c, "directory %" PRIu32 ": stray block pointer direct[%" PRIu32 "]", dir_no, i);
+        }
+    }
+    if (!ref_block(c, dir_no, ino->direct[0])) return;
+
+    uint64_t entries = 0;
+    if (!(ino->mode & MODE_DIR_INDEX)) {
+        entries = check_leaf(c, dir_no, ino->direct[0], 1, 0, 0, 0);
+    } else {
+        if (!ref_block(c, dir_no, ino->direct[1])) return;
+        dir_index_t idx;
+        if (read_full(c->fd, &idx, sizeof(idx), (uint64_t)ino->direct[1] * BS) != 0) {
+            io_failure(c, "directory index", ino->direct[1]);
+            return;
+        }
+        uint32_t stored = idx.checksum;
+        dir_index_checksum_finalize(&idx);
+        if (idx.magic != DIR_INDEX_MAGIC || idx.checksum != stored || idx.global_depth > DIR_INDEX_MAX_DEPTH) {
+            report(c, "directory %" PRIu32 ": corrupt hash index in block %" PRIu32, dir_no, ino->direct[1]);
+            return;
+        }
+        // Every leaf is checked once, from its lowest slot; all slots that
+        // share its low local_depth bits must point at it
+        uint32_t slots = 1u << idx.global_depth, leaves = 0;
+        for (uint32_t s = 0; s < slots && !stopped(c); s++) {
+            uint8_t depth = idx.local_depth[s];
+            if (depth > idx.global_depth) {
+                report(c, "directory %" PRIu32 ": index slot %" PRIu32 " has depth %u", dir_no, s, depth);
+                return;
+            }
+            if (s >= (1u << depth)) continue;
+            for (uint32_t t = s; t < slots; t += 1u << depth) {
+                if (idx.leaf[t] != idx.leaf[s] || idx.local_depth[t] != depth) {
+                    report(c, "directory %" PRIu32 ": index slots %" PRIu32 " and %" PRIu32 " disagree",
+                           dir_no, s, t);
+                    return;
+                }
+            }
+            if (s != 0 && !ref_block(c, dir_no, idx.leaf[s])) continue;
+            if (s == 0 && idx.leaf[0] != ino->direct[0]) {
+                report(c, "directory %" PRIu32 ": first index slot does not point at direct[0]", dir_no);
+                continue;
+            }
+            entries += check_leaf(c, dir_no, idx.leaf[s], s == 0, 1, s, depth);
+            leaves++;
+        }
+        if (!stopped(c) && leaves != idx.leaf_count) {
+            report(c, "directory %" PRIu32 ": index has %" PRIu32 " leaves, header says %" PRIu32,
+                   dir_no, leaves, idx.leaf_count);
+        }
+    }
+    if (!stopped(c) && ino->size_bytes != entries * sizeof(dirent64_t)) {
+        report(c, "directory %" PRIu32 ": size %" PRIu64 " but %" PRIu64 " entries",
+               dir_no, ino->size_bytes, entries);
+    }
+}
+
+static void check_inode(check_t* c, uint32_t ino_no, inode_t* ino) {
+    if (ino->mode == 0 && ino->inode_crc == 0) {
+        report(c, "inode %" PRIu32 ": marked used but never written", ino_no);
+        return;
+    }
+    uint64_t stored = ino->inode_crc;
+    inode_crc_finalize(ino);
+    if (ino->inode_crc != stored) {
+        report(c, "inode %" PRIu32 ": bad checksum", ino_no);
+        return;
+    }
+    c->modes[ino_no - 1] = ino->mode;
+    c->links[ino_no - 1] = ino->links;
+    uint16_t type = ino->mode & MODE_TYPE_MASK, layout = ino->mode & ~MODE_TYPE_MASK;
+    if (type == MODE_FILE && (layout & ~(MODE_INLINE | MODE_EXTENTS | MODE_COMPRESSED)) == 0 &&
+        (!(layout & MODE_INLINE) || layout == MODE_INLINE)) {
+        check_file_blocks(c, ino_no, ino);
+    } else if (type == MODE_DIR && (layout & ~MODE_DIR_INDEX) == 0) {
+        check_directory(c, ino_no, ino);
+    } else {
+        report(c, "inode %" PRIu32 ": invalid mode 0%o", ino_no, ino->mode);
+    }
+}
+
+static void* inode_pass(void* arg) {
+    check_t* c = arg;
+    uint8_t* table = malloc((size_t)INODE_CHUNK * INODE_SIZE);
+    if (!table) {
+        errno = ENOMEM;
+        io_failure(c, "inode table", c->sb.inode_table_start);
+        return NULL;
+    }
+    for (;;) {
+        size_t chunk = atomic_fetch_add(&c->next_chunk, 1);
+        if (chunk >= c->chunk_count || stopped(c)) break;
+        uint64_t first = (uint64_t)chunk * INODE_CHUNK;
+        uint64_t count = c->sb.inode_count - first < INODE_CHUNK ? c->sb.inode_count - first : INODE_CHUNK;
+        // Skip reading chunks with no allocated inode at all
+        if (bitmap_find(&c->inode_bitmap.bm, first, first + count, 1) < 0) continue;
+        uint64_t offset = c->sb.inode_table_start * BS + first * INODE_SIZE;
+        if (read_full(c->fd, table, count * INODE_SIZE, offset) != 0) {
+            io_failure(c, "inode table", offset / BS);
+            break;
+        }
+        for (uint64_t i = 0; i < count && !stopped(c); i++) {
+            if (!bitmap_test(&c->inode_bitmap.bm, first + i)) continue;
+            check_inode(c, (uint32_t)(first + i + 1), (inode_t*)(table + i * INODE_SIZE));
+        }
+    }
+    free(table);
+    return NULL;
+}
+
+// ============================PASS 2: CROSS-CHECK==============================
+
+static void check_links(check_t* c, uint64_t first, uint64_t count) {
+    for (uint64_t i = first; i < first + count && !stopped(c); i++) {
+        if (!bitmap_test(&c->inode_bitmap.bm, i)) continue;
+        uint32_t ino_no = (uint32_t)i + 1;
+        uint16_t type = c->modes[i] & MODE_TYPE_MASK;
+        if (type != MODE_DIR && type != MODE_FILE) continue; // already reported
+        uint32_t refs = atomic_load(&c->inode_refs[i]);
+        unsigned types = atomic_load(&c->ref_types[i]);
+        if (ino_no == ROOT_INO) {
+            if (refs != 0) report(c, "root directory is named by %" PRIu32 " entries", refs);
+            if (c->dotdot[i] != ROOT_INO) report(c, "root directory: '..' does not point to itself");
+        } else if (refs == 0) {
+            report(c, "inode %" PRIu32 ": allocated but not in any directory", ino_no);
+            continue;
+        } else if (types != (type == MODE_DIR ? 1u << 2 : 1u << 1)) {
+            report(c, "inode %" PRIu32 ": directory entry type does not match the inode", ino_no);
+        }
+        if (type == MODE_DIR) {
+            // A directory starts at 2 links and gains one per entry
+            uint64_t want = 2 + (uint64_t)c->children[i];
+            if (want > UINT16_MAX) want = UINT16_MAX;
+            if (c->links[i] != want) {
+                report(c, "directory %" PRIu32 ": link count %u, expected %" PRIu64, ino_no, c->links[i], want);
+            }
+            if (ino_no != ROOT_INO && refs > 1) {
+                report(c, "directory %" PRIu32 ": named by %" PRIu32 " entries", ino_no, refs);
+            } else if (ino_no != ROOT_INO && c->dotdot[i] != atomic_load(&c->parent_of[i])) {
+                report(c, "directory %" PRIu32 ": '..' points to %" PRIu32 ", parent is %" PRIu32,
+                       ino_no, c->dotdot[i], atomic_load(&c->parent_of[i]));
+            }
+        } else if (c->links[i] != refs) {
+            report(c, "inode %" PRIu32 ": link count %u, expected %" PRIu32, ino_no, c->links[i], refs);
+        }
+    }
+}
+
+static void check_data_bitmap(check_t* c, uint64_t first, uint64_t count) {
+    for (uint64_t bit = first; bit < first + count && !stopped(c); bit++) {
+        unsigned refs = atomic_load_explicit(&c->block_refs[bit], memory_order_relaxed);
+        unsigned shared = c->refcounts ? c->refcounts[bit] : 0;
+        int used = bitmap_test(&c->data_bitmap.bm, bit);
+        uint64_t block_no = c->sb.data_region_start + bit;
+        if (refs > 1 && !c->refcounts) {
+            report(c, "data block %" PRIu64 ": referenced more than once", block_no);
+        } else if (refs && refs != shared + 1) {
+            report(c, "data block %" PRIu64 ": referenced %u times, refcount says %u", block_no, refs, shared + 1);
+        } else if (!refs && shared) {
+            report(c, "data block %" PRIu64 ": unreferenced but has refcount %u", block_no, shared + 1);
+        } else if (refs && !used) {
+            report(c, "data block %" PRIu64 ": in use but marked free", block_no);
+        } else if (!refs && used) {
+            report(c, "data block %" PRIu64 ": marked used but not referenced", block_no);
+        }
+    }
+}
+
+static void* cross_check_pass(void* arg) {
+    check_t* c = arg;
+    size_t inode_chunks = (size_t)((c->sb.inode_count + INODE_CHUNK - 1) / INODE_CHUNK);
+    for (;;) {
+        size_t chunk = atomic_fetch_add(&c->next_chunk, 1);
+        if (chunk >= c->chunk_count || stopped(c)) break;
+        if (chunk < inode_chunks) {
+            uint64_t first = (uint64_t)chunk * INODE_CHUNK;
+            uint64_t left = c->sb.inode_count - first;
+            check_links(c, first, left < INODE_CHUNK ? left : INODE_CHUNK);
+        } else {
+            uint64_t first = (uint64_t)(chunk - inode_chunks) * BITMAP_CHUNK;
+            uint64_t left = c->sb.data_region_blocks - first;
+            check_data_bitmap(c, first, left < BITMAP_CHUNK ? left : BITMAP_CHUNK);
+        }
+    }
+    return NULL;
+}
+
+static void run_pass(check_t* c, void* (*pass)(void*), size_t chunks, int threads) {
+    atomic_store(&c->next_chunk, 0);
+    c->chunk_count = chunks;
+    pthread_t workers[MAX_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, pass, c) != 0) break;
+    }
+    pass(c); // the main thread works too
+    for (int t = 0; t < started; t++) pthread_join(workers[t], NULL);
+}
+
+// Bits past the end of a bitmap (padding in its last block) must stay clear
+static void check_bitmap_padding(check_t* c, const image_bitmap_t* ib, const char* what) {
+    for (uint64_t bit = ib->bm.nbits; bit < ib->block_count * BS * 8; bit++) {
+        if (ib->data[bit / 8] & (1u << (bit % 8))) {
+            report(c, "%s bitmap: padding bit %" PRIu64 " is set", what, bit);
+            return;
+        }
+    }
+}
+
+// The superblock's free counts and first-free hints must match the bitmaps
+static void check_free_counts(check_t* c, image_bitmap_t* ib, uint64_t free, uint64_t first_free, const char* what) {
+    if (ib->bm.free != free) {
+        report(c, "superblock: %" PRIu64 " free %s recorded, bitmap has %" PRIu64, free, what, ib->bm.free);
+    }
+    uint64_t first = bitmap_first_free(&ib->bm);
+    if (first != first_free) {
+        report(c, "superblock: first free %s recorded as %" PRIu64 ", bitmap has %" PRIu64, what, first_free, first);
+    }
+}
+
+// Superblock fields every other check relies on
+static int check_superblock(check_t* c, const uint8_t* block0, uint64_t image_size) {
+    const superblock_t* sb = &c->sb;
+    uint8_t copy[BS];
+    memcpy(copy, block0, BS);
+    memset(copy + offsetof(superblock_t, checksum), 0, sizeof(sb->checksum));
+    if (sb->magic != MVFS_MAGIC) {
+        report(c, "superblock: bad magic 0x%08" PRIx32, sb->magic);
+        return -1;
+    }
+    if (crc32(copy, BS - 4) != sb->checksum) report(c, "superblock: bad checksum");
+    if (sb->version != 1 || sb->block_size != BS) {
+        report(c, "superblock: unsupported version %" PRIu32 " / block size %" PRIu32, sb->version, sb->block_size);
+        return -1;
+    }
+    uint64_t bits_per_block = BS * 8ull;
+    if (sb->total_blocks * BS > image_size ||
+        sb->inode_count == 0 || sb->inode_count > UINT32_MAX ||
+        sb->inode_bitmap_start != 1 ||
+        sb->inode_bitmap_blocks * bits_per_block < sb->inode_count ||
+        sb->data_bitmap_start != sb->inode_bitmap_start + sb->inode_bitmap_blocks ||
+        sb->data_bitmap_blocks * bits_per_block < sb->data_region_blocks ||
+        sb->inode_table_start != sb->data_bitmap_start + sb->data_bitmap_blocks ||
+        sb->inode_table_blocks * BS < sb->inode_count * INODE_SIZE ||
+        sb->data_region_start != sb->inode_table_start + sb->inode_table_blocks ||
+        sb->data_region_start + sb->data_region_blocks != sb->total_blocks ||
+        sb->root_inode != ROOT_INO) {
+        report(c, "superblock: inconsistent geometry");
+        return -1;
+    }
+    if (sb->flags & ~(FEATURE_INLINE_DATA | FEATURE_EXTENTS | FEATURE_DIR_INDEX | FEATURE_DEDUP | FEATURE_COMPRESSED |
+                      FEATURE_FREE_COUNTS | FEATURE_MERKLE)) {
+        report(c, "superblock: unknown feature flags 0x%" PRIx32, sb->flags);
+    }
+    if ((sb->flags & FEATURE_DEDUP) &&
+        (c->ext.refcount_start < sb->data_region_start ||
+         c->ext.refcount_blocks > sb->total_blocks - c->ext.refcount_start ||
+         c->ext.refcount_blocks * REFCOUNTS_PER_BLOCK < sb->data_region_blocks)) {
+        report(c, "superblock: refcount table %" PRIu64 "+%" PRIu64 " does not cover the data region",
+               c->ext.refcount_start, c->ext.refcount_blocks);
+        return -1;
+    }
+    if ((sb->flags & FEATURE_MERKLE) &&
+        (c->ext.merkle_start < sb->data_region_start ||
+         c->ext.merkle_blocks > sb->total_blocks - c->ext.merkle_start ||
+         c->ext.merkle_blocks != merkle_tree_blocks(sb->data_region_blocks))) {
+        report(c, "superblock: hash tree %" PRIu64 "+%" PRIu64 " does not fit the data region",
+               c->ext.merkle_start, c->ext.merkle_blocks);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    char* image_name = NULL;
+    int quick = 0;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads = online < 1 ? 1 : (online > MAX_THREADS ? MAX_THREADS : online);
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_name = argv[++i];
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char* end;
+            threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0') threads = 0;
+        } else {
+            print_usage(argv[0]);
+            return CHECK_FAILED;
+        }
+    }
+    if (!image_name || threads < 1 || threads > MAX_THREADS) {
+        print_usage(argv[0]);
+        return CHECK_FAILED;
+    }
+
+    int fd = open(image_name, O_RDONLY);
+    struct stat st;
+    uint8_t block0[BS];
+    if (fd < 0 || fstat(fd, &st) != 0 || read_full(fd, block0, BS, 0) != 0) {
+        fprintf(stderr, "Error: Cannot read image '%s': %s\n", image_name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return CHECK_FAILED;
+    }
+
+    check_t c = { .fd = fd, .quick = quick };
+    memcpy(&c.sb, block0, sizeof(c.sb));
+    memcpy(&c.ext, block0 + SB_EXT_OFFSET, sizeof(c.ext));
+    pthread_mutex_init(&c.print_lock, NULL);
+    printf("Checking image '%s'%s\n", image_name, quick ? " (quick)" : "");
+
+    int status = CHECK_FAILED;
+    image_t img = { .read_fd = fd, .write_fd = -1, .total_blocks = c.sb.total_blocks };
+    if (check_superblock(&c, block0, (uint64_t)st.st_size) != 0) {
+        status = CHECK_ERRORS;
+        goto out;
+    }
+    if (image_bitmap_load(&img, &c.inode_bitmap, c.sb.inode_bitmap_start,
+                          c.sb.inode_bitmap_blocks, c.sb.inode_count, NULL) != 0 ||
+        image_bitmap_load(&img, &c.data_bitmap, c.sb.data_bitmap_start,
+                          c.sb.data_bitmap_blocks, c.sb.data_region_blocks, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot read bitmaps from '%s': %s\n", image_name, strerror(errno));
+        goto out;
+    }
+
+    uint64_t inodes = c.sb.inode_count, blocks = c.sb.data_region_blocks;
+    c.block_refs = calloc(blocks, sizeof(*c.block_refs));
+    c.inode_refs = calloc(inodes, sizeof(*c.inode_refs));
+    c.ref_types = calloc(inodes, sizeof(*c.ref_types));
+    c.parent_of = calloc(inodes, sizeof(*c.parent_of));
+    c.modes = calloc(inodes, sizeof(*c.modes));
+    c.links = calloc(inodes, sizeof(*c.links));
+    c.dotdot = calloc(inodes, sizeof(*c.dotdot));
+    c.children = calloc(inodes, sizeof(*c.children));
+    if (!c.block_refs || !c.inode_refs || !c.ref_types || !c.parent_of ||
+        !c.modes || !c.links || !c.dotdot || !c.children) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto out;
+    }
+
+    if (c.sb.flags & FEATURE_DEDUP) {
+        c.refcounts = malloc(c.ext.refcount_blocks * BS);
+        if (!c.refcounts) {
+            fprintf(stderr, "Error: Out of memory\n");
+            goto out;
+        }
+        if (read_full(fd, c.refcounts, c.ext.refcount_blocks * BS, c.ext.refcount_start * BS) != 0) {
+            fprintf(stderr, "Error: Cannot read refcount table from '%s': %s\n", image_name, strerror(errno));
+            goto out;
+        }
+        // The table's own blocks count as referenced once
+        for (uint64_t b = 0; b < c.ext.refcount_blocks; b++) {
+            c.block_refs[c.ext.refcount_start - c.sb.data_region_start + b] = 1;
+        }
+    }
+    // So do the hash tree's (its hashes are mkfs_verify's business); a tree
+    // overlapping the refcount table shows up as blocks referenced twice
+    if (c.sb.flags & FEATURE_MERKLE) {
+        for (uint64_t b = 0; b < c.ext.merkle_blocks; b++) {
+            c.block_refs[c.ext.merkle_start - c.sb.data_region_start + b]++;
+        }
+    }
+
+    if (!bitmap_test(&c.inode_bitmap.bm, ROOT_INO - 1)) report(&c, "root inode is not allocated");
+    check_bitmap_padding(&c, &c.inode_bitmap, "inode");
+    check_bitmap_padding(&c, &c.data_bitmap, "data");
+    if (c.sb.flags & FEATURE_FREE_COUNTS) {
+        check_free_counts(&c, &c.inode_bitmap, c.ext.free_inodes, c.ext.first_free_inode, "inodes");
+        check_free_counts(&c, &c.data_bitmap, c.ext.free_blocks, c.ext.first_free_block, "blocks");
+    }
+
+    size_t inode_chunks = (size_t)((inodes + INODE_CHUNK - 1) / INODE_CHUNK);
+    size_t bitmap_chunks = (size_t)((blocks + BITMAP_CHUNK - 1) / BITMAP_CHUNK);
+    if (!stopped(&c)) run_pass(&c, inode_pass, inode_chunks, (int)threads);
+    if (!stopped(&c)) run_pass(&c, cross_check_pass, inode_chunks + bitmap_chunks, (int)threads);
+    if (atomic_load(&c.io_failed)) goto out;
+
+    size_t errors = atomic_load(&c.errors);
+    if (errors == 0) {
+        printf("Image '%s' is consistent\n", image_name);
+        printf("  Inodes: %" PRIu64 " of %" PRIu64 " in use\n",
+               inodes - c.inode_bitmap.bm.free, inodes);
+        printf("  Data blocks: %" PRIu64 " of %" PRIu64 " in use\n",
+               blocks - c.data_bitmap.bm.free, blocks);
+        status = CHECK_CLEAN;
+    } else {
+        status = CHECK_ERRORS;
+    }
+
+out:
+    if (status == CHECK_ERRORS) {
+        if (quick) {
+            printf("Image '%s' is inconsistent (stopped at the first error)\n", image_name);
+        } else {
+            size_t errors = atomic_load(&c.errors);
+            printf("Image '%s' is inconsistent: %zu error%s\n", image_name, errors, errors == 1 ? "" : "s");
+        }
+    }
+    free(c.block_refs);
+    free(c.refcounts);
+    free(c.inode_refs);
+    free(c.ref_types);
+    free(c.parent_of);
+    free(c.modes);
+    free(c.links);
+    free(c.dotdot);
+    free(c.children);
+    free(c.inode_bitmap.data);
+    free(c.data_bitmap.data);
+    pthread_mutex_destroy(&c.print_lock);
+    close(fd);
+    return status;
+}
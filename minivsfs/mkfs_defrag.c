@@ -0,0 +1,200 @@
+// Build: make mkfs_defrag
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "mvfs.h"
+#include "stats.h"
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --image <image.img> [--output <output.img>] [--dry-run] [--stats json]\n", prog_name);
+}
+
+// ===================================DEFRAG====================================
+// The compacted image is always written as a new file by mvfs_defrag. Without
+// --output it goes next to the image and is renamed over it once complete and
+// synced, so a crash at any point leaves either the old image or the new one,
+// never a mix. Until the rename the image is only read.
+
+static int print_stats; // --stats json: counters and phase times on stderr at exit
+
+// One line of the report; after is NULL when there is only a before column
+static void print_row(const char* label, const char* before, const char* after) {
+    if (after) {
+        printf("  %-26s %12s %12s\n", label, before, after);
+    } else {
+        printf("  %-26s %12s\n", label, before);
+    }
+}
+
+static void print_count(const char* label, uint64_t before, const uint64_t* after) {
+    char b[32], a[32];
+    snprintf(b, sizeof(b), "%" PRIu64, before);
+    if (after) snprintf(a, sizeof(a), "%" PRIu64, *after);
+    print_row(label, b, after ? a : NULL);
+}
+
+static double runs_per_file(const mvfs_frag_t* st) {
+    return st->files ? (double)st->file_runs / st->files : 0.0;
+}
+
+// before and, unless NULL, after side by side
+static void print_frag(const mvfs_frag_t* before, const mvfs_frag_t* after) {
+    char b[32], a[32];
+    print_row("", "before", after ? "after" : NULL);
+    print_count("Files with data", before->files, after ? &after->files : NULL);
+    print_count("Fragmented files", before->fragmented, after ? &after->fragmented : NULL);
+    snprintf(b, sizeof(b), "%.2f", runs_per_file(before));
+    if (after) snprintf(a, sizeof(a), "%.2f", runs_per_file(after));
+    print_row("Runs per file", b, after ? a : NULL);
+    print_count("Used blocks", before->used_blocks, after ? &after->used_blocks : NULL);
+    print_count("Stretches in a full read", before->walk_runs, after ? &after->walk_runs : NULL);
+    print_count("Blocks out of place", before->misplaced, after ? &after->misplaced : NULL);
+    print_count("Free runs", before->free_runs, after ? &after->free_runs : NULL);
+    print_count("Largest free run (blocks)", before->largest_free, after ? &after->largest_free : NULL);
+    print_count("Free blocks at the end", before->tail_free, after ? &after->tail_free : NULL);
+}
+
+static int compact(const mvfs_frag_t* st) {
+    return st->misplaced == 0;
+}
+
+static int measure(const char* image_name, mvfs_frag_t* st) {
+    mvfs_t* fs = mvfs_open(image_name, MVFS_RDONLY);
+    if (!fs || mvfs_frag(fs, st) != 0) {
+        fprintf(stderr, "Error: Cannot read image '%s': %s\n", image_name, strerror(errno));
+        if (fs) mvfs_abort(fs);
+        return -1;
+    }
+    mvfs_abort(fs);
+    return 0;
+}
+
+static int defrag(int argc, char* argv[]) {
+    crc32_init();
+    stats_phase("parse");
+
+    char* image_name = NULL;
+    char* output_name = NULL;
+    int dry_run = 0;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_name = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+            print_stats = 1;
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!image_name || (dry_run && output_name)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Work in place when --output names the image itself
+    struct stat image_stat, output_stat;
+    if (output_name && stat(image_name, &image_stat) == 0 && stat(output_name, &output_stat) == 0 &&
+        image_stat.st_dev == output_stat.st_dev && image_stat.st_ino == output_stat.st_ino) {
+        output_name = NULL;
+    }
+
+    stats_phase("open");
+    mvfs_t* fs = mvfs_open(image_name, MVFS_RDONLY);
+    if (!fs) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is not a valid MiniVSFS image\n", image_name);
+        } else {
+            fprintf(stderr, "Error: Cannot open image '%s': %s\n", image_name, strerror(errno));
+        }
+        return 1;
+    }
+
+    stats_phase("scan");
+    mvfs_frag_t before;
+    if (mvfs_frag(fs, &before) != 0) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is damaged; run mkfs_check on it first\n", image_name);
+        } else {
+            fprintf(stderr, "Error: Cannot read image '%s': %s\n", image_name, strerror(errno));
+        }
+        mvfs_abort(fs);
+        return 1;
+    }
+    if (dry_run || (!output_name && compact(&before))) {
+        mvfs_abort(fs);
+        stats_phase(NULL);
+        printf("Image '%s' is %s\n", image_name, compact(&before) ? "already compact" : "fragmented");
+        print_frag(&before, NULL);
+        return 0;
+    }
+
+    char* temp_name = NULL;
+    if (!output_name && asprintf(&temp_name, "%s.defrag", image_name) < 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        mvfs_abort(fs);
+        return 1;
+    }
+    const char* target = output_name ? output_name : temp_name;
+    stats_phase("defrag");
+    if (mvfs_defrag(fs, target) != 0) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is damaged; run mkfs_check on it first\n", image_name);
+        } else if (errno == EFBIG) {
+            fprintf(stderr, "Error: A file sharing blocks would need more than %zu extents\n", (size_t)EXTENTS_MAX);
+        } else {
+            fprintf(stderr, "Error: Cannot write '%s': %s\n", target, strerror(errno));
+        }
+        mvfs_abort(fs);
+        free(temp_name);
+        return 1;
+    }
+    mvfs_abort(fs); // opened read-only: nothing to write back
+
+    // The commit point of an in-place run
+    stats_phase("commit");
+    if (temp_name && rename(temp_name, image_name) != 0) {
+        fprintf(stderr, "Error: Cannot replace '%s' with '%s': %s\n", image_name, temp_name, strerror(errno));
+        unlink(temp_name);
+        free(temp_name);
+        return 1;
+    }
+    free(temp_name);
+    target = output_name ? output_name : image_name;
+
+    stats_phase("verify");
+    mvfs_frag_t after;
+    if (measure(target, &after) != 0) return 1;
+    stats_phase(NULL);
+
+    if (output_name) {
+        printf("Image '%s' defragmented into '%s'\n", image_name, output_name);
+    } else {
+        printf("Image '%s' defragmented in place\n", image_name);
+    }
+    print_frag(&before, &after);
+    return 0;
+}
+// ===================================DEFRAG====================================
+
+int main(int argc, char* argv[]) {
+    int status = defrag(argc, argv);
+    if (print_stats) stats_print_json(stderr, "mkfs_defrag", status);
+    return status;
+}
@@ -0,0 +1,153 @@
+// Build: make mkfs_delta
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "delta.h"
+#include "mvfs.h"
+#include "stats.h"
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --old <old.img | old.sig> --new <new.img> --output <delta> [--stats json]\n", prog_name);
+    fprintf(stderr, "       %s --signature <image.img> --output <image.sig> [--stats json]\n", prog_name);
+}
+
+// ===================================DELTA=====================================
+// The output is written under its own name and removed again on any error, so
+// a delta that exists is complete. The images are only read.
+
+static int print_stats; // --stats json: counters and phase times on stderr at exit
+
+// Only whole MiniVSFS images are diffed; the check reads just the superblock
+// and the bitmaps
+static int check_image(const char* name) {
+    mvfs_t* fs = mvfs_open(name, MVFS_RDONLY);
+    if (!fs) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is not a valid MiniVSFS image\n", name);
+        } else {
+            fprintf(stderr, "Error: Cannot open image '%s': %s\n", name, strerror(errno));
+        }
+        return -1;
+    }
+    mvfs_abort(fs);
+    return 0;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static int delta(int argc, char* argv[]) {
+    crc32_init();
+    stats_phase("parse");
+
+    char* old_name = NULL;
+    char* new_name = NULL;
+    char* signature_name = NULL;
+    char* output_name = NULL;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--old") == 0 && i + 1 < argc) {
+            old_name = argv[++i];
+        } else if (strcmp(argv[i], "--new") == 0 && i + 1 < argc) {
+            new_name = argv[++i];
+        } else if (strcmp(argv[i], "--signature") == 0 && i + 1 < argc) {
+            signature_name = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+            print_stats = 1;
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!output_name || (signature_name ? (old_name || new_name) : (!old_name || !new_name))) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    stats_phase("open");
+    const char* in_name = signature_name ? signature_name : old_name;
+    if (check_image(signature_name ? signature_name : new_name) != 0) return 1;
+    int old_fd = open(in_name, O_RDONLY);
+    if (old_fd < 0) {
+        fprintf(stderr, "Error: Cannot open '%s': %s\n", in_name, strerror(errno));
+        return 1;
+    }
+    int new_fd = -1;
+    if (new_name && (new_fd = open(new_name, O_RDONLY)) < 0) {
+        fprintf(stderr, "Error: Cannot open image '%s': %s\n", new_name, strerror(errno));
+        close(old_fd);
+        return 1;
+    }
+    int out_fd = open(output_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        fprintf(stderr, "Error: Cannot create '%s': %s\n", output_name, strerror(errno));
+        close(old_fd);
+        if (new_fd >= 0) close(new_fd);
+        return 1;
+    }
+
+    delta_stats_t st;
+    int rc;
+    if (signature_name) {
+        stats_phase("signature");
+        rc = delta_signature(old_fd, out_fd, &st);
+    } else {
+        stats_phase("diff");
+        rc = delta_create(old_fd, new_fd, out_fd, &st);
+    }
+    int saved = errno;
+    close(old_fd);
+    if (new_fd >= 0) close(new_fd);
+    if (close(out_fd) != 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    stats_phase(NULL);
+    if (rc != 0) {
+        unlink(output_name);
+        if (saved == EBADMSG) {
+            fprintf(stderr, "Error: '%s' is a damaged signature file\n", in_name);
+        } else if (saved == EINVAL) {
+            fprintf(stderr, "Error: '%s' is not a whole number of %d-byte blocks\n", in_name, BS);
+        } else {
+            fprintf(stderr, "Error: Cannot write '%s': %s\n", output_name, strerror(saved));
+        }
+        return 1;
+    }
+
+    if (signature_name) {
+        printf("Signature of '%s' written to '%s'\n", signature_name, output_name);
+        printf("  Blocks:          %" PRIu64 "\n", st.old_blocks);
+        printf("  Signature size:  %" PRIu64 " bytes\n", st.delta_bytes);
+        return 0;
+    }
+    printf("Delta from '%s' to '%s' written to '%s'\n", old_name, new_name, output_name);
+    printf("  Blocks:          %" PRIu64 " -> %" PRIu64 "\n", st.old_blocks, st.new_blocks);
+    printf("  Changed blocks:  %" PRIu64 " in %" PRIu64 " runs (%" PRIu64 " carried, %" PRIu64 " zeroed)\n",
+           st.changed_blocks, st.runs, st.data_blocks, st.changed_blocks - st.data_blocks);
+    printf("  Delta size:      %" PRIu64 " bytes (%.2f%% of the new image)\n",
+           st.delta_bytes, percent(st.delta_bytes, st.new_blocks * BS));
+    return 0;
+}
+// ===================================DELTA=====================================
+
+int main(int argc, char* argv[]) {
+    int status = delta(argc, argv);
+    if (print_stats) stats_print_json(stderr, "mkfs_delta", status);
+    return status;
+}
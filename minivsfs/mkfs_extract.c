@@ -0,0 +1,312 @@
+// Build: make mkfs_extract
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "image.h"
+#include "mvfs.h"
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --image <image.img> --file <path> [--output <host file>]\n", prog_name);
+    fprintf(stderr, "       %s --image <image.img> --all <host directory>\n", prog_name);
+}
+
+// ================================ZERO-COPY IO=================================
+// File data moves from the image to the destination inside the kernel:
+// copy_file_range first (which can also share extents on reflink-capable file
+// systems), sendfile where the kernel refuses copy_file_range (e.g. across
+// file systems on older kernels). mvfs_map merges adjacent blocks into one
+// run, so each contiguous stretch of a file is a single call.
+
+// Copies len bytes from the image at in_off to the destination at out_off
+static int copy_range(int in_fd, int out_fd, uint64_t in_off, uint64_t out_off, uint64_t len) {
+    loff_t in_pos = (loff_t)in_off, out_pos = (loff_t)out_off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, len, 0);
+        if (n > 0) {
+            len -= (uint64_t)n;
+            continue;
+        }
+        if (n == 0) {
+            errno = EIO; // image shorter than its superblock says
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+        break; // fall back to sendfile for the rest
+    }
+    if (len > 0 && lseek(out_fd, out_pos, SEEK_SET) < 0) return -1;
+    off_t pos = (off_t)in_pos;
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, in_fd, &pos, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+// Writes one file's contents to a fresh host file; *run_count receives the
+// number of runs it was copied in
+static int extract_to(mvfs_t* fs, uint32_t ino_no, const mvfs_stat_t* st, const char* dest, size_t* run_count) {
+    extent_t* runs = NULL;
+    size_t count = 0;
+    if (mvfs_map(fs, ino_no, &runs, &count) != 0) return -1;
+    int out_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        int err = errno;
+        free(runs);
+        errno = err;
+        return -1;
+    }
+    int rc = 0;
+    if (st->mode & MODE_INLINE) {
+        uint8_t data[INLINE_MAX];
+        ssize_t n = mvfs_read(fs, ino_no, data, sizeof(data), 0);
+        rc = n < 0 ? -1 : write_full(out_fd, data, (size_t)n, 0);
+    } else if (st->mode & MODE_COMPRESSED) {
+        // The blocks hold frames, not file bytes: decode through the library
+        uint8_t* data = malloc(ZFRAME_RAW);
+        rc = data ? 0 : -1;
+        for (uint64_t done = 0; rc == 0 && done < st->size; ) {
+            ssize_t n = mvfs_read(fs, ino_no, data, ZFRAME_RAW, done);
+            if (n <= 0) {
+                if (n == 0) errno = EIO;
+                rc = -1;
+                break;
+            }
+            rc = write_full(out_fd, data, (size_t)n, done);
+            done += (uint64_t)n;
+        }
+        free(data);
+    } else {
+        uint64_t done = 0;
+        for (size_t r = 0; rc == 0 && r < count && done < st->size; r++) {
+            uint64_t len = (uint64_t)runs[r].len * BS;
+            if (len > st->size - done) len = st->size - done;
+            rc = copy_range(mvfs_data_fd(fs), out_fd, (uint64_t)runs[r].start * BS, done, len);
+            done += len;
+        }
+    }
+    int err = errno;
+    free(runs);
+    if (close(out_fd) != 0 && rc == 0) return -1;
+    errno = err;
+    *run_count = count;
+    return rc;
+}
+// ================================ZERO-COPY IO=================================
+
+// ================================EXTRACT ALL==================================
+// Every directory is walked first to collect the files; they are then sorted
+// by their first data block so the image is read front to back in one sweep.
+
+typedef struct {
+    char* path;          // relative path inside the image
+    uint32_t ino_no;
+    uint64_t first_block; // 0 for inline and empty files
+} extract_item_t;
+
+typedef struct {
+    mvfs_t* fs;
+    const char* out_dir;
+    const char* prefix;  // relative path of the directory being walked
+    extract_item_t* items;
+    size_t count;
+    size_t cap;
+    size_t dirs;
+} walk_t;
+
+// walk_entry returns WALK_REPORTED for failures it has already printed
+#define WALK_REPORTED -2
+
+static int walk_dir(walk_t* w, uint32_t dir_no, const char* prefix);
+
+static int walk_entry(const char* name, uint32_t ino_no, uint8_t type, void* arg) {
+    (void)type; // the inode decides, not the entry
+    walk_t* w = arg;
+    char* path = NULL;
+    if (asprintf(&path, "%s%s", w->prefix, name) < 0) return -1;
+    mvfs_stat_t st;
+    if (mvfs_stat(w->fs, ino_no, &st) != 0) {
+        fprintf(stderr, "Error: Cannot read inode %" PRIu32 " ('%s'): %s\n", ino_no, path, strerror(errno));
+        free(path);
+        return WALK_REPORTED;
+    }
+    if ((st.mode & MODE_TYPE_MASK) == MODE_DIR) {
+        char* host = NULL;
+        int rc = asprintf(&host, "%s/%s", w->out_dir, path);
+        if (rc >= 0 && mkdir(host, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Cannot create directory '%s': %s\n", host, strerror(errno));
+            rc = WALK_REPORTED;
+        }
+        free(host);
+        if (rc >= 0) {
+            char* sub = NULL;
+            rc = asprintf(&sub, "%s/", path);
+            if (rc >= 0) rc = walk_dir(w, ino_no, sub);
+            free(sub);
+        }
+        w->dirs++;
+        free(path);
+        return rc < 0 ? WALK_REPORTED : 0;
+    }
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 64;
+        extract_item_t* items = realloc(w->items, cap * sizeof(*items));
+        if (!items) {
+            free(path);
+            return -1;
+        }
+        w->items = items;
+        w->cap = cap;
+    }
+    extract_item_t* item = &w->items[w->count++];
+    item->path = path;
+    item->ino_no = ino_no;
+    item->first_block = 0;
+    extent_t* runs;
+    size_t count;
+    if (mvfs_map(w->fs, ino_no, &runs, &count) != 0) {
+        fprintf(stderr, "Error: Cannot map inode %" PRIu32 " ('%s'): %s\n", ino_no, path, strerror(errno));
+        return WALK_REPORTED;
+    }
+    if (count > 0) item->first_block = runs[0].start;
+    free(runs);
+    return 0;
+}
+
+static int walk_dir(walk_t* w, uint32_t dir_no, const char* prefix) {
+    const char* saved = w->prefix;
+    w->prefix = prefix;
+    int rc = mvfs_iterate(w->fs, dir_no, walk_entry, w);
+    if (rc == -1) {
+        fprintf(stderr, "Error: Cannot read directory inode %" PRIu32 ": %s\n", dir_no, strerror(errno));
+    }
+    w->prefix = saved;
+    return rc < 0 ? WALK_REPORTED : rc;
+}
+
+static int by_first_block(const void* a, const void* b) {
+    const extract_item_t* x = a;
+    const extract_item_t* y = b;
+    return (x->first_block > y->first_block) - (x->first_block < y->first_block);
+}
+// ================================EXTRACT ALL==================================
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    char* image_name = NULL;
+    char* file_name = NULL;
+    char* output_name = NULL;
+    char* all_dir = NULL;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_name = argv[++i];
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            file_name = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (strcmp(argv[i], "--all") == 0 && i + 1 < argc) {
+            all_dir = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!image_name || (!file_name == !all_dir) || (all_dir && output_name)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    mvfs_t* fs = mvfs_open(image_name, MVFS_RDONLY);
+    if (!fs) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is not a valid MiniVSFS image\n", image_name);
+        } else {
+            fprintf(stderr, "Error: Cannot open image '%s': %s\n", image_name, strerror(errno));
+        }
+        return 1;
+    }
+
+    walk_t w = { .fs = fs, .out_dir = all_dir };
+    int status = 1;
+
+    if (file_name) {
+        uint32_t ino_no;
+        mvfs_stat_t st;
+        if (mvfs_lookup(fs, file_name, &ino_no) != 0) {
+            fprintf(stderr, "Error: Cannot find '%s' in image '%s': %s\n", file_name, image_name, strerror(errno));
+            goto out;
+        }
+        if (mvfs_stat(fs, ino_no, &st) != 0 || (st.mode & MODE_TYPE_MASK) != MODE_FILE) {
+            fprintf(stderr, "Error: '%s' is not a regular file\n", file_name);
+            goto out;
+        }
+        if (!output_name) {
+            const char* base = strrchr(file_name, '/');
+            output_name = base ? (char*)base + 1 : file_name;
+        }
+        size_t run_count = 0;
+        if (extract_to(fs, ino_no, &st, output_name, &run_count) != 0) {
+            fprintf(stderr, "Error: Cannot extract '%s' to '%s': %s\n", file_name, output_name, strerror(errno));
+            goto out;
+        }
+        printf("File '%s' extracted to '%s'\n", file_name, output_name);
+        printf("  Inode: %" PRIu32 "\n", ino_no);
+        printf("  Size: %" PRIu64 " bytes (%zu run%s)\n", st.size, run_count, run_count == 1 ? "" : "s");
+        status = 0;
+        goto out;
+    }
+
+    if (mkdir(all_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create directory '%s': %s\n", all_dir, strerror(errno));
+        goto out;
+    }
+    if (walk_dir(&w, ROOT_INO, "") != 0) goto out;
+    qsort(w.items, w.count, sizeof(*w.items), by_first_block);
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < w.count; i++) {
+        char* dest = NULL;
+        mvfs_stat_t st;
+        size_t run_count;
+        if (mvfs_stat(fs, w.items[i].ino_no, &st) != 0 || asprintf(&dest, "%s/%s", all_dir, w.items[i].path) < 0) {
+            fprintf(stderr, "Error: Cannot read inode %" PRIu32 ": %s\n", w.items[i].ino_no, strerror(errno));
+            goto out;
+        }
+        if (extract_to(fs, w.items[i].ino_no, &st, dest, &run_count) != 0) {
+            fprintf(stderr, "Error: Cannot extract '%s' to '%s': %s\n", w.items[i].path, dest, strerror(errno));
+            free(dest);
+            goto out;
+        }
+        total_bytes += st.size;
+        free(dest);
+    }
+    printf("%zu files extracted to '%s'\n", w.count, all_dir);
+    printf("  Directories: %zu\n", w.dirs);
+    printf("  Size: %" PRIu64 " bytes\n", total_bytes);
+    status = 0;
+
+out:
+    for (size_t i = 0; i < w.count; i++) free(w.items[i].path);
+    free(w.items);
+    mvfs_close(fs);
+    return status;
+}
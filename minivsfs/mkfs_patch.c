@@ -0,0 +1,117 @@
+// Build: make mkfs_patch
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "delta.h"
+#include "mvfs.h"
+#include "stats.h"
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --image <image.img> --delta <delta> [--stats json]\n", prog_name);
+}
+
+// ===================================PATCH=====================================
+// delta_apply checks the whole image against the delta before it writes a
+// block, and skips blocks that already hold their new contents. A patch that
+// was interrupted is finished by running the same command again.
+
+static int print_stats; // --stats json: counters and phase times on stderr at exit
+
+static int patch(int argc, char* argv[]) {
+    crc32_init();
+    stats_phase("parse");
+
+    char* image_name = NULL;
+    char* delta_name = NULL;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_name = argv[++i];
+        } else if (strcmp(argv[i], "--delta") == 0 && i + 1 < argc) {
+            delta_name = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+            print_stats = 1;
+            i++;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!image_name || !delta_name) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    stats_phase("open");
+    int image_fd = open(image_name, O_RDWR);
+    if (image_fd < 0) {
+        fprintf(stderr, "Error: Cannot open image '%s': %s\n", image_name, strerror(errno));
+        return 1;
+    }
+    int delta_fd = open(delta_name, O_RDONLY);
+    if (delta_fd < 0) {
+        fprintf(stderr, "Error: Cannot open delta '%s': %s\n", delta_name, strerror(errno));
+        close(image_fd);
+        return 1;
+    }
+
+    stats_phase("apply");
+    delta_stats_t st;
+    int rc = delta_apply(image_fd, delta_fd, &st);
+    int saved = errno;
+    close(delta_fd);
+    if (close(image_fd) != 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    if (rc != 0) {
+        if (saved == EBADMSG) {
+            fprintf(stderr, "Error: '%s' is not a valid delta or is damaged\n", delta_name);
+        } else if (saved == ESTALE) {
+            fprintf(stderr, "Error: '%s' is not the image the delta was made from\n", image_name);
+        } else if (saved == EINVAL) {
+            fprintf(stderr, "Error: '%s' is not a whole number of %d-byte blocks\n", image_name, BS);
+        } else {
+            fprintf(stderr, "Error: Cannot patch '%s': %s\n", image_name, strerror(saved));
+        }
+        return 1;
+    }
+
+    stats_phase("verify");
+    mvfs_t* fs = mvfs_open(image_name, MVFS_RDONLY);
+    if (!fs) {
+        fprintf(stderr, "Error: Patched image '%s' does not open: %s\n", image_name, strerror(errno));
+        return 1;
+    }
+    mvfs_abort(fs);
+    stats_phase(NULL);
+
+    printf("Image '%s' patched with '%s'\n", image_name, delta_name);
+    printf("  Blocks:          %" PRIu64 " -> %" PRIu64 "\n", st.old_blocks, st.new_blocks);
+    printf("  Changed blocks:  %" PRIu64 " in %" PRIu64 " runs\n", st.changed_blocks, st.runs);
+    if (st.written_blocks < st.changed_blocks) {
+        printf("  Written blocks:  %" PRIu64 " (%" PRIu64 " already patched)\n", st.written_blocks,
+               st.changed_blocks - st.written_blocks);
+    } else {
+        printf("  Written blocks:  %" PRIu64 "\n", st.written_blocks);
+    }
+    return 0;
+}
+// ===================================PATCH=====================================
+
+int main(int argc, char* argv[]) {
+    int status = patch(argc, argv);
+    if (print_stats) stats_print_json(stderr, "mkfs_patch", status);
+    return status;
+}
@@ -0,0 +1,208 @@
+// Build: make mkfs_verify
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "minivsfs.h"
+#include "crc32.h"
+#include "mvfs.h"
+#include "stats.h"
+
+// Exit codes, as for mkfs_check
+#define VERIFY_CLEAN 0
+#define VERIFY_CORRUPT 1   // some block does not match the hash tree
+#define VERIFY_FAILED 2    // usage error, no hash tree, or the image could not be read
+
+#define MAX_THREADS 64
+
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s --image <image.img> [--path <path>]... [--threads <1..%d>] [--stats json]\n",
+            prog_name, MAX_THREADS);
+}
+
+// ==================================VERIFY=====================================
+// The whole image: the tree is read and checked once, then the data region
+// is hashed in parts, one per level-0 tree block (512 data blocks), which
+// the threads take in turn. With --path only the blocks of the named files
+// and directories are hashed, along with the tree blocks above them.
+
+static int print_stats; // --stats json: counters and phase times on stderr at exit
+
+typedef struct {
+    mvfs_t* fs;
+    uint64_t parts;
+    atomic_uint_fast64_t next_part;
+    atomic_int error;                // errno of the first failed read, 0 if none
+} verify_job_t;
+
+typedef struct {
+    verify_job_t* job;
+    mvfs_verify_t st;
+} verify_worker_t;
+
+static void* verify_worker(void* arg) {
+    verify_worker_t* w = arg;
+    verify_job_t* job = w->job;
+    while (!atomic_load_explicit(&job->error, memory_order_relaxed)) {
+        uint64_t part = atomic_fetch_add(&job->next_part, 1);
+        if (part >= job->parts) break;
+        if (mvfs_verify_part(job->fs, part, &w->st) != 0) {
+            int expected = 0;
+            atomic_compare_exchange_strong(&job->error, &expected, errno ? errno : EIO);
+        }
+    }
+    return NULL;
+}
+
+// Adds one worker's findings to the total
+static void merge(mvfs_verify_t* total, const mvfs_verify_t* part) {
+    uint64_t listed = part->bad_blocks < MVFS_VERIFY_BAD ? part->bad_blocks : MVFS_VERIFY_BAD;
+    for (uint64_t i = 0; i < listed && total->bad_blocks < MVFS_VERIFY_BAD; i++) {
+        total->bad[total->bad_blocks++] = part->bad[i];
+    }
+    total->bad_blocks += part->bad_blocks - listed;
+    total->data_blocks += part->data_blocks;
+    total->tree_blocks += part->tree_blocks;
+}
+
+static int compare_blocks(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int verify_all(mvfs_t* fs, int threads, mvfs_verify_t* st) {
+    stats_phase("tree");
+    int64_t parts = mvfs_verify_tree(fs, st);
+    if (parts < 0) return -1;
+
+    stats_phase("data");
+    verify_job_t job = { .fs = fs, .parts = (uint64_t)parts };
+    verify_worker_t workers[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    int started = 0;
+    for (int t = 0; t < threads; t++) workers[t].job = &job;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, verify_worker, &workers[started + 1]) != 0) break;
+    }
+    verify_worker(&workers[0]); // the main thread works too
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    for (int t = 0; t <= started; t++) merge(st, &workers[t].st);
+    int err = atomic_load(&job.error);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int verify(int argc, char* argv[]) {
+    crc32_init();
+    stats_phase("parse");
+
+    char* image_name = NULL;
+    char** paths = calloc((size_t)argc, sizeof(*paths));
+    size_t path_count = 0;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads = online < 1 ? 1 : (online > MAX_THREADS ? MAX_THREADS : online);
+    if (!paths) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return VERIFY_FAILED;
+    }
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_name = argv[++i];
+        } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            paths[path_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char* end;
+            threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0') threads = 0;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+            print_stats = 1;
+            i++;
+        } else {
+            print_usage(argv[0]);
+            free(paths);
+            return VERIFY_FAILED;
+        }
+    }
+    if (!image_name || threads < 1 || threads > MAX_THREADS) {
+        print_usage(argv[0]);
+        free(paths);
+        return VERIFY_FAILED;
+    }
+
+    stats_phase("open");
+    mvfs_t* fs = mvfs_open(image_name, MVFS_RDONLY);
+    if (!fs) {
+        if (errno == EUCLEAN) {
+            fprintf(stderr, "Error: '%s' is not a valid MiniVSFS image\n", image_name);
+        } else {
+            fprintf(stderr, "Error: Cannot open image '%s': %s\n", image_name, strerror(errno));
+        }
+        free(paths);
+        return VERIFY_FAILED;
+    }
+    if (!(mvfs_superblock(fs)->flags & FEATURE_MERKLE)) {
+        fprintf(stderr, "Error: '%s' has no hash tree (build it with --merkle)\n", image_name);
+        mvfs_abort(fs);
+        free(paths);
+        return VERIFY_FAILED;
+    }
+
+    mvfs_verify_t st = {0};
+    int rc = 0;
+    if (path_count == 0) {
+        rc = verify_all(fs, (int)threads, &st);
+        if (rc != 0) fprintf(stderr, "Error: Cannot read image '%s': %s\n", image_name, strerror(errno));
+    } else {
+        stats_phase("files");
+        for (size_t p = 0; rc == 0 && p < path_count; p++) {
+            uint32_t ino;
+            if (mvfs_lookup(fs, paths[p], &ino) != 0) {
+                fprintf(stderr, "Error: Cannot find '%s' in '%s': %s\n", paths[p], image_name, strerror(errno));
+                rc = -1;
+            } else if (mvfs_verify_file(fs, ino, &st) != 0) {
+                fprintf(stderr, "Error: Cannot verify '%s': %s\n", paths[p], strerror(errno));
+                rc = -1;
+            }
+        }
+    }
+    mvfs_abort(fs);
+    free(paths);
+    stats_phase(NULL);
+    if (rc != 0) return VERIFY_FAILED;
+
+    printf("Verified image '%s'%s\n", image_name, path_count ? " (selected paths)" : "");
+    printf("  Data blocks: %" PRIu64 " hashed\n", st.data_blocks);
+    printf("  Tree blocks: %" PRIu64 " checked\n", st.tree_blocks);
+    if (st.bad_blocks == 0) {
+        printf("Image '%s' matches its hash tree\n", image_name);
+        return VERIFY_CLEAN;
+    }
+    uint64_t listed = st.bad_blocks < MVFS_VERIFY_BAD ? st.bad_blocks : MVFS_VERIFY_BAD;
+    qsort(st.bad, (size_t)listed, sizeof(st.bad[0]), compare_blocks);
+    for (uint64_t i = 0; i < listed; i++) printf("  Bad block: %" PRIu64 "\n", st.bad[i]);
+    if (listed < st.bad_blocks) printf("  ... and %" PRIu64 " more\n", st.bad_blocks - listed);
+    printf("Image '%s' does not match its hash tree: %" PRIu64 " bad block%s\n", image_name, st.bad_blocks,
+           st.bad_blocks == 1 ? "" : "s");
+    return VERIFY_CORRUPT;
+}
+// ==================================VERIFY=====================================
+
+int main(int argc, char* argv[]) {
+    int status = verify(argc, argv);
+    if (print_stats) stats_print_json(stderr, "mkfs_verify", status);
+    return status;
+}
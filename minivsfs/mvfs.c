@@ -0,0 +1,2759 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "mvfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "crc32.h"
+#include "image.h"
+#include "dir.h"
+#include "io.h"
+#include "lz.h"
+#include "stats.h"
+
+#define BITS_PER_BLOCK (BS * 8ull)
+#define COPY_CHUNK_BLOCKS 64
+#define READAHEAD_MIN 8         // blocks, on the second sequential read
+#define READAHEAD_MAX 256       // blocks; the window doubles up to this
+
+// Inode-table block states
+#define TABLE_UNLOADED 0
+#define TABLE_CLEAN 1
+#define TABLE_DIRTY 2
+
+// Content index for MVFS_DEDUP: open addressing from a block's 64-bit
+// content key to an absolute block number holding those contents
+typedef struct {
+    uint64_t* keys;            // 0 marks a free slot
+    uint32_t* blocks;
+    size_t cap;                // power of two
+    size_t count;
+} dedup_index_t;
+
+struct mvfs {
+    image_t img;               // block cache and the descriptors
+    superblock_t sb;
+    superblock_ext_t ext;      // rest of block 0
+    int sb_dirty;
+    int writable;
+    char* output;              // mvfs_open_copy target, created on first write
+    int created_output;
+    image_bitmap_t inode_bitmap;
+    image_bitmap_t data_bitmap;
+    uint8_t* table;            // the whole inode table, loaded block by block
+    uint8_t* table_state;      // TABLE_* per inode-table block
+    int cache_data;            // mvfs_read goes through img's cache
+    uint32_t ra_ino;           // file of the last mvfs_read
+    uint64_t ra_next;          // offset just past it
+    uint32_t ra_window;        // current readahead window, in blocks
+    uint16_t* refcounts;       // FEATURE_DEDUP table, one entry per data block
+    uint8_t* refcount_dirty;   // per refcount table block
+    dedup_index_t index;
+    int index_built;
+    mvfs_dedup_stats_t dedup;
+    uint32_t z_ino;            // compressed file whose frame is decoded in z_raw
+    uint64_t z_offset;         // file offset of the decoded frame
+    uint64_t z_next;           // stream offset of the frame after it
+    uint32_t z_len;            // bytes decoded, 0 before the first frame
+    uint8_t* z_raw;            // ZFRAME_RAW bytes
+    uint8_t* z_packed;         // one frame as stored
+    io_kind_t io_kind;         // backend mvfs_fill copies with
+    io_engine_t* io;           // opened on first use
+    bitmap_t merkle_written;   // FEATURE_MERKLE: data blocks to rehash at the next flush (img.written)
+    uint8_t* merkle_bits;      // its storage
+    uint8_t* merkle_alloc;     // the data bitmap as of the last tree update
+    uint64_t* merkle_nodes;    // mvfs_verify_tree: the whole tree
+    uint8_t* merkle_ok;        // per tree block, whether it matches its parent
+};
+
+// =================================FORMAT======================================
+
+int mvfs_format(const char* path, uint64_t size_kib, uint64_t inodes, int preallocate, superblock_t* sb_out) {
+    // Calculate file system layout. Each bitmap gets as many blocks as its
+    // bits need; the data bitmap depends on the data region size, which in
+    // turn shrinks as the bitmap grows, so iterate to a fixed point.
+    uint64_t total_blocks = (size_kib * 1024) / BS;
+    uint64_t inode_bitmap_blocks = (inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;  // round up
+    uint64_t fixed_blocks = 1 + inode_bitmap_blocks + inode_table_blocks;  // superblock too
+
+    // Validate we have enough space
+    if (inodes == 0 || total_blocks <= fixed_blocks + 1) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t data_bitmap_blocks = 1;
+    while ((total_blocks - fixed_blocks - data_bitmap_blocks) > data_bitmap_blocks * BITS_PER_BLOCK) {
+        data_bitmap_blocks++;
+    }
+    uint64_t inode_bitmap_start = 1;
+    uint64_t data_bitmap_start = inode_bitmap_start + inode_bitmap_blocks;
+    uint64_t inode_table_start = data_bitmap_start + data_bitmap_blocks;
+    uint64_t data_region_start = inode_table_start + inode_table_blocks;
+    if (data_region_start >= total_blocks) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t data_region_blocks = total_blocks - data_region_start;
+
+    time_t build_time = time(NULL);
+
+    // Create and fill superblock
+    superblock_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = MVFS_MAGIC;
+    sb.version = 1;
+    sb.block_size = BS;
+    sb.total_blocks = total_blocks;
+    sb.inode_count = inodes;
+    sb.inode_bitmap_start = inode_bitmap_start;
+    sb.inode_bitmap_blocks = inode_bitmap_blocks;
+    sb.data_bitmap_start = data_bitmap_start;
+    sb.data_bitmap_blocks = data_bitmap_blocks;
+    sb.inode_table_start = inode_table_start;
+    sb.inode_table_blocks = inode_table_blocks;
+    sb.data_region_start = data_region_start;
+    sb.data_region_blocks = data_region_blocks;
+    sb.root_inode = ROOT_INO;
+    sb.mtime_epoch = build_time;
+    sb.flags = FEATURE_FREE_COUNTS;
+
+    // Only the root inode and the root directory block are in use
+    superblock_ext_t ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.free_inodes = inodes - 1;
+    ext.free_blocks = data_region_blocks - 1;
+    ext.first_free_inode = 1;
+    ext.first_free_block = 1;
+    superblock_ext_crc_finalize(&sb, &ext);
+
+    // Create root directory inode
+    inode_t root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
+    root_inode.mode = MODE_DIR;  // directory mode (0040000)8
+    root_inode.links = 2;       // . and ..
+    root_inode.size_bytes = 2 * sizeof(dirent64_t);  // . and .. entries
+    root_inode.atime = build_time;
+    root_inode.mtime = build_time;
+    root_inode.ctime = build_time;
+    root_inode.direct[0] = (uint32_t)data_region_start;  // first data block
+    inode_crc_finalize(&root_inode);
+
+    // Create . and .. directory entries
+    dirent64_t dot_entry, dotdot_entry;
+    memset(&dot_entry, 0, sizeof(dot_entry));
+    dot_entry.inode_no = ROOT_INO;
+    dot_entry.type = 2;  // directory
+    strcpy(dot_entry.name, ".");
+    dirent_checksum_finalize(&dot_entry);
+
+    memset(&dotdot_entry, 0, sizeof(dotdot_entry));
+    dotdot_entry.inode_no = ROOT_INO;
+    dotdot_entry.type = 2;  // directory
+    strcpy(dotdot_entry.name, "..");
+    dirent_checksum_finalize(&dotdot_entry);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    // Size the image up front. Every block that is all zeros is left as a hole
+    // (or just reserved with preallocate), so only the five blocks that carry
+    // data are written and creation time does not depend on the image size.
+    off_t image_bytes = (off_t)(total_blocks * BS);
+    int rc = preallocate ? posix_fallocate(fd, 0, image_bytes) : 0;
+    stats_add(STAT_SYSCALLS, preallocate ? 2 : 1);
+    if (rc != 0 || ftruncate(fd, image_bytes) != 0) {
+        if (rc != 0) errno = rc;
+        goto fail;
+    }
+
+    // Superblock (block 0)
+    uint8_t block_buffer[BS];
+    memset(block_buffer, 0, BS);
+    memcpy(block_buffer, &sb, sizeof(sb));
+    memcpy(block_buffer + SB_EXT_OFFSET, &ext, sizeof(ext));
+    if (write_full(fd, block_buffer, BS, 0) != 0) goto fail;
+
+    // First inode bitmap block - mark root inode as used; later bitmap blocks are all zero
+    bitmap_t bitmap;
+    memset(block_buffer, 0, BS);
+    bitmap_init(&bitmap, block_buffer, inodes < BITS_PER_BLOCK ? inodes : BITS_PER_BLOCK);
+    bitmap_set(&bitmap, ROOT_INO - 1);  // bit 0 set (inode #1 used)
+    if (write_full(fd, block_buffer, BS, inode_bitmap_start * BS) != 0) goto fail;
+
+    // First data bitmap block - mark first data block as used
+    memset(block_buffer, 0, BS);
+    bitmap_init(&bitmap, block_buffer, data_region_blocks < BITS_PER_BLOCK ? data_region_blocks : BITS_PER_BLOCK);
+    bitmap_set(&bitmap, 0);  // bit 0 set (first data block used)
+    if (write_full(fd, block_buffer, BS, data_bitmap_start * BS) != 0) goto fail;
+
+    // First inode table block - root inode at position 0; the rest of the table stays zero
+    memset(block_buffer, 0, BS);
+    memcpy(block_buffer, &root_inode, sizeof(root_inode));
+    if (write_full(fd, block_buffer, BS, inode_table_start * BS) != 0) goto fail;
+
+    // First data block - . and .. entries of the root directory
+    memset(block_buffer, 0, BS);
+    memcpy(block_buffer, &dot_entry, sizeof(dot_entry));
+    memcpy(block_buffer + sizeof(dot_entry), &dotdot_entry, sizeof(dotdot_entry));
+    if (write_full(fd, block_buffer, BS, data_region_start * BS) != 0) goto fail;
+
+    if (close(fd) != 0) return -1;
+    if (sb_out) *sb_out = sb;
+    return 0;
+
+fail:;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+// ==================================HANDLE=====================================
+
+// Block 0 as last written in full: its checksum covers the superblock, the
+// extension fields and the zeros around them
+static int superblock_crc_valid(const uint8_t* block0) {
+    uint8_t copy[BS];
+    superblock_t sb;
+    memcpy(copy, block0, BS);
+    memcpy(&sb, block0, sizeof(sb));
+    memset(copy + offsetof(superblock_t, checksum), 0, sizeof(sb.checksum));
+    return crc32(copy, BS - 4) == sb.checksum;
+}
+
+// Geometry every other operation relies on; anything else is EUCLEAN
+static int superblock_valid(const superblock_t* sb, uint64_t image_size) {
+    return sb->magic == MVFS_MAGIC && sb->block_size == BS &&
+           sb->total_blocks <= image_size / BS &&
+           sb->inode_count > 0 && sb->inode_count <= UINT32_MAX &&
+           sb->inode_bitmap_blocks * BITS_PER_BLOCK >= sb->inode_count &&
+           sb->data_bitmap_blocks * BITS_PER_BLOCK >= sb->data_region_blocks &&
+           sb->inode_table_blocks * BS >= sb->inode_count * INODE_SIZE &&
+           sb->data_region_start + sb->data_region_blocks == sb->total_blocks &&
+           sb->inode_table_start + sb->inode_table_blocks <= sb->data_region_start &&
+           sb->root_inode == ROOT_INO;
+}
+
+// Saved free counts are used only if the flag is set and they are plausible;
+// otherwise (images from before FEATURE_FREE_COUNTS, or a flush cut short
+// while it cleared the flag) the bitmaps are counted
+static int free_counts_valid(const superblock_t* sb, const superblock_ext_t* ext) {
+    return (sb->flags & FEATURE_FREE_COUNTS) &&
+           ext->first_free_inode >= 1 && ext->first_free_inode <= sb->inode_count &&
+           ext->free_inodes <= sb->inode_count - ext->first_free_inode &&
+           ext->first_free_block >= 1 && ext->first_free_block <= sb->data_region_blocks &&
+           ext->free_blocks <= sb->data_region_blocks - ext->first_free_block;
+}
+
+// The refcount table must cover the data region from inside it
+static int refcount_table_valid(const superblock_t* sb, const superblock_ext_t* ext) {
+    return ext->refcount_start >= sb->data_region_start &&
+           ext->refcount_blocks <= sb->total_blocks - ext->refcount_start &&
+           ext->refcount_blocks * REFCOUNTS_PER_BLOCK >= sb->data_region_blocks;
+}
+
+// So must the hash tree, at exactly the size its levels need
+static int merkle_tree_valid(const superblock_t* sb, const superblock_ext_t* ext) {
+    return ext->merkle_start >= sb->data_region_start &&
+           ext->merkle_blocks == merkle_tree_blocks(sb->data_region_blocks) &&
+           ext->merkle_blocks <= sb->total_blocks - ext->merkle_start;
+}
+
+static int merkle_track(mvfs_t* fs);
+static int merkle_update(mvfs_t* fs);
+static int merkle_build(int fd, const superblock_t* sb, superblock_ext_t* ext, const bitmap_t* used);
+
+static mvfs_t* open_handle(const char* path, int flags, const char* output) {
+    mvfs_t* fs = calloc(1, sizeof(*fs));
+    if (!fs) return NULL;
+    fs->img.read_fd = fs->img.write_fd = -1;
+    fs->io_kind = IO_PREAD;
+    fs->writable = flags == MVFS_RDWR || output != NULL;
+    if (output && !(fs->output = strdup(output))) goto fail;
+
+    fs->img.read_fd = open(path, flags == MVFS_RDWR ? O_RDWR : O_RDONLY);
+    if (fs->img.read_fd < 0) goto fail;
+    if (flags == MVFS_RDWR) fs->img.write_fd = fs->img.read_fd;
+
+    struct stat st;
+    uint8_t block0[BS];
+    if (fstat(fs->img.read_fd, &st) != 0) goto fail;
+    if ((uint64_t)st.st_size < BS) {
+        errno = EUCLEAN;
+        goto fail;
+    }
+    if (read_full(fs->img.read_fd, block0, BS, 0) != 0) goto fail;
+    memcpy(&fs->sb, block0, sizeof(fs->sb));
+    memcpy(&fs->ext, block0 + SB_EXT_OFFSET, sizeof(fs->ext));
+    // A torn or corrupt superblock would misplace every region below
+    if (!superblock_crc_valid(block0) ||
+        !superblock_valid(&fs->sb, (uint64_t)st.st_size) ||
+        ((fs->sb.flags & FEATURE_DEDUP) && !refcount_table_valid(&fs->sb, &fs->ext)) ||
+        ((fs->sb.flags & FEATURE_MERKLE) && !merkle_tree_valid(&fs->sb, &fs->ext))) {
+        errno = EUCLEAN;
+        goto fail;
+    }
+    if (fs->sb.flags & FEATURE_DEDUP) {
+        fs->refcounts = malloc(fs->ext.refcount_blocks * BS);
+        fs->refcount_dirty = calloc(fs->ext.refcount_blocks, 1);
+        if (!fs->refcounts || !fs->refcount_dirty ||
+            read_full(fs->img.read_fd, fs->refcounts, fs->ext.refcount_blocks * BS, fs->ext.refcount_start * BS) != 0) {
+            goto fail;
+        }
+    }
+    fs->img.total_blocks = fs->sb.total_blocks;
+    fs->img.data_region_start = fs->sb.data_region_start;
+    mvfs_set_cache(fs, MVFS_CACHE_DEFAULT);
+
+    int counted = free_counts_valid(&fs->sb, &fs->ext);
+    const uint64_t inode_summary[2] = { fs->ext.free_inodes, fs->ext.first_free_inode };
+    const uint64_t data_summary[2] = { fs->ext.free_blocks, fs->ext.first_free_block };
+    if (image_bitmap_load(&fs->img, &fs->inode_bitmap, fs->sb.inode_bitmap_start,
+                          fs->sb.inode_bitmap_blocks, fs->sb.inode_count, counted ? inode_summary : NULL) != 0 ||
+        image_bitmap_load(&fs->img, &fs->data_bitmap, fs->sb.data_bitmap_start,
+                          fs->sb.data_bitmap_blocks, fs->sb.data_region_blocks, counted ? data_summary : NULL) != 0) goto fail;
+    fs->img.data_bitmap = &fs->data_bitmap.bm; // directory and extent blocks come from here
+    if ((fs->sb.flags & FEATURE_MERKLE) && fs->writable && merkle_track(fs) != 0) goto fail;
+
+    // Reserved, not read: table blocks are loaded on first use
+    fs->table = calloc(fs->sb.inode_table_blocks, BS);
+    fs->table_state = calloc(fs->sb.inode_table_blocks, 1);
+    if (!fs->table || !fs->table_state) goto fail;
+    return fs;
+
+fail:;
+    int err = errno;
+    mvfs_abort(fs);
+    errno = err;
+    return NULL;
+}
+
+mvfs_t* mvfs_open(const char* path, int flags) {
+    return open_handle(path, flags, NULL);
+}
+
+mvfs_t* mvfs_open_copy(const char* input, const char* output) {
+    return open_handle(input, MVFS_RDONLY, output);
+}
+
+// Makes sure there is somewhere to write to: creates the copy target the
+// first time it is needed
+static int begin_write(mvfs_t* fs) {
+    if (!fs->writable) {
+        errno = EROFS;
+        return -1;
+    }
+    if (fs->img.write_fd >= 0) return 0;
+    int fd = open(fs->output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    fs->img.write_fd = fd;
+    fs->created_output = 1;
+    uint64_t t0 = stats_now_ns();
+    int rc = copy_image(fs->img.read_fd, fd, fs->sb.total_blocks * BS);
+    stats_add(STAT_CLONE_NS, stats_now_ns() - t0);
+    return rc;
+}
+
+int mvfs_data_fd(mvfs_t* fs) {
+    return fs->img.write_fd >= 0 ? fs->img.write_fd : fs->img.read_fd;
+}
+
+void mvfs_set_cache(mvfs_t* fs, size_t bytes) {
+    fs->img.budget = bytes / BS;
+    if (bytes > 0 && fs->img.budget == 0) fs->img.budget = 1;
+    fs->cache_data = bytes > 0;
+}
+
+void mvfs_cache_stats(const mvfs_t* fs, mvfs_cache_stats_t* st) {
+    st->hits = fs->img.stats.hits;
+    st->misses = fs->img.stats.misses;
+    st->readahead = fs->img.stats.readahead;
+    st->evictions = fs->img.stats.evictions;
+    st->cached_blocks = fs->img.block_count;
+    st->budget_blocks = fs->img.budget;
+}
+
+const superblock_t* mvfs_superblock(const mvfs_t* fs) {
+    return &fs->sb;
+}
+
+uint64_t mvfs_free_inodes(const mvfs_t* fs) {
+    return fs->inode_bitmap.bm.free;
+}
+
+uint64_t mvfs_free_blocks(const mvfs_t* fs) {
+    return fs->data_bitmap.bm.free;
+}
+
+// Table entry for ino, loading its block on first use. Nothing is checked
+// here; get_live_inode checks the bitmap bit and the CRC on every call.
+static inode_t* get_inode(mvfs_t* fs, uint32_t ino) {
+    if (ino == 0 || ino > fs->sb.inode_count) {
+        errno = ENOENT;
+        return NULL;
+    }
+    uint64_t offset = (uint64_t)(ino - 1) * INODE_SIZE;
+    uint64_t block = offset / BS;
+    if (fs->table_state[block] == TABLE_UNLOADED) {
+        if (read_full(fs->img.read_fd, fs->table + block * BS, BS, (fs->sb.inode_table_start + block) * BS) != 0) {
+            return NULL;
+        }
+        fs->table_state[block] = TABLE_CLEAN;
+    }
+    return (inode_t*)(fs->table + offset);
+}
+
+// An allocated inode with a valid CRC. The CRC does not bound anything, so
+// an inline size that would run past the inode is refused here, once for
+// every reader and writer of inline bytes.
+static inode_t* get_live_inode(mvfs_t* fs, uint32_t ino) {
+    inode_t* node = get_inode(fs, ino);
+    if (!node) return NULL;
+    if (!bitmap_test(&fs->inode_bitmap.bm, ino - 1)) {
+        errno = ENOENT;
+        return NULL;
+    }
+    inode_t copy = *node;
+    inode_crc_finalize(&copy);
+    if (copy.inode_crc != node->inode_crc || ((node->mode & MODE_INLINE) && node->size_bytes > INLINE_MAX)) {
+        errno = EUCLEAN;
+        return NULL;
+    }
+    return node;
+}
+
+// Finalizes the inode's CRC and schedules its table block for writing
+static void put_inode(mvfs_t* fs, uint32_t ino, inode_t* node) {
+    inode_crc_finalize(node);
+    fs->table_state[(uint64_t)(ino - 1) * INODE_SIZE / BS] = TABLE_DIRTY;
+}
+
+static inode_t* get_dir(mvfs_t* fs, uint32_t ino) {
+    inode_t* dir = get_live_inode(fs, ino);
+    if (dir && (dir->mode & MODE_TYPE_MASK) != MODE_DIR) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    return dir;
+}
+
+// Writes block 0 from the in-memory superblock and its extension fields
+static int superblock_write(mvfs_t* fs) {
+    uint8_t block[BS] = {0};
+    superblock_ext_crc_finalize(&fs->sb, &fs->ext);
+    memcpy(block, &fs->sb, sizeof(fs->sb));
+    memcpy(block + SB_EXT_OFFSET, &fs->ext, sizeof(fs->ext));
+    return write_full(fs->img.write_fd, block, BS, 0);
+}
+
+int mvfs_flush(mvfs_t* fs) {
+    if (!fs->writable) return 0;
+    if (begin_write(fs) != 0) return -1;
+    int fd = fs->img.write_fd;
+    if (image_flush(&fs->img) != 0) return -1;
+
+    // Runs of dirty inode-table blocks go out as single writes
+    uint64_t blocks = fs->sb.inode_table_blocks;
+    for (uint64_t b = 0; b < blocks; ) {
+        if (fs->table_state[b] != TABLE_DIRTY) {
+            b++;
+            continue;
+        }
+        uint64_t end = b;
+        while (end < blocks && fs->table_state[end] == TABLE_DIRTY) fs->table_state[end++] = TABLE_CLEAN;
+        if (write_full(fd, fs->table + b * BS, (end - b) * BS, (fs->sb.inode_table_start + b) * BS) != 0) return -1;
+        b = end;
+    }
+
+    for (uint64_t b = 0; fs->refcounts && b < fs->ext.refcount_blocks; ) {
+        if (!fs->refcount_dirty[b]) {
+            b++;
+            continue;
+        }
+        uint64_t end = b;
+        while (end < fs->ext.refcount_blocks && fs->refcount_dirty[end]) fs->refcount_dirty[end++] = 0;
+        if (write_full(fd, (uint8_t*)fs->refcounts + b * BS, (end - b) * BS,
+                       (fs->ext.refcount_start + b) * BS) != 0) return -1;
+        image_forget(&fs->img, fs->ext.refcount_start + b, end - b);
+        b = end;
+    }
+    if (merkle_update(fs) != 0) return -1;
+
+    // Changed bitmaps change the free counts the superblock carries. Images
+    // from before FEATURE_FREE_COUNTS gain it with their first change. While
+    // the bitmaps are written the flag is off on disk, and the writes either
+    // side of them are synced, so a flush cut short (even by a power loss)
+    // leaves an image whose bitmaps are counted when it is next opened.
+    uint64_t first, last;
+    int bitmaps_dirty = bitmap_dirty_bytes(&fs->inode_bitmap.bm, &first, &last) ||
+                        bitmap_dirty_bytes(&fs->data_bitmap.bm, &first, &last);
+    if (bitmaps_dirty && (fs->sb.flags & FEATURE_FREE_COUNTS)) {
+        fs->sb.flags &= ~FEATURE_FREE_COUNTS;
+        fs->ext.free_inodes = fs->ext.free_blocks = 0;
+        fs->ext.first_free_inode = fs->ext.first_free_block = 0;
+        if (superblock_write(fs) != 0 || fdatasync(fd) != 0) return -1;
+    }
+    if (bitmaps_dirty || (fs->sb_dirty && !(fs->sb.flags & FEATURE_FREE_COUNTS))) {
+        fs->sb.flags |= FEATURE_FREE_COUNTS;
+        fs->ext.free_inodes = fs->inode_bitmap.bm.free;
+        fs->ext.free_blocks = fs->data_bitmap.bm.free;
+        fs->ext.first_free_inode = bitmap_first_free(&fs->inode_bitmap.bm);
+        fs->ext.first_free_block = bitmap_first_free(&fs->data_bitmap.bm);
+        fs->sb_dirty = 1;
+    }
+    if (image_bitmap_flush(&fs->img, &fs->inode_bitmap) != 0 ||
+        image_bitmap_flush(&fs->img, &fs->data_bitmap) != 0) return -1;
+    if (bitmaps_dirty && fdatasync(fd) != 0) return -1;
+    bitmap_clean(&fs->inode_bitmap.bm);
+    bitmap_clean(&fs->data_bitmap.bm);
+
+    // Superblock last
+    if (fs->sb_dirty) {
+        if (superblock_write(fs) != 0) return -1;
+        fs->sb_dirty = 0;
+    }
+    return 0;
+}
+
+void mvfs_abort(mvfs_t* fs) {
+    if (!fs) return;
+    if (fs->img.write_fd >= 0 && fs->img.write_fd != fs->img.read_fd) close(fs->img.write_fd);
+    if (fs->created_output) unlink(fs->output);
+    if (fs->img.read_fd >= 0) close(fs->img.read_fd);
+    image_release(&fs->img);
+    free(fs->inode_bitmap.data);
+    free(fs->data_bitmap.data);
+    free(fs->table);
+    free(fs->table_state);
+    free(fs->refcounts);
+    free(fs->refcount_dirty);
+    free(fs->index.keys);
+    free(fs->index.blocks);
+    free(fs->z_raw);
+    free(fs->z_packed);
+    io_engine_close(fs->io);
+    free(fs->merkle_bits);
+    free(fs->merkle_alloc);
+    free(fs->merkle_nodes);
+    free(fs->merkle_ok);
+    free(fs->output);
+    free(fs);
+}
+
+int mvfs_close(mvfs_t* fs) {
+    int rc = mvfs_flush(fs);
+    int err = errno;
+    if (fs->img.write_fd >= 0 && fs->img.write_fd != fs->img.read_fd && close(fs->img.write_fd) != 0 && rc == 0) {
+        rc = -1;
+        err = errno;
+    }
+    fs->img.write_fd = -1;
+    if (rc == 0) fs->created_output = 0; // keep a completed output
+    mvfs_abort(fs);
+    errno = err;
+    return rc;
+}
+
+// =================================LOOKUPS=====================================
+
+int mvfs_lookup(mvfs_t* fs, const char* path, uint32_t* ino) {
+    image_next_op(&fs->img);
+    uint32_t cur = ROOT_INO;
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        size_t len = strcspn(p, "/");
+        char name[sizeof(((dirent64_t*)0)->name)];
+        if (len >= sizeof(name)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+
+        inode_t* dir = get_dir(fs, cur);
+        if (!dir) return -1;
+        dirent64_t* de = dir_lookup(&fs->img, dir, name);
+        if (!de) {
+            if (errno == 0) errno = ENOENT;
+            return -1;
+        }
+        cur = de->inode_no;
+    }
+    *ino = cur;
+    return 0;
+}
+
+// Appends a run, merging it with the previous one when they are adjacent
+static int push_run(extent_t** runs, size_t* count, size_t* cap, uint32_t start, uint32_t len) {
+    if (*count > 0) {
+        extent_t* last = &(*runs)[*count - 1];
+        if ((uint64_t)last->start + last->len == start && (uint64_t)last->len + len <= UINT32_MAX) {
+            last->len += len;
+            return 0;
+        }
+    }
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 8;
+        extent_t* grown = realloc(*runs, new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        *runs = grown;
+        *cap = new_cap;
+    }
+    (*runs)[*count].start = start;
+    (*runs)[*count].len = len;
+    (*count)++;
+    return 0;
+}
+
+// Block map of a live file inode; checks every run lies in the data region
+static int inode_map(mvfs_t* fs, inode_t* node, extent_t** runs_out, size_t* count_out) {
+    extent_t* runs = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t blocks = inode_data_blocks(node);
+    if (blocks > 0 && !(node->mode & MODE_EXTENTS)) {
+        if (blocks > DIRECT_MAX) goto corrupt;
+        for (uint64_t b = 0; b < blocks; b++) {
+            if (push_run(&runs, &count, &cap, node->direct[b], 1) != 0) goto fail;
+        }
+    } else if (blocks > 0) {
+        uint32_t n = node->reserved_0;
+        extent_t* overflow = NULL;
+        if (n > EXTENTS_MAX || (n > EXTENTS_INLINE && node->reserved_1 == 0)) goto corrupt;
+        if (n > EXTENTS_INLINE) {
+            meta_block_t* mb = image_block(&fs->img, node->reserved_1);
+            if (!mb) goto fail;
+            overflow = (extent_t*)mb->data;
+        }
+        extent_t* inline_runs = inode_extents(node);
+        for (uint32_t r = 0; r < n; r++) {
+            extent_t e = r < EXTENTS_INLINE ? inline_runs[r] : overflow[r - EXTENTS_INLINE];
+            if (push_run(&runs, &count, &cap, e.start, e.len) != 0) goto fail;
+        }
+    }
+    // Never touch anything outside the data region, whatever the inode says
+    uint64_t mapped = 0;
+    for (size_t r = 0; r < count; r++) {
+        if (runs[r].start < fs->sb.data_region_start ||
+            (uint64_t)runs[r].start + runs[r].len > fs->sb.total_blocks) goto corrupt;
+        mapped += runs[r].len;
+    }
+    if (mapped < blocks) goto corrupt;
+    *runs_out = runs;
+    *count_out = count;
+    return 0;
+
+corrupt:
+    errno = EUCLEAN;
+fail:;
+    int err = errno;
+    free(runs);
+    errno = err;
+    return -1;
+}
+
+int mvfs_map(mvfs_t* fs, uint32_t ino, extent_t** runs, size_t* count) {
+    image_next_op(&fs->img);
+    inode_t* node = get_live_inode(fs, ino);
+    if (!node) return -1;
+    if ((node->mode & MODE_TYPE_MASK) != MODE_FILE) {
+        errno = EISDIR;
+        return -1;
+    }
+    return inode_map(fs, node, runs, count);
+}
+
+int mvfs_stat(mvfs_t* fs, uint32_t ino, mvfs_stat_t* st) {
+    inode_t* node = get_live_inode(fs, ino);
+    if (!node) return -1;
+    st->ino = ino;
+    st->mode = node->mode;
+    st->links = node->links;
+    st->size = node->size_bytes;
+    st->blocks = (node->mode & MODE_TYPE_MASK) == MODE_DIR ? 0 : inode_data_blocks(node);
+    st->atime = node->atime;
+    st->mtime = node->mtime;
+    st->ctime = node->ctime;
+    return 0;
+}
+
+typedef struct {
+    int (*fn)(const char* name, uint32_t ino, uint8_t type, void* arg);
+    void* arg;
+} iterate_ctx_t;
+
+static int iterate_entry(const dirent64_t* de, void* arg) {
+    iterate_ctx_t* ctx = arg;
+    return ctx->fn(de->name, de->inode_no, de->type, ctx->arg);
+}
+
+int mvfs_iterate(mvfs_t* fs, uint32_t dir, int (*fn)(const char* name, uint32_t ino, uint8_t type, void* arg),
+                 void* arg) {
+    image_next_op(&fs->img);
+    inode_t* node = get_dir(fs, dir);
+    if (!node) return -1;
+    inode_t copy = *node; // fn may call back into the handle
+    iterate_ctx_t ctx = { fn, arg };
+    // Keep the directory's blocks in the cache while fn runs other calls
+    fs->img.hold++;
+    int rc = dir_iterate(&fs->img, &copy, iterate_entry, &ctx);
+    fs->img.hold--;
+    return rc;
+}
+
+// Reads or writes the byte range [offset, offset + len) of a mapped file
+static int file_io(mvfs_t* fs, inode_t* node, void* buf, size_t len, uint64_t offset, int write) {
+    extent_t* runs;
+    size_t count;
+    if (inode_map(fs, node, &runs, &count) != 0) return -1;
+    uint8_t* p = buf;
+    uint64_t file_pos = 0;
+    int rc = 0;
+    for (size_t r = 0; rc == 0 && r < count && len > 0; r++) {
+        uint64_t run_bytes = (uint64_t)runs[r].len * BS;
+        if (offset >= file_pos + run_bytes) {
+            file_pos += run_bytes;
+            continue;
+        }
+        uint64_t skip = offset - file_pos;
+        uint64_t n = run_bytes - skip < len ? run_bytes - skip : len;
+        uint64_t image_off = (uint64_t)runs[r].start * BS + skip;
+        if (write) {
+            rc = write_full(fs->img.write_fd, p, (size_t)n, image_off);
+            image_forget(&fs->img, image_off / BS, (image_off % BS + n + BS - 1) / BS);
+        } else {
+            rc = read_full(mvfs_data_fd(fs), p, (size_t)n, image_off);
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+        file_pos += run_bytes;
+    }
+    int err = errno;
+    free(runs);
+    errno = err;
+    return rc;
+}
+
+// Reads [offset, offset + len) block by block through the cache. A read that
+// starts where the previous one on the same file ended is sequential: the
+// missing blocks ahead of it are then loaded with one large read, in a window
+// that doubles with every sequential read.
+static int cached_read(mvfs_t* fs, uint32_t ino, inode_t* node, uint8_t* buf, size_t len, uint64_t offset) {
+    if (ino == fs->ra_ino && offset == fs->ra_next && offset > 0) {
+        fs->ra_window = fs->ra_window ? fs->ra_window * 2 : READAHEAD_MIN;
+        if (fs->ra_window > READAHEAD_MAX) fs->ra_window = READAHEAD_MAX;
+    } else {
+        fs->ra_window = 0;
+    }
+    // A window larger than the cache would evict itself
+    uint64_t window = fs->ra_window < fs->img.budget / 4 ? fs->ra_window : fs->img.budget / 4;
+    fs->ra_ino = ino;
+    fs->ra_next = offset + len;
+
+    extent_t* runs;
+    size_t count;
+    if (inode_map(fs, node, &runs, &count) != 0) return -1;
+    uint64_t file_pos = 0;
+    int rc = 0;
+    for (size_t r = 0; rc == 0 && r < count && len > 0; r++) {
+        uint64_t run_bytes = (uint64_t)runs[r].len * BS;
+        while (rc == 0 && len > 0 && offset < file_pos + run_bytes) {
+            uint64_t index = (offset - file_pos) / BS;
+            uint64_t block = runs[r].start + index;
+            if (window > 0 && !image_cached(&fs->img, block)) {
+                uint64_t left = runs[r].len - index;
+                rc = image_readahead(&fs->img, block, left < window ? left : window);
+                if (rc != 0) break;
+            }
+            meta_block_t* mb = image_block(&fs->img, block);
+            if (!mb) {
+                rc = -1;
+                break;
+            }
+            size_t in_block = (size_t)(offset % BS);
+            size_t n = BS - in_block < len ? BS - in_block : len;
+            memcpy(buf, mb->data + in_block, n);
+            buf += n;
+            len -= n;
+            offset += n;
+        }
+        file_pos += run_bytes;
+    }
+    int err = errno;
+    free(runs);
+    errno = err;
+    return rc;
+}
+
+// Reads [offset, offset + len) of a compressed file by decoding its frames
+// in order, one at a time. The handle keeps the last decoded frame and the
+// position after it, so a reader moving forward through the file never
+// decodes a frame twice; frames before the wanted one are skipped by their
+// headers alone.
+static int compressed_read(mvfs_t* fs, uint32_t ino, inode_t* node, uint8_t* buf, size_t len, uint64_t offset) {
+    if (!fs->z_raw) {
+        fs->z_raw = malloc(ZFRAME_RAW);
+        fs->z_packed = malloc(ZFRAME_RAW);
+        if (!fs->z_raw || !fs->z_packed) return -1;
+    }
+    if (ino != fs->z_ino || offset < fs->z_offset) {
+        fs->z_ino = ino;
+        fs->z_offset = 0;
+        fs->z_next = 0;
+        fs->z_len = 0;
+    }
+    uint64_t stream_len = (uint64_t)node->reserved_2 * BS;
+    while (len > 0) {
+        if (offset < fs->z_offset + fs->z_len) {
+            size_t in_frame = (size_t)(offset - fs->z_offset);
+            size_t n = fs->z_len - in_frame < len ? fs->z_len - in_frame : len;
+            memcpy(buf, fs->z_raw + in_frame, n);
+            buf += n;
+            len -= n;
+            offset += n;
+            continue;
+        }
+        zframe_t frame;
+        fs->z_offset += fs->z_len;
+        fs->z_len = 0;
+        if (fs->z_next + sizeof(frame) > stream_len) goto corrupt;
+        if (file_io(fs, node, &frame, sizeof(frame), fs->z_next, 0) != 0) goto fail;
+        uint32_t packed = frame.packed_len & ~ZFRAME_STORED;
+        int stored = (frame.packed_len & ZFRAME_STORED) != 0;
+        if (frame.raw_len == 0 || frame.raw_len > ZFRAME_RAW || packed > ZFRAME_RAW ||
+            (stored && packed != frame.raw_len) || fs->z_next + sizeof(frame) + packed > stream_len) goto corrupt;
+        uint64_t data = fs->z_next + sizeof(frame);
+        fs->z_next = data + packed;
+        if (offset >= fs->z_offset + frame.raw_len) { // not needed: skip without decoding
+            fs->z_offset += frame.raw_len;
+            continue;
+        }
+        uint8_t* dst = stored ? fs->z_raw : fs->z_packed;
+        if (file_io(fs, node, dst, packed, data, 0) != 0) goto fail;
+        if (!stored && lz_decompress(fs->z_packed, packed, fs->z_raw, frame.raw_len) != 0) goto corrupt;
+        fs->z_len = frame.raw_len;
+    }
+    return 0;
+
+corrupt:
+    errno = EUCLEAN;
+fail:
+    fs->z_ino = 0; // start over on the next read
+    return -1;
+}
+
+ssize_t mvfs_read(mvfs_t* fs, uint32_t ino, void* buf, size_t len, uint64_t offset) {
+    image_next_op(&fs->img);
+    inode_t* node = get_live_inode(fs, ino);
+    if (!node) return -1;
+    if ((node->mode & MODE_TYPE_MASK) != MODE_FILE) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (offset >= node->size_bytes) return 0;
+    if (len > node->size_bytes - offset) len = (size_t)(node->size_bytes - offset);
+    if (node->mode & MODE_INLINE) {
+        memcpy(buf, inode_inline_data(node) + offset, len);
+        return (ssize_t)len;
+    }
+    int rc;
+    if (node->mode & MODE_COMPRESSED) {
+        rc = compressed_read(fs, ino, node, buf, len, offset);
+    } else if (fs->cache_data) {
+        rc = cached_read(fs, ino, node, buf, len, offset);
+    } else {
+        rc = file_io(fs, node, buf, len, offset, 0);
+    }
+    return rc == 0 ? (ssize_t)len : -1;
+}
+
+// =================================UPDATES=====================================
+
+// Copies name into a dirent-sized buffer, rejecting what cannot be stored
+static int entry_name(const char* name, char out[sizeof(((dirent64_t*)0)->name)]) {
+    size_t len = strlen(name);
+    if (len == 0 || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len >= sizeof(((dirent64_t*)0)->name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(out, name, len + 1);
+    return 0;
+}
+
+// Checks that name can be added to dir; entry receives it as it is stored
+static int check_new_entry(mvfs_t* fs, uint32_t dir, const char* name, char entry[sizeof(((dirent64_t*)0)->name)]) {
+    if (begin_write(fs) != 0 || entry_name(name, entry) != 0) return -1;
+    inode_t* parent = get_dir(fs, dir);
+    if (!parent) return -1;
+    if (dir_lookup(&fs->img, parent, entry)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return 0;
+}
+
+// Allocates want data blocks as few contiguous runs as possible (relative
+// bit numbers); on failure nothing stays allocated
+static int alloc_runs(mvfs_t* fs, uint64_t want, extent_t** runs_out, size_t* count_out) {
+    extent_t* runs = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t found = 0;
+    while (found < want) {
+        uint64_t start;
+        uint64_t len = bitmap_alloc_extent(&fs->data_bitmap.bm, want - found, &start);
+        if (len == 0 || push_run(&runs, &count, &cap, (uint32_t)start, (uint32_t)len) != 0) {
+            if (len == 0) errno = ENOSPC;
+            int err = errno;
+            if (len) bitmap_clear_range(&fs->data_bitmap.bm, start, len);
+            for (size_t r = 0; r < count; r++) bitmap_clear_range(&fs->data_bitmap.bm, runs[r].start, runs[r].len);
+            free(runs);
+            errno = err;
+            return -1;
+        }
+        found += len;
+    }
+    stats_add(STAT_BLOCKS_ALLOCATED, want);
+    *runs_out = runs;
+    *count_out = count;
+    return 0;
+}
+
+// Links a freshly initialised inode into dir
+static int link_new_inode(mvfs_t* fs, uint32_t dir_ino, const char* name, uint32_t ino, inode_t* node, uint8_t type) {
+    inode_t* dir = get_dir(fs, dir_ino);
+    if (!dir || dir_add(&fs->img, dir, name, ino, type) != 0) return -1;
+    put_inode(fs, ino, node);
+    // A directory starts at 2 links and gains one per entry, files and
+    // subdirectories alike (the PDF spec's rule for the root, applied to
+    // every directory); links is 16 bits, so it saturates on very large ones
+    if (dir->links < UINT16_MAX) dir->links += 1;
+    dir->mtime = node->ctime;
+    put_inode(fs, dir_ino, dir);
+    if (dir->mode & MODE_DIR_INDEX) fs->sb.flags |= FEATURE_DIR_INDEX;
+    fs->sb_dirty = 1;
+    return 0;
+}
+
+// Allocates an inode number and a blank table entry for it
+static inode_t* new_inode(mvfs_t* fs, uint16_t mode, uint32_t* ino) {
+    int64_t bit = bitmap_alloc(&fs->inode_bitmap.bm);
+    if (bit < 0) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    inode_t* node = get_inode(fs, (uint32_t)bit + 1);
+    if (!node) {
+        int err = errno;
+        bitmap_clear_range(&fs->inode_bitmap.bm, (uint64_t)bit, 1);
+        errno = err;
+        return NULL;
+    }
+    stats_add(STAT_INODES_ALLOCATED, 1);
+    time_t now = time(NULL);
+    memset(node, 0, sizeof(*node));
+    node->mode = mode;
+    node->links = 1;
+    node->atime = now;
+    node->mtime = now;
+    node->ctime = now;
+    *ino = (uint32_t)bit + 1;
+    return node;
+}
+
+// Gives back an inode from new_inode and any blocks taken for it
+static void undo_new_inode(mvfs_t* fs, uint32_t ino, inode_t* node, meta_block_t* meta,
+                           const extent_t* runs, size_t count) {
+    int err = errno;
+    if (meta) {
+        meta->dirty = 0;
+        bitmap_clear_range(&fs->data_bitmap.bm, meta->block_no - fs->sb.data_region_start, 1);
+    }
+    for (size_t r = 0; r < count; r++) bitmap_clear_range(&fs->data_bitmap.bm, runs[r].start, runs[r].len);
+    memset(node, 0, sizeof(*node));
+    bitmap_clear_range(&fs->inode_bitmap.bm, ino - 1, 1);
+    errno = err;
+}
+
+// Points a new file inode at its blocks, runs[] + base in file order: direct
+// pointers while they suffice, extents (and an overflow block) otherwise
+static int set_file_map(mvfs_t* fs, inode_t* node, uint64_t blocks, const extent_t* runs, size_t count,
+                        uint64_t base, meta_block_t** overflow_out) {
+    if (blocks <= DIRECT_MAX) {
+        uint32_t b = 0;
+        for (size_t r = 0; r < count; r++) {
+            for (uint32_t i = 0; i < runs[r].len; i++) node->direct[b++] = (uint32_t)(base + runs[r].start + i);
+        }
+        return 0;
+    }
+    if (count > EXTENTS_MAX) {
+        errno = EFBIG; // too fragmented
+        return -1;
+    }
+    meta_block_t* overflow = NULL;
+    if (count > EXTENTS_INLINE && !(overflow = image_alloc_block(&fs->img))) return -1;
+    node->mode |= MODE_EXTENTS;
+    node->reserved_0 = (uint32_t)count;
+    node->reserved_1 = overflow ? (uint32_t)overflow->block_no : 0;
+    extent_t* inline_runs = inode_extents(node);
+    extent_t* overflow_runs = overflow ? (extent_t*)overflow->data : NULL;
+    for (size_t r = 0; r < count; r++) {
+        extent_t* e = r < EXTENTS_INLINE ? &inline_runs[r] : &overflow_runs[r - EXTENTS_INLINE];
+        e->start = (uint32_t)(base + runs[r].start);
+        e->len = runs[r].len;
+    }
+    fs->sb.flags |= FEATURE_EXTENTS;
+    *overflow_out = overflow;
+    return 0;
+}
+
+int mvfs_mkdir(mvfs_t* fs, uint32_t dir, const char* name, uint32_t* ino_out) {
+    image_next_op(&fs->img);
+    char entry[sizeof(((dirent64_t*)0)->name)];
+    if (check_new_entry(fs, dir, name, entry) != 0) return -1;
+
+    uint32_t ino;
+    inode_t* node = new_inode(fs, MODE_DIR, &ino);
+    if (!node) return -1;
+    meta_block_t* mb = image_alloc_block(&fs->img);
+    if (!mb) {
+        undo_new_inode(fs, ino, node, NULL, NULL, 0);
+        return -1;
+    }
+    dirent64_t* entries = (dirent64_t*)mb->data;
+    entries[0].inode_no = ino;
+    entries[0].type = 2;
+    strcpy(entries[0].name, ".");
+    dirent_checksum_finalize(&entries[0]);
+    entries[1].inode_no = dir;
+    entries[1].type = 2;
+    strcpy(entries[1].name, "..");
+    dirent_checksum_finalize(&entries[1]);
+    node->links = 2;       // . and ..
+    node->size_bytes = 2 * sizeof(dirent64_t);
+    node->direct[0] = (uint32_t)mb->block_no;
+
+    if (link_new_inode(fs, dir, entry, ino, node, 2) != 0) {
+        undo_new_inode(fs, ino, node, mb, NULL, 0);
+        return -1;
+    }
+    if (ino_out) *ino_out = ino;
+    return 0;
+}
+
+int mvfs_create(mvfs_t* fs, uint32_t dir, const char* name, uint64_t size, int flags, uint32_t* ino_out) {
+    image_next_op(&fs->img);
+    char entry[sizeof(((dirent64_t*)0)->name)];
+    if (check_new_entry(fs, dir, name, entry) != 0) return -1;
+    uint64_t blocks = (size + BS - 1) / BS;
+    int inline_data = (flags & MVFS_INLINE) && size > 0 && size <= INLINE_MAX;
+    if (inline_data) blocks = 0;
+    if (blocks > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    uint32_t ino;
+    inode_t* node = new_inode(fs, MODE_FILE, &ino); // file mode (0100000)8
+    if (!node) return -1;
+    node->size_bytes = size;
+
+    // Find free data blocks and mark them as used, preferring one contiguous run
+    extent_t* runs = NULL;
+    size_t count = 0;
+    meta_block_t* overflow = NULL;
+    if (blocks > 0 && alloc_runs(fs, blocks, &runs, &count) != 0) goto fail;
+
+    if (inline_data) {
+        node->mode |= MODE_INLINE; // bytes arrive with mvfs_write
+        fs->sb.flags |= FEATURE_INLINE_DATA;
+    } else if (set_file_map(fs, node, blocks, runs, count, fs->sb.data_region_start, &overflow) != 0) {
+        goto fail;
+    }
+
+    if (link_new_inode(fs, dir, entry, ino, node, 1) != 0) goto fail;
+    free(runs);
+    if (ino_out) *ino_out = ino;
+    return 0;
+
+fail:
+    undo_new_inode(fs, ino, node, overflow, runs, count);
+    free(runs);
+    return -1;
+}
+
+// ==================================DEDUP======================================
+// A block's content key is the CRC-32 (IEEE, crc32.c) of its first half and
+// of the whole block. Equal keys are only a hint: contents are compared byte
+// for byte before a block is shared.
+
+static uint64_t block_key(const uint8_t* data) {
+    uint32_t half = crc32(data, BS / 2);
+    uint64_t key = (uint64_t)half << 32 | crc32_update(half, data + BS / 2, BS / 2);
+    return key ? key : 1;
+}
+
+static size_t index_slot(const dedup_index_t* idx, uint64_t key) {
+    size_t i = (size_t)(key ^ key >> 32) & (idx->cap - 1);
+    while (idx->keys[i] && idx->keys[i] != key) i = (i + 1) & (idx->cap - 1);
+    return i;
+}
+
+// Block stored under key, 0 if none
+static uint32_t index_get(const dedup_index_t* idx, uint64_t key) {
+    if (idx->cap == 0) return 0;
+    size_t i = index_slot(idx, key);
+    return idx->keys[i] ? idx->blocks[i] : 0;
+}
+
+// Stores block under key, replacing an earlier block with that key
+static int index_put(dedup_index_t* idx, uint64_t key, uint32_t block) {
+    if ((idx->count + 1) * 2 > idx->cap) {
+        dedup_index_t grown = { NULL, NULL, idx->cap ? idx->cap * 2 : 1024, 0 };
+        grown.keys = calloc(grown.cap, sizeof(*grown.keys));
+        grown.blocks = malloc(grown.cap * sizeof(*grown.blocks));
+        if (!grown.keys || !grown.blocks) {
+            free(grown.keys);
+            free(grown.blocks);
+            return -1;
+        }
+        for (size_t i = 0; i < idx->cap; i++) {
+            if (!idx->keys[i]) continue;
+            size_t j = index_slot(&grown, idx->keys[i]);
+            grown.keys[j] = idx->keys[i];
+            grown.blocks[j] = idx->blocks[i];
+        }
+        grown.count = idx->count;
+        free(idx->keys);
+        free(idx->blocks);
+        *idx = grown;
+    }
+    size_t i = index_slot(idx, key);
+    if (!idx->keys[i]) idx->count++;
+    idx->keys[i] = key;
+    idx->blocks[i] = block;
+    return 0;
+}
+
+static uint16_t* refcount(mvfs_t* fs, uint64_t block_no) {
+    uint64_t bit = block_no - fs->sb.data_region_start;
+    fs->refcount_dirty[bit / REFCOUNTS_PER_BLOCK] = 1;
+    return &fs->refcounts[bit];
+}
+
+// 1 if any of the file's blocks is shared, 0 if none, -1 on error
+static int shares_blocks(mvfs_t* fs, inode_t* node) {
+    extent_t* runs;
+    size_t count;
+    if (inode_map(fs, node, &runs, &count) != 0) return -1;
+    int shared = 0;
+    for (size_t r = 0; !shared && r < count; r++) {
+        for (uint32_t i = 0; !shared && i < runs[r].len; i++) {
+            shared = fs->refcounts[runs[r].start + i - fs->sb.data_region_start] != 0;
+        }
+    }
+    free(runs);
+    return shared;
+}
+
+// One contiguous run of blocks for a table, as an absolute block number
+static int alloc_table(mvfs_t* fs, uint64_t blocks, uint64_t* start) {
+    extent_t* runs;
+    size_t count;
+    if (alloc_runs(fs, blocks, &runs, &count) != 0) return -1;
+    if (count > 1) {
+        for (size_t r = 0; r < count; r++) bitmap_clear_range(&fs->data_bitmap.bm, runs[r].start, runs[r].len);
+        free(runs);
+        errno = ENOSPC; // no run long enough
+        return -1;
+    }
+    *start = fs->sb.data_region_start + runs[0].start;
+    free(runs);
+    return 0;
+}
+
+// Allocates the refcount table the first time the image is deduplicated:
+// one contiguous run, all zeros since no block is shared yet
+static int dedup_enable(mvfs_t* fs) {
+    if (fs->refcounts) return 0;
+    uint64_t blocks = (fs->sb.data_region_blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+    uint64_t start;
+    if (alloc_table(fs, blocks, &start) != 0) return -1;
+    fs->refcounts = calloc(blocks, BS);
+    fs->refcount_dirty = malloc(blocks);
+    if (!fs->refcounts || !fs->refcount_dirty) {
+        bitmap_clear_range(&fs->data_bitmap.bm, start - fs->sb.data_region_start, blocks);
+        free(fs->refcounts);
+        free(fs->refcount_dirty);
+        fs->refcounts = NULL;
+        fs->refcount_dirty = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(fs->refcount_dirty, 1, blocks);
+    fs->ext.refcount_start = start;
+    fs->ext.refcount_blocks = blocks;
+    fs->sb.flags |= FEATURE_DEDUP;
+    fs->sb_dirty = 1;
+    return 0;
+}
+
+// Hashes every block of every file in the image into the content index
+static int dedup_build_index(mvfs_t* fs) {
+    if (fs->index_built) return 0;
+    uint8_t* buffer = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    if (!buffer) return -1;
+    int rc = 0;
+    for (uint32_t ino = 1; rc == 0 && ino <= fs->sb.inode_count; ino++) {
+        if (!bitmap_test(&fs->inode_bitmap.bm, ino - 1)) continue;
+        inode_t* node = get_live_inode(fs, ino);
+        extent_t* runs = NULL;
+        size_t count = 0;
+        if (!node || ((node->mode & MODE_TYPE_MASK) == MODE_FILE && inode_map(fs, node, &runs, &count) != 0)) {
+            rc = -1;
+            break;
+        }
+        uint64_t left = (node->mode & MODE_TYPE_MASK) == MODE_FILE ? (node->size_bytes + BS - 1) / BS : 0;
+        for (size_t r = 0; rc == 0 && r < count && left > 0; r++) {
+            for (uint64_t done = 0; rc == 0 && done < runs[r].len && left > 0; ) {
+                uint64_t n = runs[r].len - done;
+                if (n > COPY_CHUNK_BLOCKS) n = COPY_CHUNK_BLOCKS;
+                if (n > left) n = left;
+                uint64_t block_no = runs[r].start + done;
+                rc = read_full(mvfs_data_fd(fs), buffer, n * BS, block_no * BS);
+                for (uint64_t i = 0; rc == 0 && i < n; i++) {
+                    uint64_t key = block_key(buffer + i * BS);
+                    if (!index_get(&fs->index, key)) rc = index_put(&fs->index, key, (uint32_t)(block_no + i));
+                }
+                fs->dedup.indexed_blocks += n;
+                done += n;
+                left -= n;
+            }
+        }
+        free(runs);
+    }
+    free(buffer);
+    if (rc == 0) fs->index_built = 1;
+    return rc;
+}
+
+// Reads block b of a host file of size bytes, zero-padded to a whole block
+static int read_host_block(int fd, uint64_t size, uint64_t b, uint8_t* out) {
+    uint64_t offset = b * BS;
+    size_t n = size - offset < BS ? (size_t)(size - offset) : BS;
+    memset(out + n, 0, BS - n);
+    return read_full(fd, out, n, offset);
+}
+
+// Where block b of the file being added comes from
+#define SOURCE_NEW -1          // its own new block
+// >= 0: an existing absolute block; <= -2: same contents as file block -2 - source
+
+// Sharing scattered blocks fragments a file, and an inode maps at most
+// EXTENTS_MAX runs. Pass 1 stops sharing where the runs it would add leave
+// less than RUN_RESERVE for the new blocks, which free-space fragmentation
+// may split; should allocation need more anyway, the add is planned again
+// without sharing.
+#define RUN_RESERVE 32
+#define VIRTUAL_NEW (1ull << 32) // pass 1 places new blocks contiguously from here
+
+typedef struct {
+    int64_t* source;           // per file block, see SOURCE_NEW
+    uint16_t* repeats;         // per new block, later file blocks sharing it
+    uint64_t decided;          // blocks with a source (holding a reference)
+    uint64_t fresh;            // blocks to allocate
+} dedup_plan_t;
+
+// Pass 1: decides each block's source by hashing the host file, taking a
+// reference on every existing block it will share
+static int plan_blocks(mvfs_t* fs, int fd, uint64_t size, int share, dedup_plan_t* plan, uint8_t* buffer) {
+    uint64_t blocks = (size + BS - 1) / BS;
+    size_t chunk = (size_t)COPY_CHUNK_BLOCKS * BS;
+    dedup_index_t seen = {0}; // this file's new blocks by key, as file block + 1
+    uint64_t* where = malloc(blocks * sizeof(*where)); // estimated block, see VIRTUAL_NEW
+    uint64_t run_count = 0;
+    uint64_t run_budget = blocks > DIRECT_MAX ? EXTENTS_MAX - RUN_RESERVE : UINT64_MAX;
+    uint8_t other[BS];
+    int rc = where ? 0 : -1;
+    for (uint64_t b = 0; rc == 0 && b < blocks; b++) {
+        int64_t source = SOURCE_NEW;
+        uint64_t found = 0;
+        uint32_t first = 0;
+        if (share) {
+            uint64_t in_chunk = b % COPY_CHUNK_BLOCKS;
+            if (in_chunk == 0) {
+                uint64_t left = size - b * BS;
+                memset(buffer, 0, chunk);
+                if ((rc = read_full(fd, buffer, left < chunk ? (size_t)left : chunk, b * BS)) != 0) break;
+            }
+            const uint8_t* data = buffer + in_chunk * BS;
+            uint64_t key = block_key(data);
+            uint32_t existing = index_get(&fs->index, key);
+            if (existing && fs->refcounts[existing - fs->sb.data_region_start] < REFCOUNT_MAX) {
+                if ((rc = read_full(mvfs_data_fd(fs), other, BS, (uint64_t)existing * BS)) != 0) break;
+                if (memcmp(data, other, BS) == 0) {
+                    source = existing;
+                    found = existing;
+                }
+            }
+            first = source == SOURCE_NEW ? index_get(&seen, key) : 0;
+            if (first && plan->repeats[first - 1] < REFCOUNT_MAX) {
+                if ((rc = read_host_block(fd, size, first - 1, other)) != 0) break;
+                if (memcmp(data, other, BS) == 0) {
+                    source = -2 - (int64_t)(first - 1);
+                    found = where[first - 1];
+                }
+            }
+            // A shared block that does not continue the previous block's run
+            // starts a run, and the blocks after it likely another
+            if (source != SOURCE_NEW && b > 0 && found != where[b - 1] + 1 && run_count + 2 > run_budget) {
+                source = SOURCE_NEW;
+            }
+            if (source == SOURCE_NEW) rc = index_put(&seen, key, (uint32_t)(b + 1));
+        }
+        plan->source[b] = source;
+        plan->decided = b + 1;
+        if (source == SOURCE_NEW) {
+            where[b] = VIRTUAL_NEW + plan->fresh++;
+        } else if (source >= 0) {
+            where[b] = found;
+            (*refcount(fs, found))++;
+        } else {
+            where[b] = found;
+            plan->repeats[first - 1]++;
+        }
+        if (b == 0 || where[b] != where[b - 1] + 1) run_count++;
+    }
+    free(where);
+    free(seen.keys);
+    free(seen.blocks);
+    return rc;
+}
+
+// Drops the references plan_blocks took
+static void unplan_blocks(mvfs_t* fs, dedup_plan_t* plan) {
+    for (uint64_t b = 0; b < plan->decided; b++) {
+        if (plan->source[b] >= 0) (*refcount(fs, (uint64_t)plan->source[b]))--;
+    }
+    memset(plan->repeats, 0, plan->decided * sizeof(*plan->repeats));
+    plan->decided = 0;
+    plan->fresh = 0;
+}
+
+// Gives back the new blocks of a plan
+static void free_new_blocks(mvfs_t* fs, const extent_t* runs, size_t count, int clear_bitmap) {
+    for (size_t r = 0; r < count; r++) {
+        for (uint32_t i = 0; i < runs[r].len; i++) {
+            *refcount(fs, fs->sb.data_region_start + runs[r].start + i) = 0;
+        }
+        if (clear_bitmap) bitmap_clear_range(&fs->data_bitmap.bm, runs[r].start, runs[r].len);
+    }
+}
+
+// mvfs_add with MVFS_DEDUP. Pass 1 hashes the host file and decides every
+// block's source, pass 2 allocates the new blocks and links the inode, and
+// only pass 3 writes data: the new blocks, read from the host file again.
+// Until the inode is linked every failure is undone.
+static int add_dedup(mvfs_t* fs, uint32_t dir, const char* name, int fd, uint64_t size, uint32_t* ino_out) {
+    image_next_op(&fs->img);
+    char entry[sizeof(((dirent64_t*)0)->name)];
+    if (check_new_entry(fs, dir, name, entry) != 0) return -1;
+    uint64_t blocks = (size + BS - 1) / BS;
+    if (blocks > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (dedup_enable(fs) != 0 || dedup_build_index(fs) != 0) return -1;
+
+    size_t chunk = (size_t)COPY_CHUNK_BLOCKS * BS;
+    dedup_plan_t plan = { malloc(blocks * sizeof(int64_t)), calloc(blocks, sizeof(uint16_t)), 0, 0 };
+    uint32_t* map = malloc(blocks * sizeof(*map));
+    uint8_t* buffer = malloc(chunk);
+    extent_t* runs = NULL;    // allocated blocks, relative
+    extent_t* file_runs = NULL;
+    size_t count = 0, file_count = 0, file_cap = 0;
+    uint32_t ino = 0;
+    inode_t* node = NULL;
+    meta_block_t* overflow = NULL;
+    int rc = plan.source && plan.repeats && map && buffer ? 0 : -1;
+
+    for (int share = 1; rc == 0; share--) {
+        rc = plan_blocks(fs, fd, size, share, &plan, buffer);
+        // Pass 2: allocate and map
+        if (rc == 0 && plan.fresh > 0) rc = alloc_runs(fs, plan.fresh, &runs, &count);
+        size_t r = 0;
+        uint32_t i = 0;
+        for (uint64_t b = 0; rc == 0 && b < blocks; b++) {
+            if (plan.source[b] == SOURCE_NEW) {
+                map[b] = (uint32_t)(fs->sb.data_region_start + runs[r].start + i);
+                *refcount(fs, map[b]) = plan.repeats[b];
+                if (++i == runs[r].len) {
+                    r++;
+                    i = 0;
+                }
+            } else {
+                map[b] = plan.source[b] >= 0 ? (uint32_t)plan.source[b] : map[-2 - plan.source[b]];
+            }
+            rc = push_run(&file_runs, &file_count, &file_cap, map[b], 1);
+        }
+        if (rc != 0 || blocks <= DIRECT_MAX || file_count <= EXTENTS_MAX || !share) break;
+        free_new_blocks(fs, runs, count, 1);
+        unplan_blocks(fs, &plan);
+        free(runs);
+        runs = NULL;
+        count = file_count = 0;
+    }
+    if (rc == 0 && !(node = new_inode(fs, MODE_FILE, &ino))) rc = -1;
+    if (rc == 0) {
+        node->size_bytes = size;
+        rc = set_file_map(fs, node, blocks, file_runs, file_count, 0, &overflow);
+        if (rc == 0) rc = link_new_inode(fs, dir, entry, ino, node, 1);
+    }
+    if (rc != 0) {
+        int err = errno;
+        free_new_blocks(fs, runs, count, !node);
+        if (node) undo_new_inode(fs, ino, node, overflow, runs, count);
+        if (plan.source) unplan_blocks(fs, &plan);
+        errno = err;
+        goto out;
+    }
+
+    // Pass 3: write the new blocks in runs that are adjacent both in the
+    // file and in the image, and make them findable for later adds
+    for (uint64_t base = 0; rc == 0 && base < blocks; base += COPY_CHUNK_BLOCKS) {
+        uint64_t n = blocks - base < COPY_CHUNK_BLOCKS ? blocks - base : COPY_CHUNK_BLOCKS;
+        uint64_t b = base;
+        while (b < base + n && plan.source[b] != SOURCE_NEW) b++;
+        if (b == base + n) continue;
+        uint64_t left = size - base * BS;
+        memset(buffer, 0, chunk);
+        if ((rc = read_full(fd, buffer, left < chunk ? (size_t)left : chunk, base * BS)) != 0) break;
+        while (rc == 0 && b < base + n) {
+            if (plan.source[b] != SOURCE_NEW) {
+                b++;
+                continue;
+            }
+            uint64_t end = b + 1;
+            while (end < base + n && plan.source[end] == SOURCE_NEW && map[end] == map[end - 1] + 1) end++;
+            rc = write_full(fs->img.write_fd, buffer + (b - base) * BS, (end - b) * BS, (uint64_t)map[b] * BS);
+            image_forget(&fs->img, map[b], end - b);
+            for (; rc == 0 && b < end; b++) rc = index_put(&fs->index, block_key(buffer + (b - base) * BS), map[b]);
+        }
+    }
+    fs->dedup.written_blocks += plan.fresh;
+    fs->dedup.shared_blocks += blocks - plan.fresh;
+    if (rc == 0 && ino_out) *ino_out = ino;
+
+out:;
+    int err = errno;
+    free(plan.source);
+    free(plan.repeats);
+    free(map);
+    free(buffer);
+    free(runs);
+    free(file_runs);
+    errno = err;
+    return rc;
+}
+
+void mvfs_dedup_stats(const mvfs_t* fs, mvfs_dedup_stats_t* st) {
+    *st = fs->dedup;
+}
+
+// ===============================BLOCK STREAMS=================================
+// A writer_t collects a byte stream (compressed frames, or a file of unknown
+// length) into large writes to data blocks. Blocks are allocated up front or
+// taken from the bitmap as the stream grows; the caller trims what is left
+// over once the stream ends.
+
+// Writes len bytes at offset into the byte stream held by runs (relative)
+static int stream_write(mvfs_t* fs, const extent_t* runs, size_t count, uint64_t offset, const void* buf, size_t len) {
+    const uint8_t* p = buf;
+    uint64_t run_pos = 0;
+    for (size_t r = 0; r < count && len > 0; r++) {
+        uint64_t run_bytes = (uint64_t)runs[r].len * BS;
+        if (offset >= run_pos + run_bytes) {
+            run_pos += run_bytes;
+            continue;
+        }
+        uint64_t skip = offset - run_pos;
+        size_t n = run_bytes - skip < len ? (size_t)(run_bytes - skip) : len;
+        uint64_t block_no = fs->sb.data_region_start + runs[r].start;
+        if (write_full(fs->img.write_fd, p, n, block_no * BS + skip) != 0) return -1;
+        image_forget(&fs->img, block_no + skip / BS, (skip % BS + n + BS - 1) / BS);
+        p += n;
+        len -= n;
+        offset += n;
+        run_pos += run_bytes;
+    }
+    return 0;
+}
+
+typedef struct {
+    mvfs_t* fs;
+    extent_t* runs;            // blocks of the stream, relative
+    size_t count;
+    size_t cap;
+    uint64_t blocks;           // blocks in runs
+    uint8_t* buf;              // COPY_CHUNK_BLOCKS blocks
+    size_t used;
+    uint64_t written;          // stream bytes before buf
+    uint64_t limit;            // unless 0, the most blocks the stream may take
+    int full;                  // a write stopped at limit (EFBIG)
+} writer_t;
+
+// Takes at least min more blocks. As many as the stream already holds are
+// asked for, so a long stream lands in few, long runs, but never more than
+// the limit allows.
+static int writer_grow(writer_t* w, uint64_t min) {
+    if (w->limit && min > w->limit - w->blocks) {
+        w->full = 1;
+        errno = EFBIG;
+        return -1;
+    }
+    uint64_t want = w->blocks > min ? w->blocks : min;
+    if (w->limit && want > w->limit - w->blocks) want = w->limit - w->blocks;
+    uint64_t found = 0;
+    while (found < min) {
+        uint64_t start;
+        uint64_t len = bitmap_alloc_extent(&w->fs->data_bitmap.bm, want - found, &start);
+        if (len == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        if (push_run(&w->runs, &w->count, &w->cap, (uint32_t)start, (uint32_t)len) != 0) {
+            bitmap_clear_range(&w->fs->data_bitmap.bm, start, len);
+            return -1;
+        }
+        stats_add(STAT_BLOCKS_ALLOCATED, len);
+        found += len;
+        w->blocks += len;
+    }
+    if (w->count > EXTENTS_MAX) {
+        errno = EFBIG; // too fragmented
+        return -1;
+    }
+    return 0;
+}
+
+// Writes out the buffered bytes, zero-padding the last block
+static int writer_flush(writer_t* w) {
+    size_t padded = (w->used + BS - 1) / BS * BS;
+    memset(w->buf + w->used, 0, padded - w->used);
+    uint64_t need = (w->written + padded) / BS;
+    if (need > w->blocks && writer_grow(w, need - w->blocks) != 0) return -1;
+    if (stream_write(w->fs, w->runs, w->count, w->written, w->buf, padded) != 0) return -1;
+    w->written += w->used;
+    w->used = 0;
+    return 0;
+}
+
+static int writer_put(writer_t* w, const void* data, size_t len) {
+    const uint8_t* p = data;
+    size_t cap = (size_t)COPY_CHUNK_BLOCKS * BS;
+    while (len > 0) {
+        size_t n = cap - w->used < len ? cap - w->used : len;
+        memcpy(w->buf + w->used, p, n);
+        w->used += n;
+        p += n;
+        len -= n;
+        if (w->used == cap && writer_flush(w) != 0) return -1;
+    }
+    return 0;
+}
+
+// Keeps the first keep blocks of runs and frees the rest
+static void trim_runs(mvfs_t* fs, extent_t* runs, size_t* count, uint64_t keep) {
+    size_t kept = 0;
+    for (size_t r = 0; r < *count; r++) {
+        uint32_t len = keep < runs[r].len ? (uint32_t)keep : runs[r].len;
+        if (len < runs[r].len) bitmap_clear_range(&fs->data_bitmap.bm, runs[r].start + len, runs[r].len - len);
+        runs[r].len = len;
+        keep -= len;
+        if (len > 0) kept = r + 1;
+    }
+    *count = kept;
+}
+
+// Reads until len bytes have arrived or the input ends; the count or -1
+static ssize_t read_stream(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (uint8_t*)buf + done, len - done);
+        stats_add(STAT_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        stats_add(STAT_BYTES_READ, (uint64_t)n);
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+// ===============================COMPRESSION===================================
+
+// Appends one frame of n raw bytes, LZ-compressed or stored when compressing
+// does not save a byte; packed has room for a frame header and ZFRAME_RAW
+static int writer_put_frame(writer_t* w, const uint8_t* raw, size_t n, uint8_t* packed) {
+    zframe_t frame = { (uint32_t)n, 0 };
+    size_t z = lz_compress(raw, n, packed + sizeof(frame), n - 1);
+    if (z > 0) {
+        frame.packed_len = (uint32_t)z;
+        memcpy(packed, &frame, sizeof(frame));
+        return writer_put(w, packed, sizeof(frame) + z);
+    }
+    frame.packed_len = (uint32_t)n | ZFRAME_STORED;
+    if (writer_put(w, &frame, sizeof(frame)) != 0) return -1;
+    return writer_put(w, raw, n);
+}
+
+// mvfs_add with MVFS_COMPRESS. The host file is compressed frame by frame
+// into blocks taken as the stream grows, as for mvfs_add_fd, up to one block
+// fewer than the raw file needs. A stream that reaches that limit would not
+// save a block: the file is then stored raw in the same blocks plus the ones
+// still missing, so it never needs more free space than a raw add.
+static int add_compressed(mvfs_t* fs, uint32_t dir, const char* name, int fd, uint64_t size, uint32_t* ino_out) {
+    image_next_op(&fs->img);
+    char entry[sizeof(((dirent64_t*)0)->name)];
+    if (check_new_entry(fs, dir, name, entry) != 0) return -1;
+    uint64_t raw_blocks = (size + BS - 1) / BS;
+    if (raw_blocks > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    uint32_t ino;
+    inode_t* node = new_inode(fs, MODE_FILE, &ino);
+    if (!node) return -1;
+
+    size_t chunk = (size_t)COPY_CHUNK_BLOCKS * BS;
+    meta_block_t* overflow = NULL;
+    writer_t w = { fs, NULL, 0, 0, 0, malloc(chunk), 0, 0, 0, 0 };
+    uint8_t* raw = malloc(ZFRAME_RAW);
+    uint8_t* packed = malloc(sizeof(zframe_t) + ZFRAME_RAW);
+    int rc = w.buf && raw && packed ? 0 : -1;
+    int compressed = raw_blocks > 1; // a single block cannot shrink
+    w.limit = raw_blocks - 1;
+    for (uint64_t done = 0; rc == 0 && compressed && done < size; ) {
+        size_t n = size - done < ZFRAME_RAW ? (size_t)(size - done) : ZFRAME_RAW;
+        if ((rc = read_full(fd, raw, n, done)) != 0) break; // short read: the file shrank while being added
+        rc = writer_put_frame(&w, raw, n, packed);
+        done += n;
+    }
+    if (rc == 0 && compressed) rc = writer_flush(&w);
+    if (w.full) { // the stream would not save a block
+        rc = 0;
+        compressed = 0;
+    }
+    uint64_t used = compressed ? (w.written + BS - 1) / BS : raw_blocks;
+    if (rc == 0 && w.blocks < used) {
+        w.limit = used;
+        rc = writer_grow(&w, used - w.blocks);
+    }
+    for (uint64_t done = 0; rc == 0 && !compressed && done < size; done += chunk) {
+        size_t n = size - done < chunk ? (size_t)(size - done) : chunk;
+        memset(w.buf, 0, chunk);
+        rc = read_full(fd, w.buf, n, done);
+        if (rc == 0) rc = stream_write(fs, w.runs, w.count, done, w.buf, (n + BS - 1) / BS * BS);
+    }
+
+    if (rc == 0) {
+        trim_runs(fs, w.runs, &w.count, used);
+        node->size_bytes = size;
+        if (compressed) {
+            node->mode |= MODE_COMPRESSED;
+            node->reserved_2 = (uint32_t)used;
+            fs->sb.flags |= FEATURE_COMPRESSED;
+        }
+        rc = set_file_map(fs, node, used, w.runs, w.count, fs->sb.data_region_start, &overflow);
+        if (rc == 0) rc = link_new_inode(fs, dir, entry, ino, node, 1);
+    }
+    if (rc != 0) {
+        undo_new_inode(fs, ino, node, overflow, w.runs, w.count);
+    } else if (ino_out) {
+        *ino_out = ino;
+    }
+    int err = errno;
+    free(w.buf);
+    free(raw);
+    free(packed);
+    free(w.runs);
+    errno = err;
+    return rc;
+}
+
+int mvfs_write(mvfs_t* fs, uint32_t ino, const void* buf, size_t len, uint64_t offset) {
+    image_next_op(&fs->img);
+    if (begin_write(fs) != 0) return -1;
+    inode_t* node = get_live_inode(fs, ino);
+    if (!node) return -1;
+    if ((node->mode & MODE_TYPE_MASK) != MODE_FILE) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (offset > node->size_bytes || len > node->size_bytes - offset) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (node->mode & MODE_COMPRESSED) {
+        errno = EINVAL; // written whole by mvfs_add
+        return -1;
+    }
+    int shared = fs->refcounts ? shares_blocks(fs, node) : 0;
+    if (shared != 0) {
+        if (shared > 0) errno = EBUSY; // the write would show through in other files
+        return -1;
+    }
+    if (node->mode & MODE_INLINE) {
+        memcpy(inode_inline_data(node) + offset, buf, len);
+        put_inode(fs, ino, node); // the inode CRC covers the inline bytes too
+        return 0;
+    }
+    if (offset + len < node->size_bytes || node->size_bytes % BS == 0) {
+        return file_io(fs, node, (void*)buf, len, offset, 1);
+    }
+
+    // The write reaches the end of the file: the last block is written whole,
+    // zero-padded past the end (and keeping earlier bytes of that block this
+    // write does not cover)
+    uint64_t last_block = (node->size_bytes - 1) / BS * BS;
+    size_t head = offset < last_block ? (size_t)(last_block - offset) : 0;
+    if (head > 0 && file_io(fs, node, (void*)buf, head, offset, 1) != 0) return -1;
+    uint8_t block[BS] = {0};
+    uint64_t start = offset + head;
+    if (start > last_block && file_io(fs, node, block, (size_t)(start - last_block), last_block, 0) != 0) return -1;
+    memcpy(block + (start - last_block), (const uint8_t*)buf + head, len - head);
+    return file_io(fs, node, block, BS, last_block, 1);
+}
+
+// mvfs_fill for files mvfs_write has to handle: inline, compressed or
+// sharing blocks (which it then refuses)
+static int fill_by_write(mvfs_t* fs, uint32_t ino, int fd, uint64_t size) {
+    // Copy in large sequential chunks
+    size_t chunk = (size_t)COPY_CHUNK_BLOCKS * BS;
+    uint8_t* buffer = malloc(size < chunk ? (size ? size : 1) : chunk);
+    int rc = buffer ? 0 : -1;
+    for (uint64_t done = 0; rc == 0 && done < size; ) {
+        size_t want = size - done < chunk ? (size_t)(size - done) : chunk;
+        if (read_full(fd, buffer, want, done) != 0) { // short read: the file shrank while being added
+            rc = -1;
+            break;
+        }
+        rc = mvfs_write(fs, ino, buffer, want, done);
+        done += want;
+    }
+    int err = errno;
+    free(buffer);
+    errno = err;
+    return rc;
+}
+
+static io_engine_t* get_io(mvfs_t* fs) {
+    if (!fs->io) fs->io = io_engine_open(fs->io_kind);
+    return fs->io;
+}
+
+int mvfs_set_io(mvfs_t* fs, int backend) {
+    io_engine_t* io = io_engine_open((io_kind_t)backend);
+    if (!io) return -1;
+    io_engine_close(fs->io);
+    fs->io = io;
+    fs->io_kind = (io_kind_t)backend;
+    return 0;
+}
+
+const char* mvfs_io_name(mvfs_t* fs) {
+    io_engine_t* io = get_io(fs);
+    return io_kind_name(io ? io_engine_kind(io) : fs->io_kind);
+}
+
+// A mapped file is copied in by the I/O backend: one copy per run, the last
+// block zero-padded
+int mvfs_fill(mvfs_t* fs, uint32_t ino, const char* host_path) {
+    image_next_op(&fs->img);
+    if (begin_write(fs) != 0) return -1;
+    inode_t* node = get_live_inode(fs, ino);
+    if (!node) return -1;
+    uint64_t size = node->size_bytes;
+    int fd = open(host_path, O_RDONLY);
+    if (fd < 0) return -1;
+    if ((node->mode & MODE_TYPE_MASK) != MODE_FILE || (node->mode & (MODE_INLINE | MODE_COMPRESSED)) ||
+        (fs->refcounts && shares_blocks(fs, node) != 0)) {
+        int rc = fill_by_write(fs, ino, fd, size);
+        int err = errno;
+        close(fd);
+        errno = err;
+        return rc;
+    }
+
+    extent_t* runs = NULL;
+    size_t count = 0;
+    io_copy_t* copies = NULL;
+    io_engine_t* io = get_io(fs);
+    int rc = io && inode_map(fs, node, &runs, &count) == 0 ? 0 : -1;
+    if (rc == 0 && count > 0 && !(copies = malloc(count * sizeof(*copies)))) rc = -1;
+    uint64_t file_pos = 0;
+    for (size_t r = 0; rc == 0 && r < count; r++) {
+        uint64_t run_bytes = (uint64_t)runs[r].len * BS;
+        copies[r].src_offset = file_pos;
+        copies[r].dst_offset = (uint64_t)runs[r].start * BS;
+        copies[r].len = size - file_pos < run_bytes ? size - file_pos : run_bytes;
+        copies[r].padded = run_bytes;
+        file_pos += run_bytes;
+    }
+    // A short read (EIO) means the file shrank while being added
+    if (rc == 0) rc = io_copy(io, fd, fs->img.write_fd, copies, count);
+    for (size_t r = 0; r < count; r++) image_forget(&fs->img, runs[r].start, runs[r].len);
+    int err = errno;
+    free(copies);
+    free(runs);
+    close(fd);
+    errno = err;
+    return rc;
+}
+
+// The input is read in chunks of COPY_CHUNK_BLOCKS blocks (ZFRAME_RAW bytes
+// with MVFS_COMPRESS), each written to blocks taken as it arrives. The size,
+// block map and inode CRC are only set once the input ends, so a failure,
+// including a full image, just gives the inode and every block back.
+int mvfs_add_fd(mvfs_t* fs, uint32_t dir, const char* name, int fd, int flags, uint32_t* ino_out) {
+    if (flags & MVFS_DEDUP) {
+        errno = EINVAL; // deduplication reads its input more than once
+        return -1;
+    }
+    image_next_op(&fs->img);
+    char entry[sizeof(((dirent64_t*)0)->name)];
+    if (check_new_entry(fs, dir, name, entry) != 0) return -1;
+    uint32_t ino;
+    inode_t* node = new_inode(fs, MODE_FILE, &ino);
+    if (!node) return -1;
+
+    int compress = flags & MVFS_COMPRESS;
+    size_t cap = (size_t)COPY_CHUNK_BLOCKS * BS;
+    size_t chunk = compress ? ZFRAME_RAW : cap;
+    meta_block_t* overflow = NULL;
+    writer_t w = { fs, NULL, 0, 0, 0, malloc(cap), 0, 0, 0, 0 };
+    uint8_t* raw = compress ? malloc(ZFRAME_RAW) : w.buf; // raw chunks are read in place
+    uint8_t* packed = compress ? malloc(sizeof(zframe_t) + ZFRAME_RAW) : NULL;
+    int rc = w.buf && raw && (packed || !compress) ? 0 : -1;
+    uint64_t size = 0;
+    int inline_data = 0;
+    while (rc == 0) {
+        ssize_t n = read_stream(fd, raw, chunk);
+        if (n <= 0) {
+            rc = (int)n;
+            break;
+        }
+        if (size == 0 && (size_t)n < chunk && (size_t)n <= INLINE_MAX && (flags & MVFS_INLINE)) {
+            inline_data = 1;
+            size = (uint64_t)n;
+            break;
+        }
+        size += (uint64_t)n;
+        if (compress) {
+            rc = writer_put_frame(&w, raw, (size_t)n, packed);
+        } else {
+            w.used = (size_t)n;
+            if ((size_t)n == cap) rc = writer_flush(&w);
+        }
+        if ((size_t)n < chunk) break; // end of input
+    }
+
+    node->size_bytes = size;
+    if (rc == 0 && inline_data) {
+        node->mode |= MODE_INLINE;
+        memcpy(inode_inline_data(node), raw, (size_t)size);
+        fs->sb.flags |= FEATURE_INLINE_DATA;
+    } else if (rc == 0) {
+        rc = writer_flush(&w);
+        uint64_t used = (w.written + BS - 1) / BS;
+        if (rc == 0) {
+            trim_runs(fs, w.runs, &w.count, used);
+            if (compress && size > 0) {
+                node->mode |= MODE_COMPRESSED;
+                node->reserved_2 = (uint32_t)used;
+                fs->sb.flags |= FEATURE_COMPRESSED;
+            }
+            rc = set_file_map(fs, node, used, w.runs, w.count, fs->sb.data_region_start, &overflow);
+        }
+    }
+    if (rc == 0) rc = link_new_inode(fs, dir, entry, ino, node, 1);
+    if (rc != 0) {
+        undo_new_inode(fs, ino, node, overflow, w.runs, w.count);
+    } else if (ino_out) {
+        *ino_out = ino;
+    }
+    int err = errno;
+    if (compress) free(raw);
+    free(w.buf);
+    free(packed);
+    free(w.runs);
+    errno = err;
+    return rc;
+}
+
+int mvfs_add(mvfs_t* fs, uint32_t dir, const char* name, const char* host_path, int flags, uint32_t* ino_out) {
+    struct stat st;
+    if (stat(host_path, &st) != 0) return -1;
+    if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+        // A named pipe or device has no size to plan with: stream it
+        int fd = open(host_path, O_RDONLY);
+        if (fd < 0) return -1;
+        int rc = mvfs_add_fd(fs, dir, name, fd, flags, ino_out);
+        int err = errno;
+        close(fd);
+        errno = err;
+        return rc;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return -1;
+    }
+    if ((flags & MVFS_DEDUP) && (flags & MVFS_COMPRESS)) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    int inline_data = (flags & MVFS_INLINE) && size <= INLINE_MAX;
+    if ((flags & (MVFS_DEDUP | MVFS_COMPRESS)) && size > 0 && !inline_data) {
+        int fd = open(host_path, O_RDONLY);
+        if (fd < 0) return -1;
+        int rc = (flags & MVFS_DEDUP) ? add_dedup(fs, dir, name, fd, size, ino_out)
+                                      : add_compressed(fs, dir, name, fd, size, ino_out);
+        int err = errno;
+        close(fd);
+        errno = err;
+        return rc;
+    }
+    uint32_t ino;
+    if (mvfs_create(fs, dir, name, size, flags, &ino) != 0 ||
+        mvfs_fill(fs, ino, host_path) != 0) return -1;
+    if (ino_out) *ino_out = ino;
+    return 0;
+}
+
+// =================================DEFRAG=====================================
+// mvfs_frag and mvfs_defrag share one walk (see mvfs_frag_t) that visits
+// every allocated inode once, in walk order. mvfs_defrag gives each block it
+// meets the next block of the output's data region. Blocks that move
+// unchanged (file data, directory leaves) are only noted on the way and
+// copied afterwards, in runs that are adjacent on both sides; the blocks that
+// hold block numbers (directory indexes, extent overflow blocks, the refcount
+// table) are rebuilt for their new place instead. The hash tree is built anew
+// once the data region is complete. The inode table, the bitmaps and the
+// superblock follow, the superblock last.
+
+typedef struct walk walk_t;
+struct walk {
+    mvfs_t* fs;
+    uint8_t* seen;            // one bit per inode
+    int (*visit)(walk_t* w, uint32_t ino, inode_t* node);
+    mvfs_frag_t* frag;        // mvfs_frag: the figures being gathered
+    uint64_t next;            // block just past the last stretch read
+    int out_fd;               // mvfs_defrag: the output image
+    uint8_t* table;           // its inode table
+    uint32_t* map;            // data region block -> its output block, 0 until placed
+    uint64_t placed;          // output data region blocks taken so far (both)
+};
+
+static int walk_inode(walk_t* w, uint32_t ino);
+
+static int walk_entry(const dirent64_t* de, void* arg) {
+    return walk_inode(arg, de->inode_no);
+}
+
+static int walk_inode(walk_t* w, uint32_t ino) {
+    mvfs_t* fs = w->fs;
+    if (ino == 0 || ino > fs->sb.inode_count) {
+        errno = EUCLEAN;
+        return -1;
+    }
+    uint8_t bit = (uint8_t)(1u << ((ino - 1) % 8));
+    if (w->seen[(ino - 1) / 8] & bit) return 0;
+    w->seen[(ino - 1) / 8] |= bit;
+    inode_t* node = get_live_inode(fs, ino);
+    if (!node) {
+        if (errno == ENOENT) errno = EUCLEAN; // linked but not allocated
+        return -1;
+    }
+    if (w->visit(w, ino, node) != 0) return -1;
+    if ((node->mode & MODE_TYPE_MASK) != MODE_DIR) return 0;
+    fs->img.hold++;
+    int rc = dir_iterate(&fs->img, node, walk_entry, w);
+    fs->img.hold--;
+    return rc;
+}
+
+static int walk(walk_t* w) {
+    mvfs_t* fs = w->fs;
+    image_next_op(&fs->img);
+    w->seen = calloc((fs->sb.inode_count + 7) / 8, 1);
+    if (!w->seen) return -1;
+    int rc = walk_inode(w, ROOT_INO);
+    // Inodes no directory links to come last
+    for (uint64_t i = 0; rc == 0 && i < fs->sb.inode_count; i++) {
+        if (bitmap_test(&fs->inode_bitmap.bm, i)) rc = walk_inode(w, (uint32_t)i + 1);
+    }
+    int err = errno;
+    free(w->seen);
+    errno = err;
+    return rc;
+}
+
+static int in_data_region(const mvfs_t* fs, uint64_t block_no) {
+    return block_no >= fs->sb.data_region_start && block_no < fs->sb.total_blocks;
+}
+
+// Index block of a hashed directory, checked far enough to follow its slots
+static dir_index_t* dir_index(mvfs_t* fs, const inode_t* dir) {
+    meta_block_t* mb = in_data_region(fs, dir->direct[1]) ? image_block(&fs->img, dir->direct[1]) : NULL;
+    if (!mb) {
+        if (in_data_region(fs, dir->direct[1])) return NULL;
+        errno = EUCLEAN;
+        return NULL;
+    }
+    dir_index_t* idx = (dir_index_t*)mb->data;
+    if (idx->magic != DIR_INDEX_MAGIC || idx->global_depth > DIR_INDEX_MAX_DEPTH) {
+        errno = EUCLEAN;
+        return NULL;
+    }
+    for (uint32_t slot = 0; slot < (1u << idx->global_depth); slot++) {
+        if (idx->local_depth[slot] > idx->global_depth || !in_data_region(fs, idx->leaf[slot])) {
+            errno = EUCLEAN;
+            return NULL;
+        }
+    }
+    return idx;
+}
+
+// Blocks of a live inode in the order a reader needs them: a hashed
+// directory's index and then its leaves, a file's data and then its extent
+// overflow block
+static int inode_blocks(mvfs_t* fs, inode_t* node, extent_t** runs_out, size_t* count_out) {
+    extent_t* runs = NULL;
+    size_t count = 0, cap = 0;
+    int rc = 0;
+    if ((node->mode & MODE_TYPE_MASK) != MODE_DIR) {
+        if (inode_map(fs, node, &runs, &count) != 0) return -1;
+        cap = count;
+        if ((node->mode & MODE_EXTENTS) && node->reserved_0 > EXTENTS_INLINE) {
+            rc = push_run(&runs, &count, &cap, node->reserved_1, 1);
+        }
+    } else if (!(node->mode & MODE_DIR_INDEX)) {
+        if (!in_data_region(fs, node->direct[0])) {
+            errno = EUCLEAN;
+            return -1;
+        }
+        rc = push_run(&runs, &count, &cap, node->direct[0], 1);
+    } else {
+        dir_index_t* idx = dir_index(fs, node);
+        rc = idx ? push_run(&runs, &count, &cap, node->direct[1], 1) : -1;
+        // A leaf's lowest slot is the one below 1 << local_depth (dir_iterate)
+        for (uint32_t slot = 0; rc == 0 && slot < (1u << idx->global_depth); slot++) {
+            if (slot < (1u << idx->local_depth[slot])) rc = push_run(&runs, &count, &cap, idx->leaf[slot], 1);
+        }
+    }
+    if (rc != 0) {
+        int err = errno;
+        free(runs);
+        errno = err;
+        return -1;
+    }
+    *runs_out = runs;
+    *count_out = count;
+    return 0;
+}
+
+static int frag_visit(walk_t* w, uint32_t ino, inode_t* node) {
+    (void)ino;
+    extent_t* runs;
+    size_t count;
+    if (inode_blocks(w->fs, node, &runs, &count) != 0) return -1;
+    // Blocks take their places as mvfs_defrag would give them out
+    uint64_t base = w->fs->sb.data_region_start;
+    for (size_t r = 0; r < count; r++) {
+        if (runs[r].start != w->next) w->frag->walk_runs++;
+        w->next = (uint64_t)runs[r].start + runs[r].len;
+        for (uint64_t b = runs[r].start; b < w->next; b++) {
+            if (w->map[b - base]) continue;
+            w->map[b - base] = 1;
+            if (b != base + w->placed++) w->frag->misplaced++;
+        }
+    }
+    free(runs);
+    if ((node->mode & MODE_TYPE_MASK) != MODE_FILE || inode_data_blocks(node) == 0) return 0;
+    if (inode_map(w->fs, node, &runs, &count) != 0) return -1;
+    free(runs);
+    w->frag->files++;
+    w->frag->file_runs += count;
+    if (count > 1) w->frag->fragmented++;
+    return 0;
+}
+
+int mvfs_frag(mvfs_t* fs, mvfs_frag_t* st) {
+    memset(st, 0, sizeof(*st));
+    walk_t w = { .fs = fs, .visit = frag_visit, .frag = st };
+    w.map = calloc(fs->sb.data_region_blocks, sizeof(*w.map));
+    if (!w.map) return -1;
+    if (fs->refcounts) {
+        st->walk_runs = 1;
+        w.next = fs->ext.refcount_start + fs->ext.refcount_blocks;
+        w.placed = fs->ext.refcount_blocks;
+        if (fs->ext.refcount_start != fs->sb.data_region_start) st->misplaced += fs->ext.refcount_blocks;
+    }
+    if (fs->sb.flags & FEATURE_MERKLE) {
+        if (fs->ext.merkle_start != w.next) st->walk_runs++;
+        w.next = fs->ext.merkle_start + fs->ext.merkle_blocks;
+        if (fs->ext.merkle_start != fs->sb.data_region_start + w.placed) st->misplaced += fs->ext.merkle_blocks;
+        w.placed += fs->ext.merkle_blocks;
+    }
+    int rc = walk(&w);
+    int err = errno;
+    free(w.map);
+    errno = err;
+    if (rc != 0) return -1;
+
+    bitmap_t* bm = &fs->data_bitmap.bm;
+    st->free_blocks = bm->free;
+    st->used_blocks = bm->nbits - bm->free;
+    if (st->used_blocks > w.placed) st->misplaced += st->used_blocks - w.placed; // referenced by nothing
+    for (uint64_t pos = 0; ; ) {
+        int64_t start = bitmap_find(bm, pos, bm->nbits, 0);
+        if (start < 0) break;
+        int64_t end = bitmap_find(bm, (uint64_t)start, bm->nbits, 1);
+        uint64_t len = (end < 0 ? bm->nbits : (uint64_t)end) - (uint64_t)start;
+        st->free_runs++;
+        if (len > st->largest_free) st->largest_free = len;
+        if (end < 0) {
+            st->tail_free = len;
+            break;
+        }
+        pos = (uint64_t)end;
+    }
+    return 0;
+}
+
+// Next block of the output's data region
+static int take_block(walk_t* w, uint64_t* block_no) {
+    if (w->placed == w->fs->sb.data_region_blocks) {
+        errno = ENOSPC; // only if shared blocks now need more extent blocks
+        return -1;
+    }
+    *block_no = w->fs->sb.data_region_start + w->placed++;
+    return 0;
+}
+
+// Gives a block that moves unchanged its output block, unless a file that
+// shares it already did
+static int place(walk_t* w, uint64_t block_no) {
+    mvfs_t* fs = w->fs;
+    uint64_t rel = block_no - fs->sb.data_region_start;
+    if (!bitmap_test(&fs->data_bitmap.bm, rel)) {
+        errno = EUCLEAN; // in use, but free in the bitmap
+        return -1;
+    }
+    if (w->map[rel] != 0) return 0;
+    uint64_t to;
+    if (take_block(w, &to) != 0) return -1;
+    w->map[rel] = (uint32_t)to;
+    return 0;
+}
+
+static int defrag_dir(walk_t* w, inode_t* node, inode_t* out) {
+    mvfs_t* fs = w->fs;
+    uint64_t base = fs->sb.data_region_start;
+    if (!(node->mode & MODE_DIR_INDEX)) {
+        if (!in_data_region(fs, node->direct[0])) {
+            errno = EUCLEAN;
+            return -1;
+        }
+        if (place(w, node->direct[0]) != 0) return -1;
+        out->direct[0] = w->map[node->direct[0] - base];
+        return 0;
+    }
+    dir_index_t* idx = dir_index(fs, node);
+    uint64_t index_at;
+    if (!idx || take_block(w, &index_at) != 0) return -1;
+    uint8_t block[BS];
+    memcpy(block, idx, BS);
+    idx = (dir_index_t*)block;
+    for (uint32_t slot = 0; slot < (1u << idx->global_depth); slot++) {
+        if (place(w, idx->leaf[slot]) != 0) return -1;
+        idx->leaf[slot] = w->map[idx->leaf[slot] - base];
+    }
+    dir_index_checksum_finalize(idx);
+    if (!in_data_region(fs, node->direct[0]) || place(w, node->direct[0]) != 0) {
+        if (errno != ENOSPC) errno = EUCLEAN;
+        return -1;
+    }
+    out->direct[0] = w->map[node->direct[0] - base];
+    out->direct[1] = (uint32_t)index_at;
+    return write_full(w->out_fd, block, BS, index_at * BS);
+}
+
+// A file keeps its kind of map: direct pointers stay direct pointers, and
+// extents get an overflow block (after the data) only if the moved runs
+// still need one
+static int defrag_file(walk_t* w, inode_t* node, inode_t* out) {
+    uint64_t base = w->fs->sb.data_region_start;
+    extent_t* runs = NULL;
+    extent_t* moved = NULL;
+    size_t count = 0, moved_count = 0, moved_cap = 0;
+    if (inode_map(w->fs, node, &runs, &count) != 0) return -1;
+    int rc = 0;
+    for (size_t r = 0; rc == 0 && r < count; r++) {
+        for (uint32_t i = 0; rc == 0 && i < runs[r].len; i++) {
+            uint64_t b = (uint64_t)runs[r].start + i;
+            rc = place(w, b);
+            if (rc == 0) rc = push_run(&moved, &moved_count, &moved_cap, w->map[b - base], 1);
+        }
+    }
+    if (rc == 0 && !(node->mode & MODE_EXTENTS)) {
+        uint32_t b = 0;
+        for (size_t r = 0; r < moved_count; r++) {
+            for (uint32_t i = 0; i < moved[r].len; i++) out->direct[b++] = moved[r].start + i;
+        }
+    } else if (rc == 0 && node->reserved_0 > 0) {
+        uint8_t block[BS] = {0};
+        uint64_t overflow_at = 0;
+        if (moved_count > EXTENTS_MAX) {
+            errno = EFBIG;
+            rc = -1;
+        } else if (moved_count > EXTENTS_INLINE) {
+            rc = take_block(w, &overflow_at);
+        }
+        memset(out->direct, 0, sizeof(out->direct));
+        extent_t* inline_runs = inode_extents(out);
+        extent_t* overflow_runs = (extent_t*)block;
+        for (size_t r = 0; rc == 0 && r < moved_count; r++) {
+            if (r < EXTENTS_INLINE) inline_runs[r] = moved[r];
+            else overflow_runs[r - EXTENTS_INLINE] = moved[r];
+        }
+        out->reserved_0 = (uint32_t)moved_count;
+        out->reserved_1 = (uint32_t)overflow_at;
+        if (rc == 0 && overflow_at) rc = write_full(w->out_fd, block, BS, overflow_at * BS);
+    }
+    int err = errno;
+    free(runs);
+    free(moved);
+    errno = err;
+    return rc;
+}
+
+static int defrag_visit(walk_t* w, uint32_t ino, inode_t* node) {
+    inode_t* out = (inode_t*)(w->table + (uint64_t)(ino - 1) * INODE_SIZE);
+    int rc = (node->mode & MODE_TYPE_MASK) == MODE_DIR ? defrag_dir(w, node, out) : defrag_file(w, node, out);
+    if (rc == 0) inode_crc_finalize(out);
+    return rc;
+}
+
+static int same_file(int fd, const struct stat* st) {
+    struct stat other;
+    return fd >= 0 && fstat(fd, &other) == 0 && other.st_dev == st->st_dev && other.st_ino == st->st_ino;
+}
+
+int mvfs_defrag(mvfs_t* fs, const char* output) {
+    if (mvfs_flush(fs) != 0) return -1;
+    int fd = open(output, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    errno = 0;
+    if (fstat(fd, &st) != 0 || same_file(fs->img.read_fd, &st) || same_file(fs->img.write_fd, &st)) {
+        int err = errno;
+        close(fd);
+        errno = err ? err : EINVAL; // never truncate the input
+        return -1;
+    }
+
+    const superblock_t* sb = &fs->sb;
+    uint64_t base = sb->data_region_start;
+    walk_t w = { .fs = fs, .visit = defrag_visit, .out_fd = fd };
+    uint32_t* source = NULL;
+    uint16_t* refcounts = NULL;
+    uint8_t* data_bits = NULL;
+    stats_add(STAT_SYSCALLS, 2);
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)(sb->total_blocks * BS)) != 0) goto fail;
+
+    // Every inode is copied; the walk then rewrites the maps of the live ones
+    for (uint64_t b = 0; b < sb->inode_table_blocks; b++) {
+        if (!get_inode(fs, (uint32_t)(b * (BS / INODE_SIZE) + 1))) goto fail;
+    }
+    w.table = malloc(sb->inode_table_blocks * BS);
+    w.map = calloc(sb->data_region_blocks, sizeof(*w.map));
+    if (!w.table || !w.map) goto fail;
+    memcpy(w.table, fs->table, sb->inode_table_blocks * BS);
+    if (fs->refcounts) w.placed = fs->ext.refcount_blocks; // the table goes first
+    if (sb->flags & FEATURE_MERKLE) w.placed += fs->ext.merkle_blocks; // then the tree
+    if (walk(&w) != 0) goto fail;
+
+    source = calloc(w.placed, sizeof(*source));
+    if (!source && w.placed > 0) goto fail;
+    for (uint64_t rel = 0; rel < sb->data_region_blocks; rel++) {
+        if (w.map[rel]) source[w.map[rel] - base] = (uint32_t)(base + rel);
+    }
+    int in_fd = mvfs_data_fd(fs);
+    for (uint64_t b = 0; b < w.placed; ) {
+        if (!source[b]) {
+            b++;
+            continue;
+        }
+        uint64_t end = b + 1;
+        while (end < w.placed && source[end] == source[end - 1] + 1) end++;
+        if (copy_bytes(in_fd, (uint64_t)source[b] * BS, fd, (base + b) * BS, (end - b) * BS) != 0) goto fail;
+        b = end;
+    }
+
+    superblock_t out_sb = fs->sb;
+    superblock_ext_t ext = fs->ext;
+    if (fs->refcounts) {
+        refcounts = calloc(fs->ext.refcount_blocks, BS);
+        if (!refcounts) goto fail;
+        for (uint64_t rel = 0; rel < sb->data_region_blocks; rel++) {
+            if (w.map[rel]) refcounts[w.map[rel] - base] = fs->refcounts[rel];
+        }
+        ext.refcount_start = base;
+        if (write_full(fd, refcounts, fs->ext.refcount_blocks * BS, base * BS) != 0) goto fail;
+    }
+
+    bitmap_t bm;
+    data_bits = calloc(sb->data_bitmap_blocks, BS);
+    if (!data_bits) goto fail;
+    bitmap_init(&bm, data_bits, sb->data_region_blocks);
+    bitmap_set_range(&bm, 0, w.placed);
+    if (sb->flags & FEATURE_MERKLE) {
+        ext.merkle_start = base + (fs->refcounts ? fs->ext.refcount_blocks : 0);
+        if (merkle_build(fd, &out_sb, &ext, &bm) != 0) goto fail;
+    }
+    if (write_full(fd, w.table, sb->inode_table_blocks * BS, sb->inode_table_start * BS) != 0 ||
+        write_full(fd, fs->inode_bitmap.data, sb->inode_bitmap_blocks * BS, sb->inode_bitmap_start * BS) != 0 ||
+        write_full(fd, data_bits, sb->data_bitmap_blocks * BS, sb->data_bitmap_start * BS) != 0) goto fail;
+
+    // Superblock last
+    out_sb.flags |= FEATURE_FREE_COUNTS;
+    ext.free_inodes = fs->inode_bitmap.bm.free;
+    ext.first_free_inode = bitmap_first_free(&fs->inode_bitmap.bm);
+    ext.free_blocks = bm.free;
+    ext.first_free_block = w.placed;
+    uint8_t block[BS] = {0};
+    superblock_ext_crc_finalize(&out_sb, &ext);
+    memcpy(block, &out_sb, sizeof(out_sb));
+    memcpy(block + SB_EXT_OFFSET, &ext, sizeof(ext));
+    if (write_full(fd, block, BS, 0) != 0) goto fail;
+    stats_add(STAT_SYSCALLS, 2);
+    if (fsync(fd) != 0) goto fail;
+    int rc = close(fd);
+    fd = -1;
+    if (rc != 0) goto fail;
+    free(w.table);
+    free(w.map);
+    free(source);
+    free(refcounts);
+    free(data_bits);
+    return 0;
+
+fail:;
+    int err = errno;
+    if (fd >= 0) close(fd);
+    unlink(output);
+    free(w.table);
+    free(w.map);
+    free(source);
+    free(refcounts);
+    free(data_bits);
+    errno = err;
+    return -1;
+}
+
+// =================================MERKLE======================================
+// A writable handle on a FEATURE_MERKLE image keeps a bitmap of the data
+// blocks written since the last flush: the image layer marks every block it
+// writes back or is told was written behind its back (img.written), and the
+// flush adds every block allocated or freed since the last one, since
+// callers of mvfs_data_fd write into new blocks and a freed block's leaf
+// becomes 0. The
+// flush then reads those blocks back, stores their hashes in the level-0 tree
+// blocks and rehashes the tree blocks above them, one path per changed
+// stretch, up to merkle_root. Tree blocks go through the block cache like
+// any other metadata block.
+
+typedef struct {
+    int levels;
+    uint64_t blocks[MERKLE_MAX_LEVELS];  // per level
+    uint64_t start[MERKLE_MAX_LEVELS];   // first block of each level
+} merkle_geom_t;
+
+static void merkle_geom(const superblock_t* sb, const superblock_ext_t* ext, merkle_geom_t* g) {
+    g->levels = merkle_levels(sb->data_region_blocks, g->blocks);
+    uint64_t at = ext->merkle_start;
+    for (int l = 0; l < g->levels; l++) {
+        g->start[l] = at;
+        at += g->blocks[l];
+    }
+}
+
+static uint64_t zero_hash(void) {
+    static uint64_t hash;
+    if (!hash) {
+        static const uint8_t zeros[BS];
+        hash = block_hash(zeros);
+    }
+    return hash;
+}
+
+static int is_leaf(const superblock_ext_t* ext, const bitmap_t* used, uint64_t block_no, uint64_t rel) {
+    return bitmap_test(used, rel) && (block_no < ext->merkle_start || block_no >= ext->merkle_start + ext->merkle_blocks);
+}
+
+// Leaf hashes of data blocks [rel, rel + n) (relative, n <= COPY_CHUNK_BLOCKS)
+// as they are in fd, given the data bitmap used; free blocks and holes are
+// not read. Returns how many of the blocks are leaves.
+static int hash_leaves(int fd, const superblock_t* sb, const superblock_ext_t* ext, const bitmap_t* used,
+                       uint64_t rel, uint64_t n, uint8_t* buffer, uint64_t* out) {
+    uint64_t first = sb->data_region_start + rel;
+    uint64_t leaves = 0;
+    for (uint64_t i = 0; i < n; i++) leaves += (uint64_t)is_leaf(ext, used, first + i, rel + i);
+    if (leaves == 0) {
+        memset(out, 0, n * sizeof(*out));
+        return 0;
+    }
+    off_t data = lseek(fd, (off_t)(first * BS), SEEK_DATA);
+    stats_add(STAT_SYSCALLS, 1);
+    int hole = data >= 0 ? (uint64_t)data >= (first + n) * BS : errno == ENXIO;
+    if (!hole && read_full(fd, buffer, n * BS, first * BS) != 0) return -1;
+    for (uint64_t i = 0; i < n; i++) {
+        if (!is_leaf(ext, used, first + i, rel + i)) {
+            out[i] = 0;
+        } else {
+            out[i] = hole ? zero_hash() : block_hash(buffer + i * BS);
+        }
+    }
+    return (int)leaves;
+}
+
+// Starts tracking writes: nothing is pending, allocations count from now
+static int merkle_track(mvfs_t* fs) {
+    uint64_t words = (fs->sb.data_region_blocks + 63) / 64;
+    fs->merkle_bits = calloc(words, sizeof(uint64_t));
+    fs->merkle_alloc = malloc(fs->sb.data_bitmap_blocks * BS);
+    if (!fs->merkle_bits || !fs->merkle_alloc) return -1;
+    memcpy(fs->merkle_alloc, fs->data_bitmap.data, fs->sb.data_bitmap_blocks * BS);
+    bitmap_init(&fs->merkle_written, fs->merkle_bits, fs->sb.data_region_blocks);
+    fs->img.written = &fs->merkle_written;
+    return 0;
+}
+
+// Appends index to a level's list of changed tree blocks, which arrive in
+// ascending order
+static int note_node(uint64_t** list, size_t* count, size_t* cap, uint64_t index) {
+    if (*count > 0 && (*list)[*count - 1] == index) return 0;
+    if (*count == *cap) {
+        size_t c = *cap ? *cap * 2 : 16;
+        uint64_t* l = realloc(*list, c * sizeof(*l));
+        if (!l) return -1;
+        *list = l;
+        *cap = c;
+    }
+    (*list)[(*count)++] = index;
+    return 0;
+}
+
+static int merkle_update(mvfs_t* fs) {
+    if (!fs->img.written) return 0;
+    uint64_t blocks = fs->sb.data_region_blocks;
+    uint64_t bytes = (blocks + 7) / 8;
+    for (uint64_t i = 0; i < bytes; i++) {
+        fs->merkle_bits[i] |= (uint8_t)(fs->data_bitmap.data[i] ^ fs->merkle_alloc[i]);
+    }
+    memcpy(fs->merkle_alloc, fs->data_bitmap.data, bytes);
+    if (bitmap_find(&fs->merkle_written, 0, blocks, 1) < 0) return 0;
+
+    merkle_geom_t g;
+    merkle_geom(&fs->sb, &fs->ext, &g);
+    uint64_t* changed[MERKLE_MAX_LEVELS] = {0};
+    size_t count[MERKLE_MAX_LEVELS] = {0}, cap[MERKLE_MAX_LEVELS] = {0};
+    uint8_t* buffer = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    uint64_t hashes[COPY_CHUNK_BLOCKS];
+    int rc = buffer ? 0 : -1;
+    image_next_op(&fs->img);
+
+    // Leaves, one stretch of written blocks at a time
+    for (uint64_t pos = 0; rc == 0; ) {
+        int64_t start = bitmap_find(&fs->merkle_written, pos, blocks, 1);
+        if (start < 0) break;
+        int64_t end = bitmap_find(&fs->merkle_written, (uint64_t)start, blocks, 0);
+        pos = end < 0 ? blocks : (uint64_t)end;
+        for (uint64_t rel = (uint64_t)start; rc == 0 && rel < pos; ) {
+            uint64_t n = pos - rel < COPY_CHUNK_BLOCKS ? pos - rel : COPY_CHUNK_BLOCKS;
+            rc = hash_leaves(fs->img.write_fd, &fs->sb, &fs->ext, &fs->data_bitmap.bm, rel, n, buffer, hashes) < 0 ? -1 : 0;
+            for (uint64_t i = 0; rc == 0 && i < n; i++, rel++) {
+                meta_block_t* mb = image_block(&fs->img, g.start[0] + rel / MERKLE_FANOUT);
+                if (!mb || note_node(&changed[0], &count[0], &cap[0], rel / MERKLE_FANOUT) != 0) {
+                    rc = -1;
+                    break;
+                }
+                ((uint64_t*)mb->data)[rel % MERKLE_FANOUT] = hashes[i];
+                mb->dirty = 1;
+            }
+        }
+    }
+
+    // Then every tree block above a changed one, level by level
+    for (int l = 0; rc == 0 && l < g.levels; l++) {
+        for (size_t i = 0; rc == 0 && i < count[l]; i++) {
+            meta_block_t* mb = image_block(&fs->img, g.start[l] + changed[l][i]);
+            if (!mb) {
+                rc = -1;
+                break;
+            }
+            uint64_t hash = block_hash(mb->data);
+            if (l + 1 == g.levels) {
+                fs->ext.merkle_root = hash;
+                continue;
+            }
+            uint64_t parent = changed[l][i] / MERKLE_FANOUT;
+            meta_block_t* up = image_block(&fs->img, g.start[l + 1] + parent);
+            if (!up || note_node(&changed[l + 1], &count[l + 1], &cap[l + 1], parent) != 0) {
+                rc = -1;
+                break;
+            }
+            ((uint64_t*)up->data)[changed[l][i] % MERKLE_FANOUT] = hash;
+            up->dirty = 1;
+        }
+    }
+    // Writing the tree back marks its own blocks; they are not leaves to redo
+    if (rc == 0) rc = image_flush(&fs->img);
+    if (rc == 0) {
+        memset(fs->merkle_bits, 0, (blocks + 63) / 64 * sizeof(uint64_t));
+        fs->sb_dirty = 1;
+    }
+    int err = errno;
+    for (int l = 0; l < MERKLE_MAX_LEVELS; l++) free(changed[l]);
+    free(buffer);
+    errno = err;
+    return rc;
+}
+
+int mvfs_merkle_enable(mvfs_t* fs) {
+    image_next_op(&fs->img);
+    if (begin_write(fs) != 0) return -1;
+    if (fs->sb.flags & FEATURE_MERKLE) return 0;
+    uint64_t blocks = merkle_tree_blocks(fs->sb.data_region_blocks);
+    uint64_t start;
+    if (alloc_table(fs, blocks, &start) != 0) return -1;
+    if (merkle_track(fs) != 0) {
+        int err = errno;
+        bitmap_clear_range(&fs->data_bitmap.bm, start - fs->sb.data_region_start, blocks);
+        free(fs->merkle_bits);
+        free(fs->merkle_alloc);
+        fs->merkle_bits = fs->merkle_alloc = NULL;
+        fs->img.written = NULL;
+        errno = err;
+        return -1;
+    }
+    // Every leaf is due; the tree starts from zeros so unused entries stay 0
+    for (uint64_t b = 0; b < blocks; b++) {
+        if (!image_new_block(&fs->img, start + b)) return -1;
+    }
+    bitmap_set_range(&fs->merkle_written, 0, fs->sb.data_region_blocks);
+    fs->ext.merkle_start = start;
+    fs->ext.merkle_blocks = blocks;
+    fs->sb.flags |= FEATURE_MERKLE;
+    fs->sb_dirty = 1;
+    return 0;
+}
+
+// Writes the whole tree of an image that fd holds complete but for the tree
+// and the data bitmap, which is used
+static int merkle_build(int fd, const superblock_t* sb, superblock_ext_t* ext, const bitmap_t* used) {
+    merkle_geom_t g;
+    merkle_geom(sb, ext, &g);
+    uint64_t* tree = calloc(ext->merkle_blocks, BS);
+    uint8_t* buffer = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    int rc = tree && buffer ? 0 : -1;
+    for (uint64_t rel = 0; rc == 0 && rel < sb->data_region_blocks; rel += COPY_CHUNK_BLOCKS) {
+        uint64_t n = sb->data_region_blocks - rel;
+        if (n > COPY_CHUNK_BLOCKS) n = COPY_CHUNK_BLOCKS;
+        rc = hash_leaves(fd, sb, ext, used, rel, n, buffer, tree + rel) < 0 ? -1 : 0;
+    }
+    for (int l = 0; rc == 0 && l < g.levels; l++) {
+        uint64_t* level = tree + (g.start[l] - ext->merkle_start) * MERKLE_FANOUT;
+        for (uint64_t i = 0; i < g.blocks[l]; i++) {
+            uint64_t hash = block_hash(level + i * MERKLE_FANOUT);
+            if (l + 1 == g.levels) ext->merkle_root = hash;
+            else tree[(g.start[l + 1] - ext->merkle_start) * MERKLE_FANOUT + i] = hash;
+        }
+    }
+    if (rc == 0) rc = write_full(fd, tree, ext->merkle_blocks * BS, ext->merkle_start * BS);
+    int err = errno;
+    free(tree);
+    free(buffer);
+    errno = err;
+    return rc;
+}
+
+static int merkle_ready(mvfs_t* fs) {
+    if (!(fs->sb.flags & FEATURE_MERKLE)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return mvfs_flush(fs); // the tree is current only once flushed
+}
+
+static void verify_bad(mvfs_verify_t* st, uint64_t block_no) {
+    uint64_t listed = st->bad_blocks < MVFS_VERIFY_BAD ? st->bad_blocks : MVFS_VERIFY_BAD;
+    for (uint64_t i = 0; i < listed; i++) {
+        if (st->bad[i] == block_no) return;
+    }
+    if (listed < MVFS_VERIFY_BAD) st->bad[listed] = block_no;
+    st->bad_blocks++;
+}
+
+int64_t mvfs_verify_tree(mvfs_t* fs, mvfs_verify_t* st) {
+    if (merkle_ready(fs) != 0) return -1;
+    merkle_geom_t g;
+    merkle_geom(&fs->sb, &fs->ext, &g);
+    free(fs->merkle_nodes);
+    free(fs->merkle_ok);
+    fs->merkle_nodes = malloc(fs->ext.merkle_blocks * BS);
+    fs->merkle_ok = calloc(fs->ext.merkle_blocks, 1);
+    if (!fs->merkle_nodes || !fs->merkle_ok ||
+        read_full(mvfs_data_fd(fs), fs->merkle_nodes, fs->ext.merkle_blocks * BS, fs->ext.merkle_start * BS) != 0) {
+        return -1;
+    }
+    // Top down: a block is checked only against a parent that checked out
+    for (int l = g.levels - 1; l >= 0; l--) {
+        uint64_t first = g.start[l] - fs->ext.merkle_start;
+        for (uint64_t i = 0; i < g.blocks[l]; i++) {
+            uint64_t hash = block_hash(fs->merkle_nodes + (first + i) * MERKLE_FANOUT);
+            uint64_t expected = fs->ext.merkle_root;
+            if (l + 1 < g.levels) {
+                uint64_t parent = g.start[l + 1] - fs->ext.merkle_start + i / MERKLE_FANOUT;
+                if (!fs->merkle_ok[parent]) continue;
+                expected = fs->merkle_nodes[parent * MERKLE_FANOUT + i % MERKLE_FANOUT];
+            }
+            fs->merkle_ok[first + i] = hash == expected;
+            if (hash != expected) verify_bad(st, g.start[l] + i);
+        }
+    }
+    st->tree_blocks += fs->ext.merkle_blocks;
+    return (int64_t)g.blocks[0];
+}
+
+int mvfs_verify_part(mvfs_t* fs, uint64_t part, mvfs_verify_t* st) {
+    if (!fs->merkle_nodes || part >= (fs->sb.data_region_blocks + MERKLE_FANOUT - 1) / MERKLE_FANOUT) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!fs->merkle_ok[part]) return 0; // reported by mvfs_verify_tree
+    uint8_t* buffer = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    if (!buffer) return -1;
+    uint64_t hashes[COPY_CHUNK_BLOCKS];
+    const uint64_t* leaves = fs->merkle_nodes + part * MERKLE_FANOUT;
+    uint64_t first = part * MERKLE_FANOUT;
+    uint64_t end = first + MERKLE_FANOUT < fs->sb.data_region_blocks ? first + MERKLE_FANOUT : fs->sb.data_region_blocks;
+    int rc = 0;
+    for (uint64_t rel = first; rc == 0 && rel < end; rel += COPY_CHUNK_BLOCKS) {
+        uint64_t n = end - rel < COPY_CHUNK_BLOCKS ? end - rel : COPY_CHUNK_BLOCKS;
+        int hashed = hash_leaves(mvfs_data_fd(fs), &fs->sb, &fs->ext, &fs->data_bitmap.bm, rel, n, buffer, hashes);
+        rc = hashed < 0 ? -1 : 0;
+        for (uint64_t i = 0; rc == 0 && i < n; i++) {
+            if (hashes[i] != leaves[rel - first + i]) verify_bad(st, fs->sb.data_region_start + rel + i);
+        }
+        if (rc == 0) st->data_blocks += (uint64_t)hashed;
+    }
+    int err = errno;
+    free(buffer);
+    errno = err;
+    return rc;
+}
+
+// The path of tree blocks above the leaf being checked, one block per level,
+// each checked against its parent when loaded
+typedef struct {
+    mvfs_t* fs;
+    merkle_geom_t g;
+    uint64_t index[MERKLE_MAX_LEVELS];  // loaded block per level, UINT64_MAX for none
+    int ok[MERKLE_MAX_LEVELS];
+    uint64_t* node[MERKLE_MAX_LEVELS];
+    mvfs_verify_t* st;
+} merkle_path_t;
+
+static int path_load(merkle_path_t* p, int l, uint64_t index) {
+    if (p->index[l] == index) return 0;
+    if (read_full(mvfs_data_fd(p->fs), p->node[l], BS, (p->g.start[l] + index) * BS) != 0) return -1;
+    p->index[l] = index;
+    p->st->tree_blocks++;
+    uint64_t expected = p->fs->ext.merkle_root;
+    if (l + 1 < p->g.levels) {
+        if (path_load(p, l + 1, index / MERKLE_FANOUT) != 0) return -1;
+        if (!p->ok[l + 1]) {
+            p->ok[l] = 0;
+            return 0;
+        }
+        expected = p->node[l + 1][index % MERKLE_FANOUT];
+    }
+    p->ok[l] = block_hash(p->node[l]) == expected;
+    if (!p->ok[l]) verify_bad(p->st, p->g.start[l] + index);
+    return 0;
+}
+
+int mvfs_verify_file(mvfs_t* fs, uint32_t ino, mvfs_verify_t* st) {
+    if (merkle_ready(fs) != 0) return -1;
+    image_next_op(&fs->img);
+    inode_t* node = get_live_inode(fs, ino);
+    extent_t* runs = NULL;
+    size_t count = 0;
+    if (!node || inode_blocks(fs, node, &runs, &count) != 0) return -1;
+
+    merkle_path_t p = { .fs = fs, .st = st };
+    merkle_geom(&fs->sb, &fs->ext, &p.g);
+    uint64_t* nodes = malloc((size_t)p.g.levels * BS);
+    uint8_t* buffer = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    uint64_t hashes[COPY_CHUNK_BLOCKS];
+    int rc = nodes && buffer ? 0 : -1;
+    for (int l = 0; l < p.g.levels; l++) {
+        p.index[l] = UINT64_MAX;
+        p.node[l] = nodes ? nodes + (size_t)l * MERKLE_FANOUT : NULL;
+    }
+    for (size_t r = 0; rc == 0 && r < count; r++) {
+        if (!in_data_region(fs, runs[r].start) || !in_data_region(fs, (uint64_t)runs[r].start + runs[r].len - 1)) {
+            errno = EUCLEAN;
+            rc = -1;
+            break;
+        }
+        uint64_t rel = runs[r].start - fs->sb.data_region_start;
+        for (uint64_t left = runs[r].len; rc == 0 && left > 0; ) {
+            uint64_t n = left < COPY_CHUNK_BLOCKS ? left : COPY_CHUNK_BLOCKS;
+            int hashed = hash_leaves(mvfs_data_fd(fs), &fs->sb, &fs->ext, &fs->data_bitmap.bm, rel, n, buffer, hashes);
+            rc = hashed < 0 ? -1 : 0;
+            for (uint64_t i = 0; rc == 0 && i < n; i++, rel++) {
+                rc = path_load(&p, 0, rel / MERKLE_FANOUT);
+                if (rc == 0 && p.ok[0] && hashes[i] != p.node[0][rel % MERKLE_FANOUT]) {
+                    verify_bad(st, fs->sb.data_region_start + rel);
+                }
+            }
+            if (rc == 0) st->data_blocks += (uint64_t)hashed;
+            left -= n;
+        }
+    }
+    int err = errno;
+    free(runs);
+    free(nodes);
+    free(buffer);
+    errno = err;
+    return rc;
+}
+// =================================MERKLE======================================
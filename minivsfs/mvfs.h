@@ -0,0 +1,212 @@
+// libminivsfs: an open-image handle for MiniVSFS.
+//
+// mvfs_open() reads the superblock and both bitmaps once and keeps them, plus
+// every inode-table and directory block it touches, in memory for the life of
+// the handle. Lookups, stats and adds then cost no image I/O beyond the file
+// data itself, and all metadata changes are written back in one pass by
+// mvfs_flush() / mvfs_close(). File data is written as it is added, into
+// blocks that nothing references until the metadata is flushed, so
+// mvfs_abort() leaves the file system as it was; only free blocks may have
+// been overwritten. Callers that need the image untouched byte for byte on
+// failure create every file first and fill them afterwards.
+//
+// Calls return 0 (or a count) on success and -1 / NULL with errno set on
+// failure. Notable errno values: ENOENT (no such name), EEXIST (name taken),
+// ENOSPC (no free inode or block, or directory full), EFBIG (file too large
+// or too fragmented), EUCLEAN (corrupt image structure), EROFS (read-only
+// handle).
+#ifndef MINIVSFS_MVFS_H
+#define MINIVSFS_MVFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "minivsfs.h"
+
+typedef struct mvfs mvfs_t;
+
+// mvfs_open flags
+#define MVFS_RDONLY 0
+#define MVFS_RDWR   1
+
+// mvfs_create / mvfs_add flags
+#define MVFS_INLINE 1   // store files of up to INLINE_MAX bytes in the inode
+#define MVFS_DEDUP  2   // mvfs_add only: share blocks whose contents the image already holds
+#define MVFS_COMPRESS 4 // mvfs_add(_fd) only: store the file as compressed frames
+
+typedef struct {
+    uint64_t hits;          // blocks found in the cache
+    uint64_t misses;        // blocks read on demand
+    uint64_t readahead;     // blocks read ahead of a sequential reader
+    uint64_t evictions;
+    uint64_t cached_blocks; // blocks held right now
+    uint64_t budget_blocks;
+} mvfs_cache_stats_t;
+
+typedef struct {
+    uint64_t indexed_blocks; // existing blocks hashed to build the index
+    uint64_t written_blocks; // blocks added with new contents
+    uint64_t shared_blocks;  // blocks added as references to existing ones
+} mvfs_dedup_stats_t;
+
+typedef struct {
+    uint32_t ino;
+    uint16_t mode;      // MODE_DIR or MODE_FILE plus MODE_* layout flags
+    uint16_t links;
+    uint64_t size;
+    uint64_t blocks;    // data blocks holding file contents
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+} mvfs_stat_t;
+
+// Writes a fresh image with an empty root directory. The image is sized with
+// ftruncate and only the blocks that carry data are written; with
+// preallocate the space is also reserved with posix_fallocate. *sb receives
+// the new superblock.
+int mvfs_format(const char* path, uint64_t size_kib, uint64_t inodes, int preallocate, superblock_t* sb);
+
+// Fails with EUCLEAN unless the superblock's checksum and geometry check out
+mvfs_t* mvfs_open(const char* path, int flags);
+// Opens input read-only; changes are written to output, which is created as
+// a copy of input the first time something is written (at the latest on
+// flush). Input is never modified.
+mvfs_t* mvfs_open_copy(const char* input, const char* output);
+// Writes back every modified metadata block, the bitmaps and the superblock
+int mvfs_flush(mvfs_t* fs);
+// Flushes and releases the handle; the handle is released even on failure
+int mvfs_close(mvfs_t* fs);
+// Releases the handle without writing metadata. An output created by
+// mvfs_open_copy is removed.
+void mvfs_abort(mvfs_t* fs);
+
+// Memory budget of the block cache (default MVFS_CACHE_DEFAULT). mvfs_read
+// goes through the cache and reads ahead when a file is read sequentially;
+// the superblock, bitmaps and inode table are held in memory outside it, and
+// dirty blocks are never evicted. 0 sends mvfs_read straight to the image and
+// keeps directory and extent blocks without limit.
+#define MVFS_CACHE_DEFAULT (32u << 20)
+void mvfs_set_cache(mvfs_t* fs, size_t bytes);
+void mvfs_cache_stats(const mvfs_t* fs, mvfs_cache_stats_t* st);
+
+// Backend for the bulk copies of mvfs_fill (and so mvfs_add), see io.h:
+// pread/pwrite by default, or io_uring with registered buffers. MVFS_IO_AUTO
+// takes io_uring where the kernel allows it and pread otherwise; asking for
+// MVFS_IO_URING where it is unavailable fails with the setup error.
+#define MVFS_IO_AUTO  0
+#define MVFS_IO_PREAD 1
+#define MVFS_IO_URING 2
+int mvfs_set_io(mvfs_t* fs, int backend);
+// "pread" or "io_uring": the backend in use
+const char* mvfs_io_name(mvfs_t* fs);
+
+const superblock_t* mvfs_superblock(const mvfs_t* fs);
+// Kept current as inodes and blocks are taken and given back; no bitmap scan
+uint64_t mvfs_free_inodes(const mvfs_t* fs);
+uint64_t mvfs_free_blocks(const mvfs_t* fs);
+
+// Resolves a '/'-separated path from the root directory
+int mvfs_lookup(mvfs_t* fs, const char* path, uint32_t* ino);
+int mvfs_stat(mvfs_t* fs, uint32_t ino, mvfs_stat_t* st);
+// Calls fn for every entry of a directory except "." and ".."; a non-zero
+// return from fn stops the walk and is returned
+int mvfs_iterate(mvfs_t* fs, uint32_t dir,
+                 int (*fn)(const char* name, uint32_t ino, uint8_t type, void* arg), void* arg);
+// Reads up to len bytes at offset; returns the byte count (0 at end of file)
+ssize_t mvfs_read(mvfs_t* fs, uint32_t ino, void* buf, size_t len, uint64_t offset);
+
+// The file's data blocks as runs of adjacent absolute block numbers, in
+// file order; *runs is malloc'd (NULL for inline and empty files). Together
+// with mvfs_data_fd this lets callers move data without a userspace copy.
+int mvfs_map(mvfs_t* fs, uint32_t ino, extent_t** runs, size_t* count);
+// Descriptor that currently holds the image's file data
+int mvfs_data_fd(mvfs_t* fs);
+
+// Creates an empty directory or a file of exactly size bytes in dir. A
+// file's blocks are allocated immediately, as one contiguous run when the
+// free space allows; its contents are then written with mvfs_write.
+int mvfs_mkdir(mvfs_t* fs, uint32_t dir, const char* name, uint32_t* ino);
+int mvfs_create(mvfs_t* fs, uint32_t dir, const char* name, uint64_t size, int flags, uint32_t* ino);
+// Writes inside the size given at creation; a write that reaches the end of
+// the file also zeroes the rest of its last block
+int mvfs_write(mvfs_t* fs, uint32_t ino, const void* buf, size_t len, uint64_t offset);
+// Writes a host file's contents into a file created with its size
+int mvfs_fill(mvfs_t* fs, uint32_t ino, const char* host_path);
+// mvfs_create + mvfs_fill. With MVFS_DEDUP every 4 KiB block of the host
+// file is first looked up by content: blocks the image already holds (or
+// that repeat earlier in the same file) become references counted in the
+// refcount table (FEATURE_DEDUP) and only the rest is allocated and written.
+// The content index is built by hashing the image's file blocks on the first
+// such call. mvfs_write refuses, with EBUSY, files that share blocks.
+// With MVFS_COMPRESS (not combinable with MVFS_DEDUP) the file is stored as
+// LZ-compressed frames (MODE_COMPRESSED) when that saves at least one block.
+// mvfs_read decodes such files one frame at a time; mvfs_write refuses them
+// with EINVAL, and mvfs_map returns the blocks of the compressed stream.
+// A named pipe or character device is streamed as with mvfs_add_fd.
+int mvfs_add(mvfs_t* fs, uint32_t dir, const char* name, const char* host_path, int flags, uint32_t* ino);
+// Adds the rest of fd (a pipe, socket or file) without knowing its length:
+// blocks are allocated as the data arrives, and the size and inode are set
+// when fd reaches end of input. On failure, including ENOSPC once the image
+// is full, the inode and all its blocks are given back. MVFS_INLINE and
+// MVFS_COMPRESS work as for mvfs_add (a compressed stream is never stored
+// raw instead); MVFS_DEDUP fails with EINVAL.
+int mvfs_add_fd(mvfs_t* fs, uint32_t dir, const char* name, int fd, int flags, uint32_t* ino);
+void mvfs_dedup_stats(const mvfs_t* fs, mvfs_dedup_stats_t* st);
+
+// Hash tree over the data region (FEATURE_MERKLE, see minivsfs.h). Once
+// enabled, every flush rehashes the blocks written since the last one and
+// the tree blocks above them, so keeping the tree current costs about as
+// much as the writes themselves. Verification reads blocks with pread only.
+int mvfs_merkle_enable(mvfs_t* fs);
+
+#define MVFS_VERIFY_BAD 16
+typedef struct {
+    uint64_t data_blocks;     // used data region blocks hashed
+    uint64_t tree_blocks;     // tree blocks checked
+    uint64_t bad_blocks;      // blocks (data or tree) that did not match
+    uint64_t bad[MVFS_VERIFY_BAD]; // the first of those, absolute block numbers
+} mvfs_verify_t;
+
+// Flushes, reads the whole tree and checks it against merkle_root; returns
+// the number of parts, one per level-0 tree block, for mvfs_verify_part.
+// EOPNOTSUPP when the image has no tree.
+int64_t mvfs_verify_tree(mvfs_t* fs, mvfs_verify_t* st);
+// Checks the data blocks under one part against the tree. Callers may run
+// parts in parallel threads, each with its own st, while nothing else uses
+// the handle; a part whose tree block is bad is already counted and skipped.
+int mvfs_verify_part(mvfs_t* fs, uint64_t part, mvfs_verify_t* st);
+// Checks one file's or directory's blocks and only the tree blocks on their
+// paths to the root
+int mvfs_verify_file(mvfs_t* fs, uint32_t ino, mvfs_verify_t* st);
+
+// Fragmentation of an image. The walk reads every used block in directory
+// order: the refcount table, the hash tree, then each directory's blocks followed by its
+// entries, depth first (a file's data, then its extent overflow block), then
+// any allocated inodes no directory links to.
+typedef struct {
+    uint64_t files;           // regular files with data blocks
+    uint64_t fragmented;      // of those, files in more than one run
+    uint64_t file_runs;       // runs over all those files
+    uint64_t used_blocks;     // data region blocks in use
+    uint64_t walk_runs;       // contiguous stretches the walk reads
+    uint64_t misplaced;       // blocks mvfs_defrag would move or drop; 0 when compact
+    uint64_t free_blocks;
+    uint64_t free_runs;       // runs of free blocks
+    uint64_t largest_free;    // longest free run, in blocks
+    uint64_t tail_free;       // free blocks after the last used one
+} mvfs_frag_t;
+
+int mvfs_frag(mvfs_t* fs, mvfs_frag_t* st);
+
+// Writes a compacted copy of the image to output: every block is moved into
+// walk order from the start of the data region, so each file and directory
+// becomes one run (unless it shares blocks) and all free space one run at the
+// end. Inode numbers, contents and timestamps stay as they are; blocks that
+// nothing references are not carried over. The handle's pending changes are
+// flushed first and the handle is otherwise left alone. Output is synced
+// before this returns, so renaming it over the input replaces the image
+// atomically. On failure output is removed; EINVAL if it is the input itself.
+int mvfs_defrag(mvfs_t* fs, const char* output);
+
+#endif
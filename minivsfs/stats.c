@@ -0,0 +1,91 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PHASES 16
+
+_Thread_local stats_block_t* stats_local;
+
+static _Atomic(stats_block_t*) blocks;    // every thread's block, never freed
+static stats_block_t fallback;            // used if a block cannot be allocated
+
+static const char* const COUNTER_NAMES[STAT_COUNT] = {
+    "syscalls", "bytes_read", "bytes_written", "blocks_allocated", "inodes_allocated",
+    "bitmap_words_scanned", "crc_calls", "crc_bytes", "crc_ns", "clone_ns",
+};
+
+typedef struct {
+    const char* name;
+    uint64_t ns;
+    uint64_t entries;
+} phase_t;
+
+static phase_t phases[MAX_PHASES];
+static int phase_count;
+static int current = -1;
+static uint64_t phase_start;
+static uint64_t first_start;
+
+stats_block_t* stats_register(void) {
+    stats_block_t* b = calloc(1, sizeof(*b));
+    if (!b) {
+        // Threads share the fallback block; counts may then be lost
+        stats_local = &fallback;
+        return stats_local;
+    }
+    b->next = atomic_load(&blocks);
+    while (!atomic_compare_exchange_weak(&blocks, &b->next, b)) {}
+    stats_local = b;
+    return b;
+}
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t stats_get(stat_counter_t c) {
+    uint64_t sum = atomic_load_explicit(&fallback.v[c], memory_order_relaxed);
+    for (stats_block_t* b = atomic_load(&blocks); b; b = b->next) {
+        sum += atomic_load_explicit(&b->v[c], memory_order_relaxed);
+    }
+    return sum;
+}
+
+void stats_phase(const char* name) {
+    uint64_t now = stats_now_ns();
+    if (current >= 0) phases[current].ns += now - phase_start;
+    current = -1;
+    if (!name) return;
+    if (phase_count == 0) first_start = now;
+    int p = 0;
+    while (p < phase_count && strcmp(phases[p].name, name) != 0) p++;
+    if (p == phase_count) {
+        if (phase_count == MAX_PHASES) return;
+        phases[phase_count++].name = name;
+    }
+    phases[p].entries++;
+    current = p;
+    phase_start = now;
+}
+
+void stats_print_json(FILE* out, const char* tool, int status) {
+    stats_phase(NULL);
+    uint64_t wall = phase_count ? stats_now_ns() - first_start : 0;
+    fprintf(out, "{\"tool\":\"%s\",\"status\":%d,\"wall_ns\":%llu,\"phases\":{", tool, status,
+            (unsigned long long)wall);
+    for (int p = 0; p < phase_count; p++) {
+        fprintf(out, "%s\"%s\":{\"ns\":%llu,\"entries\":%llu}", p ? "," : "", phases[p].name,
+                (unsigned long long)phases[p].ns, (unsigned long long)phases[p].entries);
+    }
+    fprintf(out, "},\"counters\":{");
+    for (int c = 0; c < STAT_COUNT; c++) {
+        fprintf(out, "%s\"%s\":%llu", c ? "," : "", COUNTER_NAMES[c], (unsigned long long)stats_get((stat_counter_t)c));
+    }
+    fprintf(out, "}}\n");
+    fflush(out);
+}
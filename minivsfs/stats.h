@@ -0,0 +1,67 @@
+// Counters and phase timers behind the tools' --stats output.
+//
+// Counters are kept per thread: a thread adds to its own block with relaxed
+// loads and stores (no locked instructions, no cache line shared with other
+// threads), and stats_get sums the blocks of every thread that has counted.
+// Phases are timed with one monotonic clock read per switch, and CRCs are
+// timed on every STATS_SAMPLE-th call only. Everything stays compiled in;
+// the tools merely decide whether to print it.
+#ifndef MINIVSFS_STATS_H
+#define MINIVSFS_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_SAMPLE 256
+
+typedef enum {
+    STAT_SYSCALLS,           // I/O system calls: reads, writes, copies, clones, seeks
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_BLOCKS_ALLOCATED,   // data region blocks taken, including any a stream gives back
+    STAT_INODES_ALLOCATED,
+    STAT_BITMAP_WORDS,       // 64-bit bitmap words examined by searches and counts
+    STAT_CRC_CALLS,
+    STAT_CRC_BYTES,
+    STAT_CRC_NS,             // extrapolated from the sampled calls
+    STAT_CLONE_NS,           // copying the input image to a separate output
+    STAT_COUNT
+} stat_counter_t;
+
+typedef struct stats_block {
+    _Atomic uint64_t v[STAT_COUNT];
+    struct stats_block* next;
+} stats_block_t;
+
+extern _Thread_local stats_block_t* stats_local;
+// The calling thread's block, created on first use
+stats_block_t* stats_register(void);
+
+static inline stats_block_t* stats_self(void) {
+    return stats_local ? stats_local : stats_register();
+}
+
+// Adds n to the calling thread's counter and returns its new value
+static inline uint64_t stats_bump(stats_block_t* b, stat_counter_t c, uint64_t n) {
+    uint64_t v = atomic_load_explicit(&b->v[c], memory_order_relaxed) + n;
+    atomic_store_explicit(&b->v[c], v, memory_order_relaxed);
+    return v;
+}
+
+static inline void stats_add(stat_counter_t c, uint64_t n) {
+    stats_bump(stats_self(), c, n);
+}
+
+uint64_t stats_now_ns(void);
+// Sum over all threads
+uint64_t stats_get(stat_counter_t c);
+
+// Ends the current phase and starts name (NULL just ends it). Re-entering a
+// phase adds to its time. For the main thread only.
+void stats_phase(const char* name);
+
+// One JSON object on a single line: wall time, phases and counters
+void stats_print_json(FILE* out, const char* tool, int status);
+
+#endif